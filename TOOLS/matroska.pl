@@ -101,7 +101,9 @@ sub generate_c_definitions {
 
             # define a field for each subelement
             # also does lots of macro magic, but doesn't open a scope
-            for my $subel (values %{$el->{subelements}}) {
+            # the fields are sorted by ID, so that ebml.c can binary search
+            for my $subel (sort { hex($a->{elid}) <=> hex($b->{elid}) }
+                           values %{$el->{subelements}}) {
                 print "F($subel->{definename}, $subel->{fieldname}, ".
                     ($subel->{multiple}?'1':'0').")\n";
             }
@@ -340,7 +340,7 @@ static int control(sh_audio_t *sh, int cmd, void *arg)
     case ADCTRL_RESYNC_STREAM:
         avcodec_flush_buffers(ctx->avctx);
         ctx->output_left = 0;
-        talloc_free(ctx->packet);
+        free_demux_packet(ctx->packet);
         ctx->packet = NULL;
         return CONTROL_TRUE;
     }
@@ -398,7 +398,7 @@ static int decode_new_packet(struct sh_audio *sh)
         mpkt->pts = MP_NOPTS_VALUE; // don't reset PTS next time
     }
     if (mpkt->len == 0 || ret < 0) {
-        talloc_free(mpkt);
+        free_demux_packet(mpkt);
         priv->packet = NULL;
     }
     // LATM may need many packets to find mux info
@@ -293,7 +293,7 @@ static int decode_a_bit(sh_audio_t *sh, unsigned char *buf, int count)
             /* Do not use mpg123_feed(), added in later libmpg123 versions. */
             ret = mpg123_decode(con->handle, pkt->buffer, pkt->len, NULL, 0, NULL);
 #endif
-            talloc_free(pkt);
+            free_demux_packet(pkt);
             if (ret == MPG123_ERR)
                 break;
 
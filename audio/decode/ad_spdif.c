@@ -224,7 +224,7 @@ static int decode_audio(sh_audio_t *sh, unsigned char *buf,
         int ret = lavf_ctx->oformat->write_packet(lavf_ctx, &pkt);
         avio_flush(lavf_ctx->pb);
         sh->pts_bytes += spdif_ctx->out_buffer_len - out_len;
-        talloc_free(mpkt);
+        free_demux_packet(mpkt);
         if (ret < 0)
             break;
     }
@@ -22,12 +22,21 @@
 #include <assert.h>
 
 #include <libavutil/mem.h>
+#include <libavutil/common.h>
 
 #include "demux/codec_tags.h"
 
 #include "config.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "talloc.h"
+
 #include "mpvcore/codecs.h"
 #include "mpvcore/mp_msg.h"
+#include "mpvcore/mp_ring.h"
 #include "mpvcore/bstr.h"
 
 #include "stream/stream.h"
@@ -45,6 +54,40 @@ extern const struct ad_functions ad_mpg123;
 extern const struct ad_functions ad_lavc;
 extern const struct ad_functions ad_spdif;
 
+#if HAVE_PTHREADS
+
+// With --ad-thread, decoding and filtering is done by a separate thread, which
+// keeps filtered audio in a ringbuffer. decode_audio() then only copies the
+// data from the ringbuffer. Since the decoders read their packets themselves,
+// this is used only if the demuxer thread is running. Code that changes the
+// decoder or the filter chain from the outside must stop the thread, or pause
+// it with audio_pause_thread().
+struct ad_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;      // signals ringbuffer changes in both directions
+    struct mp_ring *ring;       // filtered audio, always whole samples
+
+    // Protected by lock
+    int unitsize;               // size of a sample in filter output format
+    int chunk;                  // minimum amount of data decoded at once
+    int pause_requests;
+    bool decoding;              // thread is decoding (lock released)
+    bool terminate;
+    int status;                 // error returned by decoding, 0 if none
+    // State corresponding to the data output so far, for decoded_audio_pts().
+    // Updated after decoding, so that it can be read while the thread is
+    // decoding the next chunk.
+    double pts;
+    double filter_delay;
+    int staged_len;             // staged.len
+
+    // Accessed by the thread, or with the lock held while not decoding
+    struct bstr staged;         // filtered data that didn't fit into the ring
+};
+
+#endif
+
 static const struct ad_functions * const ad_drivers[] = {
 #ifdef CONFIG_MPG123
     &ad_mpg123,
@@ -176,6 +219,7 @@ int init_best_audio_codec(sh_audio_t *sh_audio, char *audio_decoders)
 
 void uninit_audio(sh_audio_t *sh_audio)
 {
+    audio_stop_thread(sh_audio);
     if (sh_audio->afilter) {
         mp_msg(MSGT_DECAUDIO, MSGL_V, "Uninit audio filters...\n");
         af_destroy(sh_audio->afilter);
@@ -300,7 +344,8 @@ static int filter_n_bytes(sh_audio_t *sh, struct bstr *outbuf, int len)
  * In case of EOF/error it might or might not be.
  * Outbuf.start must be talloc-allocated, and will be reallocated
  * if needed to fit all filter output. */
-int decode_audio(sh_audio_t *sh_audio, struct bstr *outbuf, int minlen)
+static int decode_and_filter_audio(sh_audio_t *sh_audio, struct bstr *outbuf,
+                                   int minlen)
 {
     // Indicates that a filter seems to be buffering large amounts of data
     int huge_filter_buffer = 0;
@@ -349,6 +394,100 @@ int decode_audio(sh_audio_t *sh_audio, struct bstr *outbuf, int minlen)
     return 0;
 }
 
+#if HAVE_PTHREADS
+static int read_from_thread(struct ad_thread *t, struct bstr *outbuf,
+                            int minlen)
+{
+    int res = 0;
+    pthread_mutex_lock(&t->lock);
+    assert(!t->pause_requests);
+    while (minlen >= 0 && outbuf->len < minlen) {
+        int len = mp_ring_buffered(t->ring);
+        if (len > 0) {
+            // Round up to whole samples, like decoding does.
+            int missing = minlen - outbuf->len + t->unitsize - 1;
+            len = FFMIN(len, missing - missing % t->unitsize);
+            set_min_out_buffer_size(outbuf, outbuf->len + len);
+            mp_ring_read(t->ring, outbuf->start + outbuf->len, len);
+            outbuf->len += len;
+            pthread_cond_broadcast(&t->wakeup);
+        } else if (t->status < 0 && !t->staged_len) {
+            // Pass errors only after all audio before them was returned. The
+            // thread retries decoding once the error has been consumed.
+            res = t->status;
+            t->status = 0;
+            pthread_cond_broadcast(&t->wakeup);
+            break;
+        } else {
+            pthread_cond_wait(&t->wakeup, &t->lock);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    return res;
+}
+#endif
+
+int decode_audio(sh_audio_t *sh_audio, struct bstr *outbuf, int minlen)
+{
+#if HAVE_PTHREADS
+    if (sh_audio->dec_thread)
+        return read_from_thread(sh_audio->dec_thread, outbuf, minlen);
+#endif
+    return decode_and_filter_audio(sh_audio, outbuf, minlen);
+}
+
+// pts of the end of the audio passed to the filters so far.
+static double filter_input_pts(sh_audio_t *sh_audio)
+{
+    double a_pts = sh_audio->pts;
+    if (a_pts == MP_NOPTS_VALUE)
+        return MP_NOPTS_VALUE;
+
+    double bps = sh_audio->channels.num * sh_audio->samplerate *
+                 sh_audio->samplesize;
+
+    // sh_audio->pts is the timestamp of the latest input packet with
+    // known pts that the decoder has decoded. sh_audio->pts_bytes is
+    // the amount of bytes the decoder has written after that timestamp.
+    a_pts += sh_audio->pts_bytes / bps;
+
+    // Decoded but not filtered
+    a_pts -= sh_audio->a_buffer_len / bps;
+
+    return a_pts;
+}
+
+// Return the pts corresponding to the end of the data the filters have
+// output so far. *buffered_output is set to the amount of that data (in bytes
+// of filter output) not returned by decode_audio() yet, including data
+// buffered in the filters. The caller has to subtract it from the returned
+// pts, because this depends on the output rate and the playback speed.
+double decoded_audio_pts(sh_audio_t *sh_audio, double *buffered_output)
+{
+#if HAVE_PTHREADS
+    struct ad_thread *t = sh_audio->dec_thread;
+    if (t) {
+        double pts;
+        pthread_mutex_lock(&t->lock);
+        if (t->decoding) {
+            pts = t->pts;
+            *buffered_output = t->filter_delay;
+        } else {
+            pts = filter_input_pts(sh_audio);
+            *buffered_output = af_calc_delay(sh_audio->afilter);
+        }
+        *buffered_output += t->staged_len + mp_ring_buffered(t->ring);
+        pthread_mutex_unlock(&t->lock);
+        return pts;
+    }
+#endif
+    double pts = filter_input_pts(sh_audio);
+    *buffered_output = 0;
+    if (pts != MP_NOPTS_VALUE)
+        *buffered_output = af_calc_delay(sh_audio->afilter);
+    return pts;
+}
+
 void decode_audio_prepend_bytes(struct bstr *outbuf, int count, int byte)
 {
     set_min_out_buffer_size(outbuf, outbuf->len + count);
@@ -360,8 +499,168 @@ void decode_audio_prepend_bytes(struct bstr *outbuf, int count, int byte)
 
 void resync_audio_stream(sh_audio_t *sh_audio)
 {
+    // The thread is restarted by the player as needed.
+    audio_stop_thread(sh_audio);
     sh_audio->pts = MP_NOPTS_VALUE;
     if (!sh_audio->initialized)
         return;
     sh_audio->ad_driver->control(sh_audio, ADCTRL_RESYNC_STREAM, NULL);
 }
+
+#if HAVE_PTHREADS
+
+static void wait_decoder_idle(struct ad_thread *t)
+{
+    while (t->decoding)
+        pthread_cond_wait(&t->wakeup, &t->lock);
+}
+
+// Set the sample size and chunk size according to the filter output format.
+static void update_output_format(struct ad_thread *t, sh_audio_t *sh_audio)
+{
+    struct af_stream *afs = sh_audio->afilter;
+    t->unitsize = FFMAX(afs->output.nch * afs->output.bps, 1);
+    // Decode about 1/8 of the ringbuffer at once, so that the thread doesn't
+    // wake up for every few samples.
+    t->chunk = mp_ring_size(t->ring) / 8;
+    t->chunk = FFMAX(t->chunk - t->chunk % t->unitsize, t->unitsize);
+}
+
+static void *decoder_thread(void *arg)
+{
+    struct sh_audio *sh_audio = arg;
+    struct ad_thread *t = sh_audio->dec_thread;
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->terminate) {
+        if (t->staged.len) {
+            int len = FFMIN(t->staged.len, mp_ring_available(t->ring));
+            len -= len % t->unitsize;
+            if (len > 0) {
+                mp_ring_write(t->ring, t->staged.start, len);
+                t->staged.len -= len;
+                memmove(t->staged.start, t->staged.start + len, t->staged.len);
+                t->staged_len = t->staged.len;
+                pthread_cond_broadcast(&t->wakeup);
+                continue;
+            }
+        }
+        if (t->pause_requests || t->status < 0 || t->staged.len ||
+            mp_ring_available(t->ring) < t->chunk)
+        {
+            pthread_cond_wait(&t->wakeup, &t->lock);
+            continue;
+        }
+        int chunk = t->chunk;
+        t->decoding = true;
+        pthread_mutex_unlock(&t->lock);
+
+        int res = decode_and_filter_audio(sh_audio, &t->staged, chunk);
+
+        pthread_mutex_lock(&t->lock);
+        t->status = res;
+        t->pts = filter_input_pts(sh_audio);
+        t->filter_delay = af_calc_delay(sh_audio->afilter);
+        t->staged_len = t->staged.len;
+        t->decoding = false;
+        pthread_cond_broadcast(&t->wakeup);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+#endif
+
+// Decode and filter audio in a separate thread, which keeps up to buffer_secs
+// seconds of filtered audio ready. This requires the filter chain to be
+// initialized, and the demuxer thread to be running. Returns false if the
+// thread is not used.
+bool audio_start_thread(sh_audio_t *sh_audio, double buffer_secs)
+{
+#if HAVE_PTHREADS
+    assert(!sh_audio->dec_thread);
+    struct af_stream *afs = sh_audio->afilter;
+    if (!sh_audio->initialized || !afs ||
+        !demux_is_threaded(sh_audio->gsh->demuxer))
+        return false;
+
+    struct ad_thread *t = talloc_ptrtype(NULL, t);
+    *t = (struct ad_thread) {
+        .staged = { .start = talloc_new(t) },
+    };
+    double bps = afs->output.rate * afs->output.nch * afs->output.bps;
+    int size = av_clipf(buffer_secs * bps, 64 * 1024, 1 << 30);
+    size = mp_ring_round_size(size);
+    t->ring = mp_ring_new(t, size);
+    update_output_format(t, sh_audio);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wakeup, NULL);
+    sh_audio->dec_thread = t;
+    if (pthread_create(&t->thread, NULL, decoder_thread, sh_audio)) {
+        mp_tmsg(MSGT_DECAUDIO, MSGL_ERR, "Starting decoder thread failed.\n");
+        sh_audio->dec_thread = NULL;
+        pthread_cond_destroy(&t->wakeup);
+        pthread_mutex_destroy(&t->lock);
+        talloc_free(t);
+        return false;
+    }
+    mp_msg(MSGT_DECAUDIO, MSGL_V, "Started audio decoder thread (%d bytes "
+           "buffer).\n", size);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// Stop the thread. Filtered audio buffered by the thread is discarded.
+void audio_stop_thread(sh_audio_t *sh_audio)
+{
+#if HAVE_PTHREADS
+    struct ad_thread *t = sh_audio->dec_thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->terminate = true;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->wakeup);
+    pthread_mutex_destroy(&t->lock);
+    talloc_free(t);
+    sh_audio->dec_thread = NULL;
+#endif
+}
+
+// Block until the thread is outside of the decoder and the filters, and keep
+// it from entering them again until audio_unpause_thread() is called. Unlike
+// audio_stop_thread(), this keeps already filtered audio. Calls can be nested.
+// Does nothing if the thread is not used.
+void audio_pause_thread(sh_audio_t *sh_audio)
+{
+#if HAVE_PTHREADS
+    struct ad_thread *t = sh_audio ? sh_audio->dec_thread : NULL;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->pause_requests++;
+    wait_decoder_idle(t);
+    pthread_mutex_unlock(&t->lock);
+#endif
+}
+
+void audio_unpause_thread(sh_audio_t *sh_audio)
+{
+#if HAVE_PTHREADS
+    struct ad_thread *t = sh_audio ? sh_audio->dec_thread : NULL;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    assert(t->pause_requests > 0);
+    t->pause_requests--;
+    // The filter chain might have been rebuilt for a different format.
+    if (!t->pause_requests && sh_audio->afilter)
+        update_output_format(t, sh_audio);
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+#endif
+}
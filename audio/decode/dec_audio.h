@@ -19,6 +19,8 @@
 #ifndef MPLAYER_DEC_AUDIO_H
 #define MPLAYER_DEC_AUDIO_H
 
+#include <stdbool.h>
+
 #include "audio/chmap.h"
 #include "demux/stheader.h"
 
@@ -29,6 +31,7 @@ struct mp_decoder_list *mp_audio_decoder_list(void);
 int init_best_audio_codec(sh_audio_t *sh_audio, char *audio_decoders);
 int decode_audio(sh_audio_t *sh_audio, struct bstr *outbuf, int minlen);
 void decode_audio_prepend_bytes(struct bstr *outbuf, int count, int byte);
+double decoded_audio_pts(sh_audio_t *sh_audio, double *buffered_output);
 void resync_audio_stream(sh_audio_t *sh_audio);
 void skip_audio_frame(sh_audio_t *sh_audio);
 void uninit_audio(sh_audio_t *sh_audio);
@@ -37,4 +40,9 @@ int init_audio_filters(sh_audio_t *sh_audio, int in_samplerate,
                        int *out_samplerate, struct mp_chmap *out_channels,
                        int *out_format);
 
+bool audio_start_thread(sh_audio_t *sh_audio, double buffer_secs);
+void audio_stop_thread(sh_audio_t *sh_audio);
+void audio_pause_thread(sh_audio_t *sh_audio);
+void audio_unpause_thread(sh_audio_t *sh_audio);
+
 #endif /* MPLAYER_DEC_AUDIO_H */
@@ -29,10 +29,20 @@
 #include <sys/stat.h>
 
 #include "config.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "mpvcore/options.h"
 #include "mpvcore/av_common.h"
+#include "mpvcore/path.h"
+#include "mpvcore/user_cache.h"
+#include "mpvcore/mp_memory_barrier.h"
 #include "talloc.h"
 #include "mpvcore/mp_msg.h"
+#include "osdep/timer.h"
+#include "osdep/io.h"
 
 #include "stream/stream.h"
 #include "demux.h"
@@ -42,6 +52,7 @@
 #include "audio/format.h"
 
 #include <libavcodec/avcodec.h>
+#include <libavutil/md5.h>
 
 #if MP_INPUT_BUFFER_PADDING_SIZE < FF_INPUT_BUFFER_PADDING_SIZE
 #error MP_INPUT_BUFFER_PADDING_SIZE is too small!
@@ -98,10 +109,64 @@ struct demux_stream {
     int bytes;            // total bytes of packets in buffer
     struct demux_packet *head;
     struct demux_packet *tail;
+    // Data of queued packets moved out of memory (see demux_make_room())
+    FILE *spill_file;
+    int64_t spill_size;    // bytes appended to spill_file
+    int spilled_packs;     // number of queued packets with data in spill_file
+    // Copies of packets returned by demux_read_packet(), which are kept for
+    // seeking back without calling into the demuxer (--demuxer-back-buffer)
+    struct demux_packet *back_head;
+    struct demux_packet *back_tail;
+    int64_t back_bytes;
+    // demuxer thread only
+    bool active;           // packets were read from this stream by the player
+    bool reader_waiting;   // the player is blocked on this stream
+};
+
+// State for the optional demuxer thread. All fields (and the packet queues of
+// all demux_streams) are protected by the lock while the thread is running.
+struct demux_internal {
+#if HAVE_PTHREADS
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+#endif
+    bool thread_terminate;
+    int pause_requests;     // if >0, the thread must not call into the demuxer
+    bool reading;           // thread is inside demuxer->desc->fill_buffer
+    bool eof;               // last fill_buffer call returned EOF
 };
 
 static void add_stream_chapters(struct demuxer *demuxer);
 
+// The lock is a no-op if no demuxer thread is running.
+static void demux_lock(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    if (demuxer->in)
+        pthread_mutex_lock(&demuxer->in->lock);
+#endif
+}
+
+static void demux_unlock(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    if (demuxer->in)
+        pthread_mutex_unlock(&demuxer->in->lock);
+#endif
+}
+
+// Called when no queued packet references the temporary file anymore. The
+// file is closed to give the disk space back, and recreated when needed.
+static void ds_reset_spill(struct demux_stream *ds)
+{
+    if (ds->spill_file)
+        fclose(ds->spill_file);
+    ds->spill_file = NULL;
+    ds->spill_size = 0;
+    ds->spilled_packs = 0;
+}
+
 static void ds_free_packs(struct demux_stream *ds)
 {
     demux_packet_t *dp = ds->head;
@@ -111,16 +176,184 @@ static void ds_free_packs(struct demux_stream *ds)
         dp = dn;
     }
     ds->head = ds->tail = NULL;
+    dp = ds->back_head;
+    while (dp) {
+        demux_packet_t *dn = dp->next;
+        free_demux_packet(dp);
+        dp = dn;
+    }
+    ds->back_head = ds->back_tail = NULL;
+    ds->back_bytes = 0;
     ds->packs = 0; // !!!!!
     ds->bytes = 0;
     ds->eof = 0;
+    ds_reset_spill(ds);
+}
+
+// Packet payloads are allocated from per-size-class free lists, so that the
+// large number of small audio/subtitle packets doesn't constantly go through
+// malloc. Larger payloads are allocated directly. The buffers are refcounted,
+// so that demux_copy_packet() can share them. Packets are allocated by the
+// demuxer thread and freed by the decoders, so the pool is locked.
+// The packet structs themselves are recycled as well, if they're freed with
+// free_demux_packet().
+#define POOL_MIN_SIZE_LOG2 8        // smallest size class: 256 bytes
+#define POOL_NUM_CLASSES 9          // largest size class: 64 KiB
+#define POOL_MAX_FREE_BYTES (512 * 1024) // max. unused memory per size class
+#define POOL_MAX_FREE_PACKETS 1024  // max. unused packet structs
+
+struct packet_buffer {
+    int refcount;
+    int size_class;                 // -1 if not allocated from the pool
+    size_t size;                    // usable size of the data
+    struct packet_buffer *next;     // in the pool free list
+};
+
+// The data follows the header, and keeps malloc alignment.
+#define BUFFER_HEADER_SIZE ((sizeof(struct packet_buffer) + 15) & ~(size_t)15)
+#define BUFFER_DATA(b) ((unsigned char *)(b) + BUFFER_HEADER_SIZE)
+
+static struct {
+    struct packet_buffer *free[POOL_NUM_CLASSES];
+    int num_free[POOL_NUM_CLASSES];
+    struct demux_packet *free_packets;  // linked with demux_packet.next
+    int num_free_packets;
+} buffer_pool;
+
+#if HAVE_PTHREADS
+static pthread_mutex_t buffer_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+#define pool_lock() pthread_mutex_lock(&buffer_pool_lock)
+#define pool_unlock() pthread_mutex_unlock(&buffer_pool_lock)
+#else
+#define pool_lock() do {} while (0)
+#define pool_unlock() do {} while (0)
+#endif
+
+// Packet payload data copied in memory (see demux_get_copy_stats()).
+// Protected by the pool lock.
+static struct {
+    int64_t bytes;          // total
+    int64_t window_bytes;   // total at window_start
+    int64_t window_start;   // mp_time_us()
+    double speed;           // bytes/s over the last window
+} copy_stats;
+
+// Call with the pool lock held.
+static void update_copy_speed(void)
+{
+    int64_t now = mp_time_us();
+    int64_t elapsed = now - copy_stats.window_start;
+    if (!copy_stats.window_start) {
+        copy_stats.window_start = now;
+    } else if (elapsed >= 1000000) {
+        copy_stats.speed = (copy_stats.bytes - copy_stats.window_bytes) /
+                           (elapsed / 1e6);
+        copy_stats.window_bytes = copy_stats.bytes;
+        copy_stats.window_start = now;
+    }
 }
 
-static int packet_destroy(void *ptr)
+static void count_copied_bytes(size_t bytes)
+{
+    pool_lock();
+    copy_stats.bytes += bytes;
+    update_copy_speed();
+    pool_unlock();
+}
+
+void demux_get_copy_stats(struct demux_copy_stats *st)
+{
+    pool_lock();
+    update_copy_speed();
+    *st = (struct demux_copy_stats) {
+        .bytes_copied = copy_stats.bytes,
+        .speed = copy_stats.speed,
+    };
+    pool_unlock();
+}
+
+static int get_size_class(size_t size)
+{
+    for (int n = 0; n < POOL_NUM_CLASSES; n++) {
+        if (size <= ((size_t)1 << (POOL_MIN_SIZE_LOG2 + n)))
+            return n;
+    }
+    return -1;
+}
+
+// Return a buffer with at least size bytes of data and refcount 1.
+static struct packet_buffer *buffer_alloc(size_t size)
+{
+    struct packet_buffer *b = NULL;
+    int size_class = get_size_class(size);
+    if (size_class >= 0) {
+        size = (size_t)1 << (POOL_MIN_SIZE_LOG2 + size_class);
+        pool_lock();
+        b = buffer_pool.free[size_class];
+        if (b) {
+            buffer_pool.free[size_class] = b->next;
+            buffer_pool.num_free[size_class]--;
+        }
+        pool_unlock();
+    }
+    if (!b) {
+        b = malloc(BUFFER_HEADER_SIZE + size);
+        if (!b) {
+            mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
+            abort();
+        }
+    }
+    *b = (struct packet_buffer) {
+        .refcount = 1,
+        .size_class = size_class,
+        .size = size,
+    };
+    return b;
+}
+
+static struct packet_buffer *buffer_ref(struct packet_buffer *b)
+{
+    mp_atomic_add_and_fetch(&b->refcount, 1);
+    return b;
+}
+
+static int buffer_refcount(struct packet_buffer *b)
+{
+    return mp_atomic_add_and_fetch(&b->refcount, 0);
+}
+
+static void buffer_unref(struct packet_buffer *b)
+{
+    if (!b || mp_atomic_add_and_fetch(&b->refcount, -1) > 0)
+        return;
+    int size_class = b->size_class;
+    if (size_class >= 0) {
+        int max_free = POOL_MAX_FREE_BYTES >> (POOL_MIN_SIZE_LOG2 + size_class);
+        pool_lock();
+        if (buffer_pool.num_free[size_class] < max_free) {
+            b->next = buffer_pool.free[size_class];
+            buffer_pool.free[size_class] = b;
+            buffer_pool.num_free[size_class]++;
+            b = NULL;
+        }
+        pool_unlock();
+    }
+    free(b);
+}
+
+static void packet_free_data(struct demux_packet *dp)
 {
-    struct demux_packet *dp = ptr;
     talloc_free(dp->avpacket);
-    free(dp->allocation);
+    buffer_unref(dp->allocation);
+    dp->avpacket = NULL;
+    dp->allocation = NULL;
+    dp->buffer = NULL;
+    dp->mem = 0;
+}
+
+static int packet_destroy(void *ptr)
+{
+    packet_free_data(ptr);
     return 0;
 }
 
@@ -131,7 +364,16 @@ static struct demux_packet *create_packet(size_t len)
                "over 1 GB!\n");
         abort();
     }
-    struct demux_packet *dp = talloc(NULL, struct demux_packet);
+    pool_lock();
+    struct demux_packet *dp = buffer_pool.free_packets;
+    if (dp) {
+        buffer_pool.free_packets = dp->next;
+        buffer_pool.num_free_packets--;
+    }
+    pool_unlock();
+    if (!dp)
+        dp = talloc(NULL, struct demux_packet);
+    // (Recycled packets might not have had it, see demux_packet_list_fill().)
     talloc_set_destructor(dp, packet_destroy);
     *dp = (struct demux_packet) {
         .len = len,
@@ -145,13 +387,10 @@ static struct demux_packet *create_packet(size_t len)
 struct demux_packet *new_demux_packet(size_t len)
 {
     struct demux_packet *dp = create_packet(len);
-    dp->buffer = malloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
-    if (!dp->buffer) {
-        mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
-        abort();
-    }
+    struct packet_buffer *b = buffer_alloc(len + MP_INPUT_BUFFER_PADDING_SIZE);
+    dp->allocation = b;
+    dp->buffer = BUFFER_DATA(b);
     memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
-    dp->allocation = dp->buffer;
     return dp;
 }
 
@@ -167,9 +406,91 @@ struct demux_packet *new_demux_packet_from(void *data, size_t len)
 {
     struct demux_packet *dp = new_demux_packet(len);
     memcpy(dp->buffer, data, len);
+    count_copied_bytes(len);
     return dp;
 }
 
+// libavcodec requires MP_INPUT_BUFFER_PADDING_SIZE zero bytes after the data.
+static bool padding_is_zero(unsigned char *data, size_t len)
+{
+    for (int n = 0; n < MP_INPUT_BUFFER_PADDING_SIZE; n++) {
+        if (data[len + n])
+            return false;
+    }
+    return true;
+}
+
+// Allocate a refcounted buffer for size bytes of data, followed by
+// MP_INPUT_BUFFER_PADDING_SIZE zero bytes. Demuxers can read data into it
+// (see packet_buffer_data()), and create packets referencing parts of it with
+// new_demux_packet_in_buffer().
+struct packet_buffer *new_packet_buffer(size_t size)
+{
+    struct packet_buffer *b = buffer_alloc(size + MP_INPUT_BUFFER_PADDING_SIZE);
+    memset(BUFFER_DATA(b) + size, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+    return b;
+}
+
+unsigned char *packet_buffer_data(struct packet_buffer *b)
+{
+    return BUFFER_DATA(b);
+}
+
+struct packet_buffer *packet_buffer_ref(struct packet_buffer *b)
+{
+    return b ? buffer_ref(b) : NULL;
+}
+
+void packet_buffer_unref(struct packet_buffer *b)
+{
+    buffer_unref(b);
+}
+
+// Create a packet for data, which must be inside of b. The data is referenced
+// if it's followed by zeroed padding in b, and copied otherwise (e.g. if it's
+// followed by the data of the next packet). Small packets are copied too, so
+// that they don't keep a much larger buffer alive. The data must not be
+// changed while packets reference it.
+struct demux_packet *new_demux_packet_in_buffer(struct packet_buffer *b,
+                                                void *data, size_t len)
+{
+    unsigned char *start = BUFFER_DATA(b), *end = start + b->size;
+    unsigned char *p = data;
+    assert(p >= start && p + len <= end);
+    if (len < b->size / 2 || end - (p + len) < MP_INPUT_BUFFER_PADDING_SIZE ||
+        !padding_is_zero(p, len))
+        return new_demux_packet_from(data, len);
+    struct demux_packet *dp = create_packet(len);
+    dp->allocation = buffer_ref(b);
+    dp->buffer = data;
+    return dp;
+}
+
+// Create a packet with a copy of the data for each of the num parts. The
+// packets share a single buffer, in which each part is followed by zeroed
+// padding, so that a group of small packets (like the laces of a Matroska
+// block) needs only one allocation.
+void new_demux_packets_from(struct bstr *parts, int num,
+                            struct demux_packet **out)
+{
+    size_t size = 0;
+    for (int n = 0; n < num; n++)
+        size += parts[n].len + MP_INPUT_BUFFER_PADDING_SIZE;
+    struct packet_buffer *b = buffer_alloc(size);
+    unsigned char *dst = BUFFER_DATA(b);
+    for (int n = 0; n < num; n++) {
+        memcpy(dst, parts[n].start, parts[n].len);
+        memset(dst + parts[n].len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+        struct demux_packet *dp = create_packet(parts[n].len);
+        dp->allocation = buffer_ref(b);
+        dp->buffer = dst;
+        out[n] = dp;
+        dst += parts[n].len + MP_INPUT_BUFFER_PADDING_SIZE;
+    }
+    buffer_unref(b);
+    count_copied_bytes(size - num * MP_INPUT_BUFFER_PADDING_SIZE);
+}
+
 void resize_demux_packet(struct demux_packet *dp, size_t len)
 {
     if (len > 1000000000) {
@@ -177,52 +498,152 @@ void resize_demux_packet(struct demux_packet *dp, size_t len)
                "over 1 GB!\n");
         abort();
     }
-    assert(dp->allocation);
-    dp->buffer = realloc(dp->buffer, len + MP_INPUT_BUFFER_PADDING_SIZE);
-    if (!dp->buffer) {
-        mp_msg(MSGT_DEMUXER, MSGL_FATAL, "Memory allocation failure!\n");
-        abort();
+    struct packet_buffer *b = dp->allocation;
+    assert(b);
+    size_t size = len + MP_INPUT_BUFFER_PADDING_SIZE;
+    // Reallocate if the buffer is too small, or shared with other packets.
+    // (The packet might start anywhere in the buffer.)
+    size_t avail = BUFFER_DATA(b) + b->size - dp->buffer;
+    if (size > avail || buffer_refcount(b) > 1) {
+        struct packet_buffer *new = buffer_alloc(size);
+        memcpy(BUFFER_DATA(new), dp->buffer, FFMIN(dp->len, len));
+        count_copied_bytes(FFMIN(dp->len, len));
+        buffer_unref(b);
+        dp->allocation = new;
+        dp->buffer = BUFFER_DATA(new);
     }
     memset(dp->buffer + len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
     dp->len = len;
-    dp->allocation = dp->buffer;
 }
 
+// Memory kept allocated by the packet payload. A buffer referenced by several
+// packets (e.g. by demux_copy_packet()) is split between them, so that it's
+// not accounted multiple times. The value is computed on the first call and
+// stored in the packet, so that the same amount is subtracted again when the
+// packet is removed from a queue, even if the number of references changed.
+static int packet_mem(struct demux_packet *dp)
+{
+    struct packet_buffer *b = dp->allocation;
+    if (!dp->mem)
+        dp->mem = b ? b->size / buffer_refcount(b) : dp->len;
+    return dp->mem;
+}
+
+// Free the packet, and keep the struct for reuse by create_packet(). Packets
+// that have a talloc parent are freed normally.
 void free_demux_packet(struct demux_packet *dp)
 {
+    if (!dp || talloc_parent(dp)) {
+        talloc_free(dp);
+        return;
+    }
+    packet_free_data(dp);
+    talloc_free_children(dp);
+    pool_lock();
+    if (buffer_pool.num_free_packets < POOL_MAX_FREE_PACKETS) {
+        dp->next = buffer_pool.free_packets;
+        buffer_pool.free_packets = dp;
+        buffer_pool.num_free_packets++;
+        dp = NULL;
+    }
+    pool_unlock();
     talloc_free(dp);
 }
 
+// Free the unused buffers and packet structs kept by the pool. Must be called
+// only when no demuxer or decoder is active anymore (at exit).
+void demux_uninit_packet_pool(void)
+{
+    pool_lock();
+    for (int n = 0; n < POOL_NUM_CLASSES; n++) {
+        while (buffer_pool.free[n]) {
+            struct packet_buffer *b = buffer_pool.free[n];
+            buffer_pool.free[n] = b->next;
+            free(b);
+        }
+        buffer_pool.num_free[n] = 0;
+    }
+    while (buffer_pool.free_packets) {
+        struct demux_packet *dp = buffer_pool.free_packets;
+        buffer_pool.free_packets = dp->next;
+        talloc_free(dp);
+    }
+    buffer_pool.num_free_packets = 0;
+    pool_unlock();
+}
+
 static int destroy_avpacket(void *pkt)
 {
     av_free_packet(pkt);
     return 0;
 }
 
+#if HAVE_AVUTIL_REFCOUNTING
+// Return a new packet referencing the payload of src, or NULL if src is not
+// refcounted. Only the side data is copied.
+static AVPacket *ref_avpacket(AVPacket *src)
+{
+    if (!src->buf)
+        return NULL;
+    AVPacket *pkt = talloc_ptrtype(NULL, pkt);
+    *pkt = *src;
+    pkt->side_data = NULL;
+    pkt->side_data_elems = 0;
+    pkt->buf = av_buffer_ref(src->buf);
+    if (!pkt->buf)
+        abort();
+    talloc_set_destructor(pkt, destroy_avpacket);
+    for (int n = 0; n < src->side_data_elems; n++) {
+        int size = src->side_data[n].size;
+        uint8_t *data =
+            av_packet_new_side_data(pkt, src->side_data[n].type, size);
+        if (!data)
+            abort();
+        memcpy(data, src->side_data[n].data, size);
+    }
+    return pkt;
+}
+#endif
+
 struct demux_packet *demux_copy_packet(struct demux_packet *dp)
 {
     struct demux_packet *new = NULL;
-    // No av_copy_packet() in Libav
-#if LIBAVCODEC_VERSION_MICRO >= 100
     if (dp->avpacket) {
         assert(dp->buffer == dp->avpacket->data);
         assert(dp->len == dp->avpacket->size);
-        AVPacket *newavp = talloc_zero(NULL, AVPacket);
-        talloc_set_destructor(newavp, destroy_avpacket);
-        av_init_packet(newavp);
-        if (av_copy_packet(newavp, dp->avpacket) < 0)
-            abort();
-        new = new_demux_packet_fromdata(newavp->data, newavp->size);
-        new->avpacket = newavp;
-    }
+        AVPacket *newavp = NULL;
+#if HAVE_AVUTIL_REFCOUNTING
+        newavp = ref_avpacket(dp->avpacket);
+#endif
+        // No av_copy_packet() in Libav
+#if LIBAVCODEC_VERSION_MICRO >= 100
+        if (!newavp) {
+            newavp = talloc_zero(NULL, AVPacket);
+            talloc_set_destructor(newavp, destroy_avpacket);
+            av_init_packet(newavp);
+            if (av_copy_packet(newavp, dp->avpacket) < 0)
+                abort();
+            count_copied_bytes(newavp->size);
+        }
 #endif
-    if (!new) {
-        new = new_demux_packet(dp->len);
-        memcpy(new->buffer, dp->buffer, new->len);
+        if (newavp) {
+            new = new_demux_packet_fromdata(newavp->data, newavp->size);
+            new->avpacket = newavp;
+        }
     }
+    if (!new && dp->allocation) {
+        // Share the data; resize_demux_packet() copies it if needed.
+        new = create_packet(dp->len);
+        new->allocation = buffer_ref(dp->allocation);
+        new->buffer = dp->buffer;
+    }
+    if (!new)
+        new = new_demux_packet_from(dp->buffer, dp->len);
     new->pts = dp->pts;
     new->duration = dp->duration;
     new->stream_pts = dp->stream_pts;
+    new->pos = dp->pos;
+    new->keyframe = dp->keyframe;
     return new;
 }
 
@@ -309,10 +730,15 @@ static void free_sh_stream(struct sh_stream *sh)
     }
 }
 
+static void demux_stop_thread(struct demuxer *demuxer);
+static void demux_index_save(struct demuxer *demux);
+
 void free_demuxer(demuxer_t *demuxer)
 {
     if (!demuxer)
         return;
+    demux_stop_thread(demuxer);
+    demux_index_save(demuxer);
     if (demuxer->desc->close)
         demuxer->desc->close(demuxer);
     // free streams:
@@ -347,18 +773,219 @@ static int count_bytes(struct demuxer *demux, enum stream_type type)
     return c;
 }
 
+// Keyframe index for demuxers which set demuxer->generic_index. It maps the
+// pts of keyframes of one stream to the byte position of the packet, and is
+// built from the packets passing through demuxer_add_packet(). New entries
+// are added only while the file is read linearly from the last entry on, so
+// the index never has gaps.
+// Not protected by the demuxer lock: it's accessed only by the thread calling
+// demuxer_add_packet(), or while the demuxer thread is paused.
+
+#define INDEX_INTERVAL 1.0  // minimum distance between entries in seconds
+#define INDEX_CACHE_DIR "demux_index"
+#define INDEX_CACHE_HEADER "mpv-demux-index 1"
+
+struct demux_index_entry {
+    double pts;
+    int64_t pos;
+};
+
+struct demux_index {
+    struct sh_stream *stream;   // stream the keyframes are taken from
+    struct demux_index_entry *entries;
+    int num_entries;
+    int num_cached;             // entries loaded from the cache file
+    bool linear;                // reading continues after the last entry
+    bool broken;                // timestamps not monotonic; don't use index
+    char *cache_file;
+    int64_t file_size, file_mtime;
+};
+
+// The cache file is named after the hash of the absolute filename, and
+// contains the file size and mtime, which must match for the cache to be used.
+static char *get_index_cache_file(struct demuxer *demux, int64_t *size,
+                                  int64_t *mtime)
+{
+    const char *file = mp_user_cache_stream_file(demux->stream);
+    if (!mp_user_cache_stat(file, size, mtime))
+        return NULL;
+
+    void *tmp = talloc_new(NULL);
+    char *cwd = mp_getcwd(tmp);
+    char *path = mp_path_join(tmp, bstr0(cwd), bstr0(file));
+    uint8_t md5[16];
+    av_md5_sum(md5, path, strlen(path));
+    char *name = talloc_strdup(NULL, INDEX_CACHE_DIR "/");
+    for (int n = 0; n < 16; n++)
+        name = talloc_asprintf_append(name, "%02X", md5[n]);
+    talloc_free(tmp);
+    return name;
+}
+
+// Returns false if timestamps go backwards (e.g. timestamp resets).
+static bool demux_index_append(struct demux_index *index, double pts,
+                               int64_t pos)
+{
+    if (index->num_entries) {
+        struct demux_index_entry *last = &index->entries[index->num_entries - 1];
+        if (pos <= last->pos)
+            return true; // already indexed
+        if (pts < last->pts)
+            return false;
+        if (pts < last->pts + INDEX_INTERVAL)
+            return true;
+    }
+    struct demux_index_entry e = {pts, pos};
+    MP_TARRAY_APPEND(index, index->entries, index->num_entries, e);
+    return true;
+}
+
+static void demux_index_load(struct demuxer *demux)
+{
+    struct demux_index *index = demux->index;
+    if (!demux->opts->demuxer_index_cache)
+        return;
+    index->cache_file = talloc_steal(index,
+        get_index_cache_file(demux, &index->file_size, &index->file_mtime));
+    if (!index->cache_file)
+        return;
+    FILE *f = mp_user_cache_open(index->cache_file, INDEX_CACHE_HEADER);
+    if (!f)
+        return;
+    char type[16];
+    int64_t c_size, c_mtime;
+    if (fscanf(f, "%"SCNd64" %"SCNd64" %15s\n", &c_size, &c_mtime, type) != 3 ||
+        c_size != index->file_size || c_mtime != index->file_mtime ||
+        strcmp(type, stream_type_name(index->stream->type)) != 0)
+    {
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Index cache %s is outdated.\n",
+               index->cache_file);
+        goto done;
+    }
+    double pts;
+    int64_t pos;
+    while (fscanf(f, "%lf %"SCNd64"\n", &pts, &pos) == 2) {
+        if (pos < 0 || pos >= c_size || !demux_index_append(index, pts, pos))
+            break;
+    }
+    index->num_cached = index->num_entries;
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Read %d index entries from %s.\n",
+           index->num_entries, index->cache_file);
+done:
+    fclose(f);
+}
+
+static void demux_index_save(struct demuxer *demux)
+{
+    struct demux_index *index = demux->index;
+    if (!index || !index->cache_file || index->broken ||
+        index->num_entries <= index->num_cached)
+        return;
+    // Don't save the index if the file was changed while playing it.
+    int64_t size, mtime;
+    char *file = get_index_cache_file(demux, &size, &mtime);
+    bool changed = !file || size != index->file_size ||
+                   mtime != index->file_mtime;
+    talloc_free(file);
+    if (changed)
+        return;
+    struct mp_user_cache_writer *w =
+        mp_user_cache_create(index->cache_file, INDEX_CACHE_HEADER);
+    if (!w)
+        return;
+    fprintf(w->f, "%"PRId64" %"PRId64" %s\n", size, mtime,
+            stream_type_name(index->stream->type));
+    for (int n = 0; n < index->num_entries; n++) {
+        struct demux_index_entry *e = &index->entries[n];
+        fprintf(w->f, "%.6f %"PRId64"\n", e->pts, e->pos);
+    }
+    mp_user_cache_commit(w);
+}
+
+// The index uses the first selected video stream, or audio if there's none.
+static struct sh_stream *demux_index_select_stream(struct demuxer *demux)
+{
+    struct sh_stream *audio = NULL;
+    for (int n = 0; n < demux->num_streams; n++) {
+        struct sh_stream *sh = demux->streams[n];
+        if (!sh->ds->selected || sh->attached_picture)
+            continue;
+        if (sh->type == STREAM_VIDEO)
+            return sh;
+        if (sh->type == STREAM_AUDIO && !audio)
+            audio = sh;
+    }
+    return audio;
+}
+
+static void demux_index_add(struct demuxer *demux, struct sh_stream *stream,
+                            struct demux_packet *dp)
+{
+    struct demux_index *index = demux->index;
+    if (!index || index->broken)
+        return;
+    if (!index->stream) {
+        index->stream = demux_index_select_stream(demux);
+        if (!index->stream)
+            return;
+        demux_index_load(demux);
+    }
+    if (stream != index->stream || !index->linear || !dp->keyframe ||
+        dp->pts == MP_NOPTS_VALUE || dp->pos < 0)
+        return;
+    if (!demux_index_append(index, dp->pts, dp->pos)) {
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Timestamps are not monotonic, not "
+               "using the keyframe index.\n");
+        index->broken = true;
+    }
+}
+
+// Seek to the last indexed keyframe before pts (or the first one after it
+// with SEEK_FORWARD). Returns false if pts is not covered by the index.
+static bool demux_seek_index(struct demuxer *demux, double pts, int flags)
+{
+    struct demux_index *index = demux->index;
+    if (!index || index->broken || index->num_entries < 2)
+        return false;
+    struct demux_index_entry *e = index->entries;
+    int num = index->num_entries;
+    if (pts < e[0].pts || pts > e[num - 1].pts)
+        return false;
+    int lo = 0, hi = num - 1;
+    while (lo < hi) {
+        int mid = lo + (hi - lo + 1) / 2;
+        if (e[mid].pts <= pts) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if ((flags & SEEK_FORWARD) && e[lo].pts < pts && lo + 1 < num)
+        lo++;
+    int64_t pos = e[lo].pos;
+    if (demux_control(demux, DEMUXER_CTRL_SEEK_POS, &pos) != DEMUXER_CTRL_OK)
+        return false;
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Seeking to index entry %f at %"PRId64".\n",
+           e[lo].pts, e[lo].pos);
+    index->linear = true;
+    return true;
+}
+
 // Returns the same value as demuxer->fill_buffer: 1 ok, 0 EOF/not selected.
 int demuxer_add_packet(demuxer_t *demuxer, struct sh_stream *stream,
                        demux_packet_t *dp)
 {
     struct demux_stream *ds = stream ? stream->ds : NULL;
     if (!dp || !ds || !ds->selected) {
-        talloc_free(dp);
+        free_demux_packet(dp);
         return 0;
     }
 
+    demux_index_add(demuxer, stream, dp);
+
+    demux_lock(demuxer);
     ds->packs++;
-    ds->bytes += dp->len;
+    ds->bytes += packet_mem(dp);
     if (ds->tail) {
         // next packet in stream
         ds->tail->next = dp;
@@ -372,19 +999,205 @@ int demuxer_add_packet(demuxer_t *demuxer, struct sh_stream *stream,
            "[packs: A=%d V=%d S=%d]\n", stream_type_name(stream->type),
            dp->len, dp->pts, dp->pos, count_packs(demuxer, STREAM_AUDIO),
            count_packs(demuxer, STREAM_VIDEO), count_packs(demuxer, STREAM_SUB));
+    demux_unlock(demuxer);
     return 1;
 }
 
-static bool demux_check_queue_full(demuxer_t *demux)
+// How much packet data can be moved to temporary files per stream, relative
+// to the memory budget.
+#define DEMUX_MAX_SPILL 4
+
+// Memory used by the packet queues. Includes the packet struct, so that
+// lots of tiny packets are accounted for as well.
+static int64_t ds_queue_bytes(struct demux_stream *ds)
+{
+    return ds->bytes + ds->packs * (int64_t)sizeof(struct demux_packet);
+}
+
+static int64_t demux_queue_bytes(struct demuxer *demux)
+{
+    int64_t bytes = 0;
+    for (int n = 0; n < demux->num_streams; n++)
+        bytes += ds_queue_bytes(demux->streams[n]->ds);
+    return bytes;
+}
+
+static int64_t demux_queue_budget(struct demuxer *demux)
+{
+    return demux->opts->demuxer_queue_size * (int64_t)1024;
+}
+
+static bool demux_queue_full(struct demuxer *demux)
+{
+    return demux_queue_bytes(demux) >= demux_queue_budget(demux);
+}
+
+// Whether spilling the packet's data frees its memory, and the data can be
+// restored. Data shared with other packets stays
+// allocated, and libavformat side data would be lost.
+static bool packet_owns_data(struct demux_packet *dp)
+{
+    struct packet_buffer *b = dp->allocation;
+    if (b)
+        return buffer_refcount(b) == 1;
+    if (dp->avpacket && !dp->avpacket->side_data_elems) {
+#if HAVE_AVUTIL_REFCOUNTING
+        return !dp->avpacket->buf || av_buffer_is_writable(dp->avpacket->buf);
+#else
+        return true;
+#endif
+    }
+    return false;
+}
+
+// Append the data of the packets to the stream's temporary file. Returns the
+// number of packets written.
+// The file I/O is done with the lock held: demux_make_room() spills the queue
+// of a stream other than the one it reads from, so the packets and the file
+// can be accessed by another reader at the same time.
+static int ds_write_spill(struct demux_stream *ds, struct demux_packet **list,
+                          int num)
 {
+    if (!num)
+        return 0;
+    if (!ds->spill_file) {
+        ds->spill_file = tmpfile();
+        if (!ds->spill_file) {
+            mp_msg(MSGT_DEMUXER, MSGL_ERR, "Can't create temporary file for "
+                   "demuxer packets.\n");
+            return 0;
+        }
+    }
+    if (fseeko(ds->spill_file, ds->spill_size, SEEK_SET) < 0)
+        goto error;
+    for (int n = 0; n < num; n++) {
+        struct demux_packet *dp = list[n];
+        if (dp->len > 0 && fwrite(dp->buffer, dp->len, 1, ds->spill_file) < 1)
+            goto error;
+    }
+    return num;
+error:
+    mp_msg(MSGT_DEMUXER, MSGL_ERR, "Error writing demuxer packets to "
+           "temporary file.\n");
+    return 0;
+}
+
+// Read the packet data back from the temporary file. Called with the lock
+// held (see ds_write_spill()).
+static void ds_unspill_packet(struct demux_stream *ds, struct demux_packet *dp)
+{
+    struct packet_buffer *b = buffer_alloc(dp->len + MP_INPUT_BUFFER_PADDING_SIZE);
+    unsigned char *data = BUFFER_DATA(b);
+    memset(data + dp->len, 0, MP_INPUT_BUFFER_PADDING_SIZE);
+    if (dp->len > 0 && (fseeko(ds->spill_file, dp->spill_pos, SEEK_SET) < 0 ||
+                        fread(data, dp->len, 1, ds->spill_file) < 1))
+    {
+        mp_msg(MSGT_DEMUXER, MSGL_ERR, "Error reading demuxer packets from "
+               "temporary file.\n");
+        memset(data, 0, dp->len);
+    }
+    dp->allocation = b;
+    dp->buffer = data;
+    dp->spilled = false;
+    ds->bytes += packet_mem(dp);
+    if (--ds->spilled_packs == 0)
+        ds_reset_spill(ds);
+}
+
+// Spill the data of the last packets in the queue, so that at least
+// min_bytes are freed. Returns the number of bytes freed. Called with the
+// lock held.
+static int64_t ds_spill_packets(struct demuxer *demux, struct demux_stream *ds,
+                                int64_t min_bytes)
+{
+    // Keep the packets which will be read first in memory.
+    int64_t keep = ds->bytes - min_bytes;
+    struct demux_packet *dp = ds->head;
+    for (; dp && keep > 0; dp = dp->next) {
+        if (!dp->spilled)
+            keep -= packet_mem(dp);
+    }
+    struct demux_packet **list = NULL;
+    int num = 0;
+    int64_t size = ds->spill_size;
+    int64_t max_size = demux_queue_budget(demux) * DEMUX_MAX_SPILL;
+    for (; dp; dp = dp->next) {
+        if (dp->spilled || !packet_owns_data(dp))
+            continue;
+        if (size + dp->len > max_size)
+            break;
+        MP_TARRAY_APPEND(NULL, list, num, dp);
+        size += dp->len;
+    }
+
+    int written = ds_write_spill(ds, list, num);
+
+    int64_t freed = 0;
+    for (int n = 0; n < written; n++) {
+        dp = list[n];
+        dp->spilled = true;
+        dp->spill_pos = ds->spill_size;
+        ds->spill_size += dp->len;
+        ds->spilled_packs++;
+        ds->bytes -= packet_mem(dp);
+        freed += packet_mem(dp);
+        packet_free_data(dp);
+    }
+    talloc_free(list);
+    return freed;
+}
+
+// Called if the packet queues use up the memory budget, but the stream want
+// has no packets queued. Instead of signaling EOF (which would stop playback
+// of badly interleaved files), move the data of packets queued on another
+// stream to a temporary file: streams the player doesn't read from first,
+// otherwise the stream that exceeds its fair share of the budget by the
+// largest amount (i.e. which is furthest ahead). The data is read back when
+// the packets are returned by demux_read_packet().
+// Returns false if no memory could be freed.
+static bool demux_make_room(struct demuxer *demux, struct demux_stream *want)
+{
+    int64_t budget = demux_queue_budget(demux);
+    int selected = 0;
+    for (int n = 0; n < demux->num_streams; n++)
+        selected += !!demux->streams[n]->ds->selected;
+    int64_t fair_share = budget / MPMAX(selected, 1);
+
+    struct sh_stream *victim = NULL;
+    int64_t victim_excess = 0;
     for (int n = 0; n < demux->num_streams; n++) {
         struct sh_stream *sh = demux->streams[n];
-        if (sh->ds->packs > MAX_PACKS || sh->ds->bytes > MAX_PACK_BYTES)
-            goto overflow;
+        struct demux_stream *ds = sh->ds;
+        if (ds == want || ds->bytes <= 0)
+            continue;
+        int64_t excess = ds_queue_bytes(ds) - fair_share;
+        // ds->active is only maintained if the demuxer thread is used.
+        if (demux->in && !ds->active)
+            excess += budget;
+        if (!victim || excess > victim_excess) {
+            victim = sh;
+            victim_excess = excess;
+        }
     }
-    return false;
 
-overflow:
+    // Free a bit more than needed, so that this doesn't happen on every
+    // packet read.
+    int64_t min_bytes = demux_queue_bytes(demux) - budget / 8 * 7;
+    int64_t freed = 0;
+    if (victim)
+        freed = ds_spill_packets(demux, victim->ds, min_bytes);
+
+    if (freed) {
+        if (!demux->warned_queue_spill) {
+            mp_tmsg(MSGT_DEMUXER, MSGL_WARN, "\nThe demuxer packet queue is "
+                    "full. Moving packets to a temporary file. The file is "
+                    "probably badly interleaved.\n");
+        }
+        demux->warned_queue_spill = true;
+        mp_msg(MSGT_DEMUXER, MSGL_V, "Moved %"PRId64" bytes of the %s stream "
+               "to a temporary file.\n", freed, stream_type_name(victim->type));
+        return true;
+    }
 
     if (!demux->warned_queue_overflow) {
         mp_tmsg(MSGT_DEMUXER, MSGL_ERR, "\nToo many packets in the demuxer "
@@ -397,7 +1210,7 @@ overflow:
                 "interleaved stream/file or the codec failed?\n");
     }
     demux->warned_queue_overflow = true;
-    return true;
+    return false;
 }
 
 // return value:
@@ -409,12 +1222,44 @@ static int demux_fill_buffer(demuxer_t *demux)
     return demux->desc->fill_buffer ? demux->desc->fill_buffer(demux) : 0;
 }
 
+// Threaded variant of ds_get_packets(): wait until the demuxer thread has
+// queued a packet for this stream. Called with the lock held.
+static void ds_wait_packets(struct sh_stream *sh)
+{
+#if HAVE_PTHREADS
+    struct demux_stream *ds = sh->ds;
+    demuxer_t *demux = sh->demuxer;
+    struct demux_internal *in = demux->in;
+    ds->active = true;
+    while (!ds->head) {
+        if (!ds->selected || in->eof ||
+            (demux_queue_full(demux) && !demux_make_room(demux, ds)))
+        {
+            mp_msg(MSGT_DEMUXER, MSGL_V, "ds_get_packets: EOF reached "
+                   "(stream: %s)\n", stream_type_name(sh->type));
+            ds->eof = 1;
+            break;
+        }
+        ds->reader_waiting = true;
+        pthread_cond_broadcast(&in->wakeup);
+        pthread_cond_wait(&in->wakeup, &in->lock);
+    }
+    ds->reader_waiting = false;
+    if (ds->head)
+        ds->eof = 0;
+#endif
+}
+
 static void ds_get_packets(struct sh_stream *sh)
 {
     struct demux_stream *ds = sh->ds;
     demuxer_t *demux = sh->demuxer;
     mp_dbg(MSGT_DEMUXER, MSGL_DBG3, "ds_get_packets (%s) called\n",
            stream_type_name(sh->type));
+    if (demux->in) {
+        ds_wait_packets(sh);
+        return;
+    }
     while (1) {
         if (ds->head) {
             /* The code below can set ds->eof to 1 when another stream runs
@@ -428,7 +1273,7 @@ static void ds_get_packets(struct sh_stream *sh)
             return;
         }
 
-        if (demux_check_queue_full(demux))
+        if (demux_queue_full(demux) && !demux_make_room(demux, ds))
             break;
 
         if (!demux_fill_buffer(demux))
@@ -439,30 +1284,189 @@ static void ds_get_packets(struct sh_stream *sh)
     ds->eof = 1;
 }
 
+static int64_t demux_back_budget(struct demuxer *demux)
+{
+    return demux->opts->demuxer_back_buffer * (int64_t)1024;
+}
+
+// Drop the oldest packets from the back-buffers until they fit into the
+// budget.
+static void demux_trim_back_buffer(struct demuxer *demux)
+{
+    int64_t bytes = 0;
+    for (int n = 0; n < demux->num_streams; n++)
+        bytes += demux->streams[n]->ds->back_bytes;
+    while (bytes > demux_back_budget(demux)) {
+        struct demux_stream *oldest = NULL;
+        for (int n = 0; n < demux->num_streams; n++) {
+            struct demux_stream *ds = demux->streams[n]->ds;
+            if (ds->back_head && (!oldest ||
+                                  ds->back_head->pts < oldest->back_head->pts))
+                oldest = ds;
+        }
+        if (!oldest)
+            break;
+        struct demux_packet *dp = oldest->back_head;
+        oldest->back_head = dp->next;
+        if (!oldest->back_head)
+            oldest->back_tail = NULL;
+        int64_t size = packet_mem(dp) + sizeof(struct demux_packet);
+        oldest->back_bytes -= size;
+        bytes -= size;
+        free_demux_packet(dp);
+    }
+}
+
+// Remember a packet returned to the player. Called with the lock held.
+static void ds_add_back_packet(struct demuxer *demux, struct demux_stream *ds,
+                               struct demux_packet *dp)
+{
+    struct demux_packet *copy = demux_copy_packet(dp);
+    if (ds->back_tail) {
+        ds->back_tail->next = copy;
+    } else {
+        ds->back_head = copy;
+    }
+    ds->back_tail = copy;
+    ds->back_bytes += packet_mem(copy) + sizeof(struct demux_packet);
+    demux_trim_back_buffer(demux);
+}
+
+// Return the last packet in the back-buffer with pts <= pts (and which is a
+// keyframe, if keyframe is set), or NULL.
+static struct demux_packet *ds_find_back_packet(struct demux_stream *ds,
+                                                double pts, bool keyframe)
+{
+    struct demux_packet *found = NULL;
+    for (struct demux_packet *dp = ds->back_head; dp; dp = dp->next) {
+        if (dp->pts == MP_NOPTS_VALUE || (keyframe && !dp->keyframe))
+            continue;
+        if (dp->pts > pts)
+            break;
+        found = dp;
+    }
+    return found;
+}
+
+// Put the packets starting with dp (which is in the back-buffer) back into
+// the packet queue, so that they're returned again by demux_read_packet().
+static void ds_requeue_back_packets(struct demux_stream *ds,
+                                    struct demux_packet *dp)
+{
+    struct demux_packet *prev = NULL;
+    for (struct demux_packet *cur = ds->back_head; cur != dp; cur = cur->next)
+        prev = cur;
+    for (struct demux_packet *cur = dp; cur; cur = cur->next) {
+        ds->back_bytes -= packet_mem(cur) + sizeof(struct demux_packet);
+        ds->bytes += packet_mem(cur);
+        ds->packs++;
+    }
+    ds->back_tail->next = ds->head;
+    if (!ds->head)
+        ds->tail = ds->back_tail;
+    ds->head = dp;
+    ds->back_tail = prev;
+    if (prev) {
+        prev->next = NULL;
+    } else {
+        ds->back_head = NULL;
+    }
+    ds->eof = 0;
+}
+
+// Try to seek to the given pts by replaying packets from the back-buffers.
+// This works if all selected audio and video streams still have packets
+// from before the keyframe preceding the target. Called with the lock held.
+static bool demux_seek_back_buffer(struct demuxer *demux, double pts)
+{
+    // The stream that determines where decoding has to start.
+    struct sh_stream *main_sh = NULL;
+    for (int n = 0; n < demux->num_streams; n++) {
+        struct sh_stream *sh = demux->streams[n];
+        if (!sh->ds->selected)
+            continue;
+        if (sh->type == STREAM_VIDEO || (sh->type == STREAM_AUDIO && !main_sh))
+            main_sh = sh;
+    }
+    if (!main_sh)
+        return false;
+    struct demux_stream *main_ds = main_sh->ds;
+    // Targets beyond the packets returned so far aren't handled.
+    struct demux_packet *last = main_ds->head ? main_ds->head : main_ds->back_tail;
+    if (!last || last->pts == MP_NOPTS_VALUE || pts > last->pts)
+        return false;
+    struct demux_packet *main_dp = ds_find_back_packet(main_ds, pts, true);
+    if (!main_dp)
+        return false;
+    double start_pts = main_dp->pts;
+
+    // Check first whether all streams can be handled, then requeue.
+    for (int pass = 0; pass < 2; pass++) {
+        for (int n = 0; n < demux->num_streams; n++) {
+            struct sh_stream *sh = demux->streams[n];
+            struct demux_stream *ds = sh->ds;
+            struct demux_packet *start;
+            if (!ds->selected)
+                continue;
+            if (ds == main_ds) {
+                start = main_dp;
+            } else if (sh->type == STREAM_SUB) {
+                // Subtitles are sparse; take what is there after the start.
+                start = ds->back_head;
+                while (start && (start->pts == MP_NOPTS_VALUE ||
+                                 start->pts < start_pts))
+                    start = start->next;
+            } else {
+                start = ds_find_back_packet(ds, start_pts, true);
+                if (!start)
+                    return false;
+            }
+            if (pass == 1 && start)
+                ds_requeue_back_packets(ds, start);
+        }
+    }
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Seeking to %f using the back-buffer "
+           "(starting at %f).\n", pts, start_pts);
+    return true;
+}
+
 // Read a packet from the given stream. The returned packet belongs to the
 // caller, who has to free it with talloc_free(). Might block. Returns NULL
 // on EOF.
+// With the demuxer thread, this only blocks if the thread didn't manage to
+// read ahead far enough.
 struct demux_packet *demux_read_packet(struct sh_stream *sh)
 {
     struct demux_stream *ds = sh ? sh->ds : NULL;
+    struct demux_packet *pkt = NULL;
     if (ds) {
+        demux_lock(sh->demuxer);
         ds_get_packets(sh);
-        struct demux_packet *pkt = ds->head;
+        pkt = ds->head;
         if (pkt) {
+            if (pkt->spilled)
+                ds_unspill_packet(ds, pkt);
             ds->head = pkt->next;
             pkt->next = NULL;
             if (!ds->head)
                 ds->tail = NULL;
-            ds->bytes -= pkt->len;
+            ds->bytes -= packet_mem(pkt);
             ds->packs--;
 
             if (pkt->stream_pts != MP_NOPTS_VALUE)
                 sh->demuxer->stream_pts = pkt->stream_pts;
 
-            return pkt;
+            if (demux_back_budget(sh->demuxer) > 0)
+                ds_add_back_packet(sh->demuxer, ds, pkt);
         }
+#if HAVE_PTHREADS
+        // wakeup the demuxer thread, possibly make it read more data ahead
+        if (sh->demuxer->in)
+            pthread_cond_broadcast(&sh->demuxer->in->wakeup);
+#endif
+        demux_unlock(sh->demuxer);
     }
-    return NULL;
+    return pkt;
 }
 
 // Return the pts of the next packet that demux_read_packet() would return.
@@ -470,18 +1474,29 @@ struct demux_packet *demux_read_packet(struct sh_stream *sh)
 // packets from the queue.
 double demux_get_next_pts(struct sh_stream *sh)
 {
-    if (sh && sh->ds->selected) {
-        ds_get_packets(sh);
-        if (sh->ds->head)
-            return sh->ds->head->pts;
+    double pts = MP_NOPTS_VALUE;
+    if (sh) {
+        demux_lock(sh->demuxer);
+        if (sh->ds->selected) {
+            ds_get_packets(sh);
+            if (sh->ds->head)
+                pts = sh->ds->head->pts;
+        }
+        demux_unlock(sh->demuxer);
     }
-    return MP_NOPTS_VALUE;
+    return pts;
 }
 
 // Return whether a packet is queued. Never blocks, never forces any reads.
 bool demux_has_packet(struct sh_stream *sh)
 {
-    return sh && sh->ds->head;
+    bool has_packet = false;
+    if (sh) {
+        demux_lock(sh->demuxer);
+        has_packet = sh->ds->head;
+        demux_unlock(sh->demuxer);
+    }
+    return has_packet;
 }
 
 // Same as demux_has_packet, but to be called internally by demuxers, as
@@ -494,7 +1509,158 @@ bool demuxer_stream_has_packets_queued(struct demuxer *d, struct sh_stream *stre
 // Return whether EOF was returned with an earlier packet read.
 bool demux_stream_eof(struct sh_stream *sh)
 {
-    return !sh || sh->ds->eof;
+    bool eof = true;
+    if (sh) {
+        demux_lock(sh->demuxer);
+        eof = sh->ds->eof;
+        demux_unlock(sh->demuxer);
+    }
+    return eof;
+}
+
+#if HAVE_PTHREADS
+
+// Whether the demuxer thread should read more packets. Called with the lock.
+static bool demux_thread_wants_packets(struct demuxer *demux)
+{
+    struct demux_internal *in = demux->in;
+    if (in->eof || in->pause_requests)
+        return false;
+    bool active = false, read_more = false;
+    int packs = 0, bytes = 0;
+    for (int n = 0; n < demux->num_streams; n++) {
+        struct demux_stream *ds = demux->streams[n]->ds;
+        if (ds->selected && ds->active) {
+            active = true;
+            read_more |= ds->reader_waiting;
+            packs += ds->packs;
+            bytes += ds->bytes;
+        }
+    }
+    if (demux_queue_full(demux))
+        return false;
+    // Read ahead only if the player actually reads from the demuxer.
+    // Otherwise, we could end up reading the whole file for nothing.
+    if (active && packs < DEMUX_READAHEAD_PACKS && bytes < DEMUX_READAHEAD_BYTES)
+        read_more = true;
+    return read_more;
+}
+
+static void *demux_thread(void *pctx)
+{
+    struct demuxer *demux = pctx;
+    struct demux_internal *in = demux->in;
+    pthread_mutex_lock(&in->lock);
+    while (!in->thread_terminate) {
+        if (!demux_thread_wants_packets(demux)) {
+            pthread_cond_wait(&in->wakeup, &in->lock);
+            continue;
+        }
+        in->reading = true;
+        pthread_mutex_unlock(&in->lock);
+        bool eof = !demux_fill_buffer(demux);
+        pthread_mutex_lock(&in->lock);
+        in->reading = false;
+        in->eof = eof;
+        pthread_cond_broadcast(&in->wakeup);
+    }
+    pthread_mutex_unlock(&in->lock);
+    return NULL;
+}
+
+#endif
+
+// Start a thread, which reads packets from the demuxer into the packet queues
+// ahead of time. This makes demux_read_packet() return without calling into
+// the demuxer implementation in the common case. Everything that accesses the
+// demuxer implementation or its stream from outside of demux.c must be
+// enclosed in demux_pause()/demux_unpause() while the thread is running.
+void demux_start_thread(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    if (demuxer->in || !demuxer->desc->fill_buffer)
+        return;
+    // These are controlled directly by the player or the stream layer, and
+    // bypass the demuxer API.
+    if (demuxer->type == DEMUXER_TYPE_TV || stream_manages_timeline(demuxer->stream))
+        return;
+    switch (demuxer->stream->uncached_type) {
+    case STREAMTYPE_RADIO:
+    case STREAMTYPE_DVB:
+    case STREAMTYPE_PVR:
+    case STREAMTYPE_TV:
+        return;
+    }
+    struct demux_internal *in = talloc_zero(demuxer, struct demux_internal);
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->wakeup, NULL);
+    demuxer->in = in;
+    if (pthread_create(&in->thread, NULL, demux_thread, demuxer)) {
+        mp_msg(MSGT_DEMUXER, MSGL_ERR, "Starting demuxer thread failed.\n");
+        demuxer->in = NULL;
+        pthread_mutex_destroy(&in->lock);
+        pthread_cond_destroy(&in->wakeup);
+        talloc_free(in);
+        return;
+    }
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Started demuxer thread.\n");
+#endif
+}
+
+static void demux_stop_thread(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    struct demux_internal *in = demuxer->in;
+    if (!in)
+        return;
+    pthread_mutex_lock(&in->lock);
+    in->thread_terminate = true;
+    pthread_cond_broadcast(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->wakeup);
+    demuxer->in = NULL;
+    talloc_free(in);
+#endif
+}
+
+// Block until the demuxer thread is outside of the demuxer implementation,
+// and keep it from entering it again until demux_unpause() is called. Calls
+// can be nested. Does nothing if the demuxer thread is not used.
+void demux_pause(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    struct demux_internal *in = demuxer ? demuxer->in : NULL;
+    if (!in)
+        return;
+    pthread_mutex_lock(&in->lock);
+    in->pause_requests++;
+    while (in->reading)
+        pthread_cond_wait(&in->wakeup, &in->lock);
+    pthread_mutex_unlock(&in->lock);
+#endif
+}
+
+void demux_unpause(struct demuxer *demuxer)
+{
+#if HAVE_PTHREADS
+    struct demux_internal *in = demuxer ? demuxer->in : NULL;
+    if (!in)
+        return;
+    pthread_mutex_lock(&in->lock);
+    assert(in->pause_requests > 0);
+    in->pause_requests--;
+    pthread_cond_broadcast(&in->wakeup);
+    pthread_mutex_unlock(&in->lock);
+#endif
+}
+
+// Whether the demuxer thread is running. In this case, demux_read_packet()
+// can be called from other threads as well.
+bool demux_is_threaded(struct demuxer *demuxer)
+{
+    return demuxer->in;
 }
 
 // ====================================================================
@@ -550,7 +1716,11 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
     mp_msg(MSGT_DEMUXER, MSGL_V, "Trying demuxer: %s (force-level: %s)\n",
            desc->name, d_level(check));
 
+    int64_t probe_start = mp_time_us();
     int ret = demuxer->desc->open(demuxer, check);
+    mp_msg(MSGT_DEMUXER, MSGL_V, "Demuxer %s %s after %.3f ms.\n", desc->name,
+           ret >= 0 ? "opened the file" : "failed",
+           (mp_time_us() - probe_start) / 1000.0);
     if (ret >= 0) {
         demuxer->params = NULL;
         if (demuxer->filetype)
@@ -565,6 +1735,12 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
             // Doesn't work, because stream_pts is a "guess".
             demuxer->accurate_seek = false;
         }
+        if (demuxer->generic_index && demuxer->seekable &&
+            !stream_manages_timeline(demuxer->stream))
+        {
+            demuxer->index = talloc_zero(demuxer, struct demux_index);
+            demuxer->index->linear = true;
+        }
         add_stream_chapters(demuxer);
         demuxer_sort_chapters(demuxer);
         demux_info_update(demuxer);
@@ -575,6 +1751,76 @@ static struct demuxer *open_given_type(struct MPOpts *opts,
     return NULL;
 }
 
+// Signatures of common file formats. When probing (not with forced or
+// requested demuxers), a file matching a signature is opened only with the
+// demuxers listed for it, or with libavformat. This avoids letting text based
+// demuxers parse binary files. A signature can have several entries.
+static const struct demux_signature {
+    int offset;
+    const char *magic;
+    int len;
+    const char *demuxer;    // NULL: libavformat only
+} demux_signatures[] = {
+    {0, "\x1A\x45\xDF\xA3",    4,  "mkv"},
+    {0, "mplayer EDL file",     16, "edl"},
+    {0, "\x8aMNG\r\n\x1a\n",     8,  "mng"},
+    {0, "#EXTM3U",              7,  "playlist"},
+    {0, "[Reference]",          11, "playlist"},
+    {0, "RTSPtext",             8,  "playlist"},
+    // subreader handles SSA too (and is the only choice without libass)
+    {0, "[Script Info]",        13, "libass"},
+    {0, "[Script Info]",        13, "subreader"},
+    {0, "RIFF",                 4},
+    {4, "ftyp",                 4},
+    {0, "OggS",                 4},
+    {0, "fLaC",                 4},
+    {0, "ID3",                  3},
+    {0, "FLV\x01",              4},
+    {0, ".RMF",                 4},
+    {0, "FORM",                 4},
+    {0, "\x00\x00\x01\xBA",      4},
+    {0, "\x30\x26\xB2\x75\x8E\x66\xCF\x11", 8}, // ASF
+};
+
+// Demuxers which can't open files without one of their signatures.
+static const char *const signature_only_demuxers[] = {
+    "mkv", "edl", "mng", NULL
+};
+
+struct probe_signatures {
+    bool matched[MP_ARRAY_SIZE(demux_signatures)];
+    bool any;
+};
+
+static void match_signatures(struct probe_signatures *res, bstr data)
+{
+    *res = (struct probe_signatures){0};
+    bstr_eatstart0(&data, "\xEF\xBB\xBF"); // UTF-8 BOM
+    for (int n = 0; n < MP_ARRAY_SIZE(demux_signatures); n++) {
+        const struct demux_signature *sig = &demux_signatures[n];
+        if (data.len >= sig->offset + sig->len &&
+            memcmp(data.start + sig->offset, sig->magic, sig->len) == 0)
+        {
+            res->matched[n] = res->any = true;
+        }
+    }
+}
+
+static bool demuxer_is_plausible(const struct demuxer_desc *desc,
+                                 struct probe_signatures *sigs)
+{
+    for (int n = 0; n < MP_ARRAY_SIZE(demux_signatures); n++) {
+        const char *name = demux_signatures[n].demuxer;
+        if (sigs->matched[n] && name && strcmp(name, desc->name) == 0)
+            return true;
+    }
+    for (int n = 0; signature_only_demuxers[n]; n++) {
+        if (strcmp(signature_only_demuxers[n], desc->name) == 0)
+            return false;
+    }
+    return !sigs->any || desc == &demuxer_desc_lavf;
+}
+
 static const int d_normal[]  = {DEMUX_CHECK_NORMAL, DEMUX_CHECK_UNSAFE, -1};
 static const int d_request[] = {DEMUX_CHECK_REQUEST, -1};
 static const int d_force[]   = {DEMUX_CHECK_FORCE, -1};
@@ -607,13 +1853,20 @@ struct demuxer *demux_open(struct stream *stream, char *force_format,
 
     // Peek this much data to avoid that stream_read() run by some demuxers
     // or stream filters will flush previous peeked data.
-    stream_peek(stream, STREAM_BUFFER_SIZE);
+    bstr probe_data = stream_peek(stream, STREAM_BUFFER_SIZE);
+    struct probe_signatures sigs;
+    match_signatures(&sigs, probe_data);
 
     // Test demuxers from first to last, one pass for each check_levels[] entry
     for (int pass = 0; check_levels[pass] != -1; pass++) {
         enum demux_check level = check_levels[pass];
         for (int n = 0; demuxer_list[n]; n++) {
             const struct demuxer_desc *desc = demuxer_list[n];
+            if (!check_desc && !demuxer_is_plausible(desc, &sigs)) {
+                mp_msg(MSGT_DEMUXER, MSGL_DBG2, "Skipping demuxer %s (file "
+                       "signature doesn't match).\n", desc->name);
+                continue;
+            }
             if (!check_desc || desc == check_desc) {
                 struct demuxer *demuxer = open_given_type(opts, desc, stream,
                                                           params, level);
@@ -628,9 +1881,15 @@ struct demuxer *demux_open(struct stream *stream, char *force_format,
 
 void demux_flush(demuxer_t *demuxer)
 {
+    demux_pause(demuxer);
+    demux_lock(demuxer);
     for (int n = 0; n < demuxer->num_streams; n++)
         ds_free_packs(demuxer->streams[n]->ds);
     demuxer->warned_queue_overflow = false;
+    if (demuxer->in)
+        demuxer->in->eof = false;
+    demux_unlock(demuxer);
+    demux_unpause(demuxer);
 }
 
 int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
@@ -643,9 +1902,29 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
     if (rel_seek_secs == MP_NOPTS_VALUE && (flags & SEEK_ABSOLUTE))
         return 0;
 
+    demux_pause(demuxer);
+
+    if ((flags & SEEK_ABSOLUTE) && !(flags & SEEK_FACTOR) &&
+        demux_back_budget(demuxer) > 0 &&
+        !stream_manages_timeline(demuxer->stream))
+    {
+        demux_lock(demuxer);
+        bool ok = demux_seek_back_buffer(demuxer, rel_seek_secs);
+        demux_unlock(demuxer);
+        if (ok)
+            goto done;
+    }
+
     // clear demux buffers:
     demux_flush(demuxer);
 
+    if (demuxer->index) {
+        demuxer->index->linear = false;
+        if ((flags & SEEK_ABSOLUTE) && !(flags & SEEK_FACTOR) &&
+            demux_seek_index(demuxer, rel_seek_secs, flags))
+            goto done;
+    }
+
     /* HACK: assume any demuxer used with these streams can cope with
      * the stream layer suddenly seeking to a different position under it
      * (nothing actually implements DEMUXER_CTRL_RESYNC now).
@@ -674,7 +1953,7 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
         if (stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_TIME, &pts)
             != STREAM_UNSUPPORTED) {
             demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
-            return 1;
+            goto done;
         }
     }
 
@@ -682,6 +1961,8 @@ int demux_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
     if (demuxer->desc->seek)
         demuxer->desc->seek(demuxer, rel_seek_secs, flags);
 
+  done:
+    demux_unpause(demuxer);
     return 1;
 }
 
@@ -769,6 +2050,7 @@ char *demux_info_get(demuxer_t *demuxer, const char *opt)
 
 void demux_info_update(struct demuxer *demuxer)
 {
+    demux_pause(demuxer);
     demux_control(demuxer, DEMUXER_CTRL_UPDATE_INFO, NULL);
     // Take care of stream metadata as well
     char **meta;
@@ -777,15 +2059,30 @@ void demux_info_update(struct demuxer *demuxer)
             demux_info_add(demuxer, meta[n + 0], meta[n + 1]);
         talloc_free(meta);
     }
+    demux_unpause(demuxer);
 }
 
 int demux_control(demuxer_t *demuxer, int cmd, void *arg)
 {
+    int r = DEMUXER_CTRL_NOTIMPL;
 
-    if (demuxer->desc->control)
-        return demuxer->desc->control(demuxer, cmd, arg);
+    if (demuxer->desc->control) {
+        demux_pause(demuxer);
+        r = demuxer->desc->control(demuxer, cmd, arg);
+        demux_unpause(demuxer);
+    }
 
-    return DEMUXER_CTRL_NOTIMPL;
+    return r;
+}
+
+// Same as stream_control() on demuxer->stream, but safe to call while the
+// demuxer thread is running.
+int demux_stream_control(struct demuxer *demuxer, int cmd, void *arg)
+{
+    demux_pause(demuxer);
+    int r = stream_control(demuxer->stream, cmd, arg);
+    demux_unpause(demuxer);
+    return r;
 }
 
 struct sh_stream *demuxer_stream_by_demuxer_id(struct demuxer *d,
@@ -816,9 +2113,16 @@ void demuxer_select_track(struct demuxer *demuxer, struct sh_stream *stream,
 {
     // don't flush buffers if stream is already selected / unselected
     if (stream->ds->selected != selected) {
+        demux_pause(demuxer);
+        demux_lock(demuxer);
         stream->ds->selected = selected;
+        stream->ds->active = false;
         ds_free_packs(stream->ds);
+        if (demuxer->in)
+            demuxer->in->eof = false;
+        demux_unlock(demuxer);
         demux_control(demuxer, DEMUXER_CTRL_SWITCHED_TRACKS, NULL);
+        demux_unpause(demuxer);
     }
 }
 
@@ -904,7 +2208,7 @@ static void add_stream_chapters(struct demuxer *demuxer)
     int num_chapters = demuxer_chapter_count(demuxer);
     for (int n = 0; n < num_chapters; n++) {
         double p = n;
-        if (stream_control(demuxer->stream, STREAM_CTRL_GET_CHAPTER_TIME, &p)
+        if (demux_stream_control(demuxer, STREAM_CTRL_GET_CHAPTER_TIME, &p)
                 != STREAM_OK)
             return;
         demuxer_add_chapter(demuxer, bstr0(""), p * 1e9, 0, 0);
@@ -924,14 +2228,17 @@ int demuxer_seek_chapter(demuxer_t *demuxer, int chapter, double *seek_pts)
 {
     int ris = STREAM_UNSUPPORTED;
 
+    demux_pause(demuxer);
     if (demuxer->num_chapters == 0)
         ris = stream_control(demuxer->stream, STREAM_CTRL_SEEK_TO_CHAPTER,
                              &chapter);
-
     if (ris != STREAM_UNSUPPORTED) {
         demux_flush(demuxer);
         demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    }
+    demux_unpause(demuxer);
 
+    if (ris != STREAM_UNSUPPORTED) {
         // exit status may be ok, but main() doesn't have to seek itself
         // (because e.g. dvds depend on sectors, not on pts)
         *seek_pts = -1.0;
@@ -953,7 +2260,7 @@ int demuxer_get_current_chapter(demuxer_t *demuxer, double time_now)
 {
     int chapter = -2;
     if (!demuxer->num_chapters || !demuxer->chapters) {
-        if (stream_control(demuxer->stream, STREAM_CTRL_GET_CURRENT_CHAPTER,
+        if (demux_stream_control(demuxer, STREAM_CTRL_GET_CURRENT_CHAPTER,
                            &chapter) == STREAM_UNSUPPORTED)
             chapter = -2;
     } else {
@@ -989,7 +2296,7 @@ int demuxer_chapter_count(demuxer_t *demuxer)
 {
     if (!demuxer->num_chapters || !demuxer->chapters) {
         int num_chapters = 0;
-        if (stream_control(demuxer->stream, STREAM_CTRL_GET_NUM_CHAPTERS,
+        if (demux_stream_control(demuxer, STREAM_CTRL_GET_NUM_CHAPTERS,
                            &num_chapters) == STREAM_UNSUPPORTED)
             num_chapters = 0;
         return num_chapters;
@@ -1000,7 +2307,7 @@ int demuxer_chapter_count(demuxer_t *demuxer)
 double demuxer_get_time_length(struct demuxer *demuxer)
 {
     double len;
-    if (stream_control(demuxer->stream, STREAM_CTRL_GET_TIME_LENGTH, &len) > 0)
+    if (demux_stream_control(demuxer, STREAM_CTRL_GET_TIME_LENGTH, &len) > 0)
         return len;
     // <= 0 means DEMUXER_CTRL_NOTIMPL or DEMUXER_CTRL_DONTKNOW
     if (demux_control(demuxer, DEMUXER_CTRL_GET_TIME_LENGTH, &len) > 0)
@@ -1011,7 +2318,7 @@ double demuxer_get_time_length(struct demuxer *demuxer)
 double demuxer_get_start_time(struct demuxer *demuxer)
 {
     double time;
-    if (stream_control(demuxer->stream, STREAM_CTRL_GET_START_TIME, &time) > 0)
+    if (demux_stream_control(demuxer, STREAM_CTRL_GET_START_TIME, &time) > 0)
         return time;
     if (demux_control(demuxer, DEMUXER_CTRL_GET_START_TIME, &time) > 0)
         return time;
@@ -1022,7 +2329,7 @@ int demuxer_angles_count(demuxer_t *demuxer)
 {
     int ris, angles = -1;
 
-    ris = stream_control(demuxer->stream, STREAM_CTRL_GET_NUM_ANGLES, &angles);
+    ris = demux_stream_control(demuxer, STREAM_CTRL_GET_NUM_ANGLES, &angles);
     if (ris == STREAM_UNSUPPORTED)
         return -1;
     return angles;
@@ -1031,7 +2338,7 @@ int demuxer_angles_count(demuxer_t *demuxer)
 int demuxer_get_current_angle(demuxer_t *demuxer)
 {
     int ris, curr_angle = -1;
-    ris = stream_control(demuxer->stream, STREAM_CTRL_GET_ANGLE, &curr_angle);
+    ris = demux_stream_control(demuxer, STREAM_CTRL_GET_ANGLE, &curr_angle);
     if (ris == STREAM_UNSUPPORTED)
         return -1;
     return curr_angle;
@@ -1046,15 +2353,15 @@ int demuxer_set_angle(demuxer_t *demuxer, int angle)
     if ((angles < 1) || (angle > angles))
         return -1;
 
+    demux_pause(demuxer);
     demux_flush(demuxer);
 
     ris = stream_control(demuxer->stream, STREAM_CTRL_SET_ANGLE, &angle);
-    if (ris == STREAM_UNSUPPORTED)
-        return -1;
-
-    demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    if (ris != STREAM_UNSUPPORTED)
+        demux_control(demuxer, DEMUXER_CTRL_RESYNC, NULL);
+    demux_unpause(demuxer);
 
-    return angle;
+    return ris == STREAM_UNSUPPORTED ? -1 : angle;
 }
 
 static int packet_sort_compare(const void *p1, const void *p2)
@@ -1117,8 +2424,13 @@ struct demux_packet *demux_packet_list_fill(struct demux_packet **pkts,
         *current = 0;
     if (*current >= num_pkts)
         return NULL;
+    // The new packet references the data owned by pkts[*current].
     struct demux_packet *new = talloc(NULL, struct demux_packet);
     *new = *pkts[*current];
+    new->next = NULL;
+    new->allocation = NULL;
+    new->avpacket = NULL;
+    new->mem = 0;
     *current += 1;
     return new;
 }
@@ -32,8 +32,9 @@
 
 struct MPOpts;
 
-#define MAX_PACKS 4096
-#define MAX_PACK_BYTES 0x8000000  // 128 MiB
+// How far the demuxer thread reads ahead (summed over the active streams)
+#define DEMUX_READAHEAD_PACKS 200
+#define DEMUX_READAHEAD_BYTES (8 * 1024 * 1024)
 
 enum demuxer_type {
     DEMUXER_TYPE_GENERIC = 0,
@@ -64,6 +65,9 @@ enum demux_ctrl {
     DEMUXER_CTRL_RESYNC,
     DEMUXER_CTRL_SWITCH_VIDEO,
     DEMUXER_CTRL_IDENTIFY_PROGRAM,
+    DEMUXER_CTRL_PREFETCH,      // double *time: a seek to time is coming up
+    DEMUXER_CTRL_SEEK_POS,      // int64_t *pos: seek to a packet's byte position
+    DEMUXER_CTRL_START_INDEXING, // file is being played; may index it in background
 };
 
 #define SEEK_ABSOLUTE (1 << 0)
@@ -94,6 +98,8 @@ enum demux_check {
 #define MAX_SH_STREAMS 256
 
 struct demuxer;
+struct demux_internal;
+struct demux_index;
 
 /**
  * Demuxer description structure
@@ -154,6 +160,7 @@ struct demuxer_params {
     unsigned char (*matroska_wanted_uids)[16];
     int matroska_wanted_segment;
     bool *matroska_was_valid;
+    unsigned char *matroska_found_uid; // 16 bytes, set if the segment has one
     struct ass_library *ass_library;
 };
 
@@ -175,6 +182,11 @@ typedef struct demuxer {
     bool ts_resets_possible;
     enum timestamp_type timestamp_type;
     bool warned_queue_overflow;
+    bool warned_queue_spill;
+    // Set by the demuxer on opening if seeking benefits from a keyframe index
+    // built from the demuxed packets (requires DEMUXER_CTRL_SEEK_POS).
+    bool generic_index;
+    struct demux_index *index;
 
     struct sh_stream **streams;
     int num_streams;
@@ -201,6 +213,8 @@ typedef struct demuxer {
     void *priv;   // demuxer-specific internal data
     struct MPOpts *opts;
     struct demuxer_params *params;
+
+    struct demux_internal *in; // demuxer thread state (NULL if not running)
 } demuxer_t;
 
 typedef struct {
@@ -208,14 +222,32 @@ typedef struct {
     int aid, vid, sid; //audio, video and subtitle id
 } demux_program_t;
 
+struct packet_buffer;
+
 struct demux_packet *new_demux_packet(size_t len);
 // data must already have suitable padding
 struct demux_packet *new_demux_packet_fromdata(void *data, size_t len);
 struct demux_packet *new_demux_packet_from(void *data, size_t len);
+struct packet_buffer *new_packet_buffer(size_t size);
+unsigned char *packet_buffer_data(struct packet_buffer *b);
+struct packet_buffer *packet_buffer_ref(struct packet_buffer *b);
+void packet_buffer_unref(struct packet_buffer *b);
+struct demux_packet *new_demux_packet_in_buffer(struct packet_buffer *b,
+                                                void *data, size_t len);
+void new_demux_packets_from(struct bstr *parts, int num,
+                            struct demux_packet **out);
 void resize_demux_packet(struct demux_packet *dp, size_t len);
 void free_demux_packet(struct demux_packet *dp);
+void demux_uninit_packet_pool(void);
 struct demux_packet *demux_copy_packet(struct demux_packet *dp);
 
+struct demux_copy_stats {
+    int64_t bytes_copied;   // packet payload bytes copied in memory
+    double speed;           // bytes/s copied during the last second
+};
+
+void demux_get_copy_stats(struct demux_copy_stats *st);
+
 #ifndef SIZE_MAX
 #define SIZE_MAX ((size_t)-1)
 #endif
@@ -235,6 +267,11 @@ struct sh_stream *new_sh_stream(struct demuxer *demuxer, enum stream_type type);
 struct demuxer *demux_open(struct stream *stream, char *force_format,
                            struct demuxer_params *params, struct MPOpts *opts);
 
+void demux_start_thread(struct demuxer *demuxer);
+void demux_pause(struct demuxer *demuxer);
+void demux_unpause(struct demuxer *demuxer);
+bool demux_is_threaded(struct demuxer *demuxer);
+
 void demux_flush(struct demuxer *demuxer);
 int demux_seek(struct demuxer *demuxer, float rel_seek_secs, int flags);
 
@@ -246,6 +283,7 @@ int demux_info_print(struct demuxer *demuxer);
 void demux_info_update(struct demuxer *demuxer);
 
 int demux_control(struct demuxer *demuxer, int cmd, void *arg);
+int demux_stream_control(struct demuxer *demuxer, int cmd, void *arg);
 
 void demuxer_switch_track(struct demuxer *demuxer, enum stream_type type,
                           struct sh_stream *stream);
@@ -705,6 +705,17 @@ static int demux_open_lavf(demuxer_t *demuxer, enum demux_check check)
 #endif
     demuxer->accurate_seek = !priv->seek_by_bytes;
 
+    // Formats like MPEG-TS have no index, and libavformat seeks by bisection
+    // or by reading the file up to the target. Formats with AVFMT_GENERIC_INDEX
+    // get an index built by libavformat, but only for the part already read.
+    bool has_index = false;
+    for (int n = 0; n < avfc->nb_streams; n++)
+        has_index |= avfc->streams[n]->nb_index_entries > 0;
+    demuxer->generic_index = !priv->seek_by_bytes &&
+        !avfc->iformat->read_seek2 &&
+        !(priv->avif->flags & AVFMT_NO_BYTE_SEEK) &&
+        (!has_index || (priv->avif->flags & AVFMT_GENERIC_INDEX));
+
     return 0;
 }
 
@@ -818,7 +829,7 @@ static int demux_lavf_fill_buffer(demuxer_t *demux)
         if (pkt->convergence_duration > 0)
             dp->duration = pkt->convergence_duration * av_q2d(st->time_base);
     }
-    dp->pos = demux->filepos;
+    dp->pos = pkt->pos >= 0 ? pkt->pos : demux->filepos;
     dp->keyframe = pkt->flags & AV_PKT_FLAG_KEY;
     // Use only one stream for stream_pts, otherwise PTS might be jumpy.
     if (stream->type == STREAM_VIDEO) {
@@ -1024,6 +1035,13 @@ redo:
         seek_reset(demuxer);
         avio_flush(priv->avfc->pb);
         return DEMUXER_CTRL_OK;
+    case DEMUXER_CTRL_SEEK_POS:
+        if (priv->avif->flags & AVFMT_NO_BYTE_SEEK)
+            return DEMUXER_CTRL_NOTIMPL;
+        seek_reset(demuxer);
+        if (av_seek_frame(priv->avfc, -1, *(int64_t *)arg, AVSEEK_FLAG_BYTE) < 0)
+            return DEMUXER_CTRL_DONTKNOW;
+        return DEMUXER_CTRL_OK;
     default:
         return DEMUXER_CTRL_NOTIMPL;
     }
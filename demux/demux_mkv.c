@@ -41,6 +41,11 @@
 #include <zlib.h>
 #endif
 
+#if HAVE_PTHREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "talloc.h"
 #include "mpvcore/options.h"
 #include "mpvcore/bstr.h"
@@ -52,6 +57,8 @@
 #include "codec_tags.h"
 
 #include "mpvcore/mp_msg.h"
+#include "mpvcore/user_cache.h"
+#include "osdep/io.h"
 
 static const unsigned char sipr_swaps[38][2] = {
     {0,63},{1,22},{2,44},{3,90},{5,81},{7,31},{8,86},{9,58},{10,36},{12,68},
@@ -177,6 +184,18 @@ typedef struct mkv_demuxer {
     bool index_complete;
     uint64_t deferred_cues;
 
+    // --demuxer-mkv-index-cache (only set for files without cues)
+    char *index_cache_file;
+    int index_cache_entries;        // number of entries read from the cache
+
+    // --demuxer-mkv-index-thread
+    struct index_thread *index_thread;
+    int64_t first_cluster;
+
+    // Cluster data read ahead by read_next_block() (see fill_cluster_chunk())
+    struct packet_buffer *chunk;
+    bstr chunk_data;                // not yet parsed part of the chunk
+
     int64_t *parsed_pos;
     int num_parsed_pos;
     bool parsed_info;
@@ -196,6 +215,19 @@ typedef struct mkv_demuxer {
 #define RAPROPERTIES4_SIZE 56
 #define RAPROPERTIES5_SIZE 70
 
+// Maximum amount of data requested with DEMUXER_CTRL_PREFETCH.
+#define PREFETCH_MAX_BYTES (4 * 1024 * 1024)
+
+// Amount of cluster data read at once (unless a block is larger).
+#define CLUSTER_CHUNK_SIZE (256 * 1024)
+
+// Readable bytes required after the data of a block. Block data read into
+// memory is followed by this many zero bytes (see new_packet_buffer()).
+#define BLOCK_PADDING MP_INPUT_BUFFER_PADDING_SIZE
+#if AV_LZO_INPUT_PADDING > MP_INPUT_BUFFER_PADDING_SIZE
+#error AV_LZO_INPUT_PADDING is too large!
+#endif
+
 // Maximum number of subtitle packets that are accepted for pre-roll.
 // (Subtitle packets added before first A/V keyframe packet is found with seek.)
 #define NUM_SUB_PREROLL_PACKETS 500
@@ -383,6 +415,10 @@ static int demux_mkv_read_info(demuxer_t *demuxer)
         } else {
             memcpy(demuxer->matroska_data.segment_uid, info.segment_uid.start,
                    len);
+            if (demuxer->params && demuxer->params->matroska_found_uid) {
+                memcpy(demuxer->params->matroska_found_uid,
+                       info.segment_uid.start, len);
+            }
             mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] | + segment uid");
             for (int i = 0; i < len; i++)
                 mp_msg(MSGT_DEMUX, MSGL_V, " %02x",
@@ -1678,11 +1714,108 @@ static int demux_mkv_open_sub(demuxer_t *demuxer, mkv_track_t *track)
     return 0;
 }
 
+static void stop_index_thread(struct demuxer *demuxer);
+static void merge_background_index(struct demuxer *demuxer);
+
+#define INDEX_CACHE_DIR "mkv_index"
+#define INDEX_CACHE_HEADER "mpv-mkv-index 1"
+
+// The index created with index_block() for files without cues can be stored
+// in a cache file, so that seeking in the file is fast if it's played again.
+// The cache file is named after the segment UID, and contains the file size,
+// mtime and timecode scale, which all must match for the cache to be used.
+static bool get_file_identity(struct demuxer *demuxer, int64_t *size,
+                              int64_t *mtime)
+{
+    const char *path = mp_user_cache_stream_file(demuxer->stream);
+    return mp_user_cache_stat(path, size, mtime);
+}
+
+static char *get_index_cache_file(struct demuxer *demuxer)
+{
+    unsigned char *uid = demuxer->matroska_data.segment_uid;
+    char name[sizeof(INDEX_CACHE_DIR) + 33] = INDEX_CACHE_DIR "/";
+    bool have_uid = false;
+    for (int n = 0; n < 16; n++) {
+        snprintf(name + strlen(name), 3, "%02x", uid[n]);
+        have_uid |= uid[n];
+    }
+    return have_uid ? talloc_strdup(NULL, name) : NULL;
+}
+
+static void load_index_cache(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    int64_t size, mtime;
+    if (!demuxer->opts->mkv_index_cache || mkv_d->parsed_cues ||
+        mkv_d->deferred_cues || mkv_d->index_complete ||
+        !get_file_identity(demuxer, &size, &mtime))
+        return;
+    mkv_d->index_cache_file = talloc_steal(mkv_d, get_index_cache_file(demuxer));
+    if (!mkv_d->index_cache_file)
+        return;
+    FILE *f = mp_user_cache_open(mkv_d->index_cache_file, INDEX_CACHE_HEADER);
+    if (!f)
+        return;
+    int64_t c_size, c_mtime;
+    uint64_t c_tc_scale;
+    if (fscanf(f, "%"SCNd64" %"SCNd64" %"SCNu64"\n", &c_size, &c_mtime,
+               &c_tc_scale) != 3 ||
+        c_size != size || c_mtime != mtime || c_tc_scale != mkv_d->tc_scale)
+    {
+        mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Index cache %s is outdated.\n",
+               mkv_d->index_cache_file);
+        goto done;
+    }
+    int tnum;
+    uint64_t timecode, filepos;
+    while (fscanf(f, "%d %"SCNu64" %"SCNu64"\n", &tnum, &timecode,
+                  &filepos) == 3)
+    {
+        if (filepos >= size)
+            break;
+        for (int n = 0; n < mkv_d->num_tracks; n++) {
+            if (mkv_d->tracks[n]->tnum == tnum)
+                add_block_position(demuxer, mkv_d->tracks[n], filepos, timecode);
+        }
+    }
+    mkv_d->index_cache_entries = mkv_d->num_indexes;
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Read %d index entries from %s.\n",
+           mkv_d->num_indexes, mkv_d->index_cache_file);
+done:
+    fclose(f);
+}
+
+static void save_index_cache(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    int64_t size, mtime;
+    if (!mkv_d->index_cache_file || mkv_d->index_complete ||
+        mkv_d->num_indexes <= mkv_d->index_cache_entries ||
+        !get_file_identity(demuxer, &size, &mtime))
+        return;
+    struct mp_user_cache_writer *w =
+        mp_user_cache_create(mkv_d->index_cache_file, INDEX_CACHE_HEADER);
+    if (!w)
+        return;
+    fprintf(w->f, "%"PRId64" %"PRId64" %"PRIu64"\n", size, mtime,
+            mkv_d->tc_scale);
+    for (int n = 0; n < mkv_d->num_indexes; n++) {
+        mkv_index_t *index = &mkv_d->indexes[n];
+        fprintf(w->f, "%d %"PRIu64" %"PRIu64"\n", index->tnum, index->timecode,
+                index->filepos);
+    }
+    mp_user_cache_commit(w);
+}
+
 static void mkv_free(struct demuxer *demuxer)
 {
     struct mkv_demuxer *mkv_d = demuxer->priv;
     if (!mkv_d)
         return;
+    stop_index_thread(demuxer);
+    save_index_cache(demuxer);
+    packet_buffer_unref(mkv_d->chunk);
     for (int i = 0; i < mkv_d->num_tracks; i++)
         demux_mkv_free_trackentry(mkv_d->tracks[i]);
     free(mkv_d->indexes);
@@ -1796,6 +1929,7 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
             mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] |+ found cluster, headers are "
                    "parsed completely :)\n");
             stream_seek(s, stream_tell(s) - 4);
+            mkv_d->first_cluster = stream_tell(s);
             break;
         }
         int res = read_header_element(demuxer, id, 0);
@@ -1813,6 +1947,7 @@ static int demux_mkv_open(demuxer_t *demuxer, enum demux_check check)
         demuxer->movi_start = s->start_pos;
         demuxer->movi_end = s->end_pos;
         demuxer->seekable = 1;
+        load_index_cache(demuxer);
     }
 
     return 0;
@@ -2192,14 +2327,14 @@ struct block_info {
     uint64_t timecode;
     mkv_track_t *track;
     bstr data;
-    void *alloc;
+    struct packet_buffer *buffer; // data points into it
 };
 
 static void free_block(struct block_info *block)
 {
-    free(block->alloc);
-    block->alloc = NULL;
     block->data = (bstr){0};
+    packet_buffer_unref(block->buffer);
+    block->buffer = NULL;
 }
 
 static void index_block(demuxer_t *demuxer, struct block_info *block)
@@ -2211,35 +2346,20 @@ static void index_block(demuxer_t *demuxer, struct block_info *block)
     }
 }
 
-static int read_block(demuxer_t *demuxer, struct block_info *block)
+// Parse the header of the Block element. block->data is the element contents.
+static int parse_block_header(demuxer_t *demuxer, struct block_info *block)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
-    stream_t *s = demuxer->stream;
     uint64_t num;
     int16_t time;
-    uint64_t length;
-    int res = -1;
-
-    free_block(block);
-    length = ebml_read_length(s, NULL);
-    if (length > 500000000)
-        goto exit;
-    block->alloc = malloc(length + AV_LZO_INPUT_PADDING);
-    if (!block->alloc)
-        goto exit;
-    block->data = (bstr){block->alloc, length};
-    demuxer->filepos = stream_tell(s);
-    if (stream_read(s, block->data.start, block->data.len) != block->data.len)
-        goto exit;
 
-    // Parse header of the Block element
     /* first byte(s): track num */
     num = ebml_read_vlen_uint(&block->data);
     if (num == EBML_UINT_INVALID)
-        goto exit;
+        return -1;
     /* time (relative to cluster time) */
     if (block->data.len < 3)
-        goto exit;
+        return -1;
     time = block->data.start[0] << 8 | block->data.start[1];
     block->data.start += 2;
     block->data.len -= 2;
@@ -2252,18 +2372,39 @@ static int read_block(demuxer_t *demuxer, struct block_info *block)
             break;
         }
     }
-    if (!block->track) {
-        res = 0;
+    return block->track ? 1 : 0;
+}
+
+static int read_block(demuxer_t *demuxer, struct block_info *block)
+{
+    stream_t *s = demuxer->stream;
+    uint64_t length;
+    int res = -1;
+
+    free_block(block);
+    length = ebml_read_length(s, NULL);
+    if (length > 500000000)
+        goto exit;
+    demuxer->filepos = stream_tell(s);
+    block->buffer = new_packet_buffer(length);
+    block->data = (bstr){packet_buffer_data(block->buffer), length};
+    int len = stream_read(s, block->data.start, block->data.len);
+    if (len != block->data.len)
         goto exit;
-    }
 
-    res = 1;
+    res = parse_block_header(demuxer, block);
 exit:
     if (res <= 0)
         free_block(block);
     return res;
 }
 
+// Whether data points into the block (and wasn't allocated by decoding).
+static bool bstr_in_block(bstr block, bstr data)
+{
+    return data.start >= block.start && data.start <= block.start + block.len;
+}
+
 static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
@@ -2320,6 +2461,10 @@ static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
         mkv_d->last_pts = current_pts;
         mkv_d->last_filepos = demuxer->filepos;
 
+        // Decoded laces, and their index in the block.
+        bstr lace_data[MAX_NUM_LACES];
+        int lace_index[MAX_NUM_LACES];
+        int num_lace_data = 0;
         for (int i = 0; i < laces; i++) {
             bstr block = bstr_splice(data, 0, lace_size[i]);
             if (stream->type == STREAM_VIDEO && track->realmedia)
@@ -2330,23 +2475,42 @@ static int handle_block(demuxer_t *demuxer, struct block_info *block_info)
                 bstr buffer = demux_mkv_decode(track, block, 1);
                 mkv_parse_packet(track, &buffer);
                 if (buffer.start) {
-                    demux_packet_t *dp =
-                        new_demux_packet_from(buffer.start, buffer.len);
-                    if (buffer.start != block.start)
-                        talloc_free(buffer.start);
-                    dp->keyframe = keyframe;
-                    /* If default_duration is 0, assume no pts value is known
-                     * for packets after the first one (rather than all pts
-                     * values being the same) */
-                    if (i == 0 || track->default_duration)
-                        dp->pts = mkv_d->last_pts + i * track->default_duration;
-                    dp->duration = block_duration / 1e9;
-                    demuxer_add_packet(demuxer, stream, dp);
+                    lace_data[num_lace_data] = buffer;
+                    lace_index[num_lace_data] = i;
+                    num_lace_data++;
                 }
             }
             data = bstr_cut(data, lace_size[i]);
         }
 
+        demux_packet_t *packets[MAX_NUM_LACES];
+        bstr block_data = block_info->data;
+        if (num_lace_data == 1 && bstr_in_block(block_data, lace_data[0])) {
+            // Reference the block data directly if possible.
+            packets[0] = new_demux_packet_in_buffer(block_info->buffer,
+                                                    lace_data[0].start,
+                                                    lace_data[0].len);
+        } else if (num_lace_data) {
+            // Laces other than the last are followed by the next lace instead
+            // of zero padding, so copy all laces into one buffer at once.
+            new_demux_packets_from(lace_data, num_lace_data, packets);
+        }
+        for (int n = 0; n < num_lace_data; n++) {
+            bstr buffer = lace_data[n];
+            if (!bstr_in_block(block_data, buffer))
+                talloc_free(buffer.start);
+            int i = lace_index[n];
+            demux_packet_t *dp = packets[n];
+            dp->keyframe = keyframe;
+            /* If default_duration is 0, assume no pts value is known
+             * for packets after the first one (rather than all pts
+             * values being the same) */
+            if (i == 0 || track->default_duration)
+                dp->pts = mkv_d->last_pts + i * track->default_duration;
+            dp->duration = block_duration / 1e9;
+            demuxer_add_packet(demuxer, stream, dp);
+        }
+
         if (stream->type == STREAM_VIDEO) {
             mkv_d->v_skip_to_keyframe = 0;
             mkv_d->skip_to_timecode = 0;
@@ -2406,13 +2570,174 @@ error:
     return -1;
 }
 
+// Cluster data is read in chunks of up to CLUSTER_CHUNK_SIZE bytes, and the
+// elements are parsed from memory, instead of reading each element header
+// and block separately from the stream. The stream position is at the end of
+// the chunk, so drop_cluster_chunk() must be called before using the stream
+// for anything else. Packets can reference the chunk.
+// Only used with seekable streams, because dropping the chunk seeks back.
+
+static int64_t mkv_tell(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    return stream_tell(demuxer->stream) - mkv_d->chunk_data.len;
+}
+
+static void drop_cluster_chunk(demuxer_t *demuxer)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    if (mkv_d->chunk_data.len)
+        stream_seek(demuxer->stream, mkv_tell(demuxer));
+    packet_buffer_unref(mkv_d->chunk);
+    mkv_d->chunk = NULL;
+    mkv_d->chunk_data = (bstr){0};
+}
+
+// Try to make sure at least min_len bytes of the current cluster are in the
+// chunk. Returns false if not enough data is available.
+static bool fill_cluster_chunk(demuxer_t *demuxer, int64_t min_len)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    stream_t *s = demuxer->stream;
+    bstr old = mkv_d->chunk_data;
+    if (old.len >= min_len)
+        return true;
+
+    int64_t pos = stream_tell(s);
+    int64_t end = s->end_pos ? s->end_pos : INT64_MAX;
+    if (mkv_d->cluster_end != EBML_UINT_INVALID)
+        end = FFMIN(end, mkv_d->cluster_end);
+    int64_t len = FFMIN(FFMAX(min_len, CLUSTER_CHUNK_SIZE) - old.len, end - pos);
+    if (len <= 0)
+        return false;
+
+    struct packet_buffer *buf = new_packet_buffer(old.len + len);
+    unsigned char *start = packet_buffer_data(buf);
+    if (old.len)
+        memcpy(start, old.start, old.len);
+    int read = stream_read(s, start + old.len, len);
+    memset(start + old.len + read, 0, BLOCK_PADDING);
+    packet_buffer_unref(mkv_d->chunk);
+    mkv_d->chunk = buf;
+    mkv_d->chunk_data = (bstr){start, old.len + read};
+    return mkv_d->chunk_data.len >= min_len;
+}
+
+// data is the Block element contents at file position pos in the chunk.
+static int read_block_from_chunk(demuxer_t *demuxer, struct block_info *block,
+                                 bstr data, int64_t pos)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+    free_block(block);
+    demuxer->filepos = pos;
+    block->data = data;
+    block->buffer = packet_buffer_ref(mkv_d->chunk);
+    int res = parse_block_header(demuxer, block);
+    if (res <= 0)
+        free_block(block);
+    return res;
+}
+
+// Read the next element of the current cluster from the chunk.
+// Returns 1 if a block was read, 0 if the element was skipped, -1 if the
+// element can't be parsed from memory (nothing was read in this case), and
+// -2 on errors.
+static int read_element_from_chunk(demuxer_t *demuxer, struct block_info *block)
+{
+    mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
+
+    // Element ID and length take at most 12 bytes.
+    fill_cluster_chunk(demuxer, 12);
+    bstr data = mkv_d->chunk_data;
+    uint32_t id = ebml_read_vlen_id(&data);
+    uint64_t length = ebml_read_vlen_uint(&data);
+    int header_len = mkv_d->chunk_data.len - data.len;
+    // (length > 500000000 includes EBML_UINT_INVALID, i.e. unknown length)
+    if (id == EBML_ID_INVALID || id == MATROSKA_ID_CLUSTER ||
+        length > 500000000 || !fill_cluster_chunk(demuxer, header_len + length))
+    {
+        drop_cluster_chunk(demuxer);
+        return -1;
+    }
+    int64_t pos = mkv_tell(demuxer) + header_len;
+    data = bstr_splice(mkv_d->chunk_data, header_len, header_len + length);
+    mkv_d->chunk_data = bstr_cut(mkv_d->chunk_data, header_len + length);
+
+    switch (id) {
+    case MATROSKA_ID_TIMECODE: {
+        uint64_t num = ebml_parse_bstr_uint(data);
+        if (num == EBML_UINT_INVALID)
+            goto error;
+        mkv_d->cluster_tc = num * mkv_d->tc_scale;
+        return 0;
+    }
+
+    case MATROSKA_ID_SIMPLEBLOCK:
+        *block = (struct block_info){ .simple = true };
+        if (read_block_from_chunk(demuxer, block, data, pos) < 0)
+            goto error;
+        return block->data.start ? 1 : 0;
+
+    case MATROSKA_ID_BLOCKGROUP: {
+        *block = (struct block_info){ .keyframe = true };
+        bstr group = data;
+        while (group.len) {
+            uint32_t child_id = ebml_read_vlen_id(&group);
+            uint64_t child_len = ebml_read_vlen_uint(&group);
+            if (child_id == EBML_ID_INVALID || child_len > group.len)
+                goto error;
+            int64_t child_pos = pos + (group.start - data.start);
+            bstr child = bstr_splice(group, 0, child_len);
+            group = bstr_cut(group, child_len);
+            switch (child_id) {
+            case MATROSKA_ID_BLOCKDURATION:
+                block->duration = ebml_parse_bstr_uint(child);
+                if (block->duration == EBML_UINT_INVALID)
+                    goto error;
+                block->duration *= mkv_d->tc_scale;
+                break;
+            case MATROSKA_ID_BLOCK:
+                if (read_block_from_chunk(demuxer, block, child, child_pos) < 0)
+                    goto error;
+                break;
+            case MATROSKA_ID_REFERENCEBLOCK: {
+                int64_t num = ebml_parse_bstr_int(child);
+                if (num == EBML_INT_INVALID)
+                    goto error;
+                if (num)
+                    block->keyframe = false;
+                break;
+            }
+            }
+        }
+        return block->data.start ? 1 : 0;
+    }
+    }
+    return 0;
+
+error:
+    free_block(block);
+    drop_cluster_chunk(demuxer);
+    return -2;
+}
+
 static int read_next_block(demuxer_t *demuxer, struct block_info *block)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
     stream_t *s = demuxer->stream;
 
     while (1) {
-        while (stream_tell(s) < mkv_d->cluster_end) {
+        while (mkv_tell(demuxer) < mkv_d->cluster_end) {
+            if (demuxer->seekable) {
+                int res = read_element_from_chunk(demuxer, block);
+                if (res > 0)
+                    return 1;
+                if (res == 0)
+                    continue;
+                if (res < -1)
+                    goto find_next_cluster;
+                // res == -1: parse the element directly from the stream
+            }
             int64_t start_filepos = stream_tell(s);
             switch (ebml_read_id(s, NULL)) {
             case MATROSKA_ID_TIMECODE: {
@@ -2512,6 +2837,180 @@ static mkv_index_t *get_highest_index_entry(struct demuxer *demuxer)
     return index;
 }
 
+#if HAVE_PTHREADS
+
+// For files without cues, the index can be built by a separate thread, which
+// reads the file from the start with its own stream. The demuxer takes over
+// the index entries found so far when it needs the index for seeking.
+struct index_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // Private to the thread
+    struct demuxer *demuxer;        // shadow demuxer (with own stream)
+    uint64_t *last_timecode;        // per track in mkv_d->tracks
+    // Protected by lock
+    bool terminate;
+    mkv_index_t *indexes;
+    int num_indexes;
+    int num_merged;                 // entries already added to the real index
+};
+
+static void *index_thread(void *arg)
+{
+    struct index_thread *t = arg;
+    struct demuxer *demuxer = t->demuxer;
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Building index in background.\n");
+    for (;;) {
+        pthread_mutex_lock(&t->lock);
+        bool terminate = t->terminate;
+        pthread_mutex_unlock(&t->lock);
+        if (terminate)
+            break;
+        struct block_info block;
+        int res = read_next_block(demuxer, &block);
+        if (res < 0)
+            break;
+        if (res > 0 && block.keyframe) {
+            uint64_t timecode = block.timecode / mkv_d->tc_scale;
+            int n = 0;
+            while (mkv_d->tracks[n] != block.track)
+                n++;
+            if (t->last_timecode[n] == EBML_UINT_INVALID ||
+                timecode > t->last_timecode[n])
+            {
+                t->last_timecode[n] = timecode;
+                mkv_index_t index = {
+                    .tnum = block.track->tnum,
+                    .timecode = timecode,
+                    .filepos = mkv_d->cluster_start,
+                };
+                pthread_mutex_lock(&t->lock);
+                MP_TARRAY_APPEND(t, t->indexes, t->num_indexes, index);
+                pthread_mutex_unlock(&t->lock);
+            }
+        }
+        if (res > 0)
+            free_block(&block);
+    }
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] Background indexing stopped at %"
+           PRId64".\n", stream_tell(demuxer->stream));
+    return NULL;
+}
+
+static int start_index_thread(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    stream_t *s = demuxer->stream;
+    if (mkv_d->index_thread)
+        return DEMUXER_CTRL_OK;
+    if (!demuxer->opts->mkv_index_thread || !demuxer->seekable ||
+        mkv_d->parsed_cues || mkv_d->deferred_cues || mkv_d->index_complete ||
+        !mkv_d->first_cluster || s->uncached_type != STREAMTYPE_FILE)
+        return DEMUXER_CTRL_DONTKNOW;
+    stream_t *file = s->uncached_stream ? s->uncached_stream : s;
+    stream_t *own_stream = stream_open(file->url, demuxer->opts);
+    if (!own_stream)
+        return DEMUXER_CTRL_DONTKNOW;
+
+    struct index_thread *t = talloc_zero(NULL, struct index_thread);
+    t->demuxer = talloc_zero(t, struct demuxer);
+    *t->demuxer = (struct demuxer) {
+        .stream = own_stream,
+        .opts = demuxer->opts,
+        .seekable = true,
+    };
+    mkv_demuxer_t *shadow = talloc_zero(t, struct mkv_demuxer);
+    *shadow = (struct mkv_demuxer) {
+        .tc_scale = mkv_d->tc_scale,
+        .tracks = mkv_d->tracks,        // read-only
+        .num_tracks = mkv_d->num_tracks,
+    };
+    t->demuxer->priv = shadow;
+    t->last_timecode = talloc_array(t, uint64_t, mkv_d->num_tracks);
+    for (int n = 0; n < mkv_d->num_tracks; n++)
+        t->last_timecode[n] = EBML_UINT_INVALID;
+
+    // Continue after the index read from the index cache.
+    int64_t start = mkv_d->first_cluster;
+    mkv_index_t *index = get_highest_index_entry(demuxer);
+    if (index)
+        start = index->filepos;
+    stream_seek(own_stream, start);
+
+    pthread_mutex_init(&t->lock, NULL);
+    if (pthread_create(&t->thread, NULL, index_thread, t)) {
+        pthread_mutex_destroy(&t->lock);
+        free_stream(own_stream);
+        talloc_free(t);
+        return DEMUXER_CTRL_DONTKNOW;
+    }
+    mkv_d->index_thread = t;
+    return DEMUXER_CTRL_OK;
+}
+
+static void stop_index_thread(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    struct index_thread *t = mkv_d->index_thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->terminate = true;
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    merge_background_index(demuxer);
+    pthread_mutex_destroy(&t->lock);
+    packet_buffer_unref(((mkv_demuxer_t *)t->demuxer->priv)->chunk);
+    free_stream(t->demuxer->stream);
+    talloc_free(t);
+    mkv_d->index_thread = NULL;
+}
+
+// Add the entries found by the index thread to the index.
+static void merge_background_index(struct demuxer *demuxer)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    struct index_thread *t = mkv_d->index_thread;
+    if (!t || mkv_d->index_complete)
+        return;
+    // Seeking may have indexed the file beyond the thread's position.
+    mkv_index_t *highest = get_highest_index_entry(demuxer);
+    int64_t min_pos = highest ? highest->filepos : -1;
+    pthread_mutex_lock(&t->lock);
+    for (int i = t->num_merged; i < t->num_indexes; i++) {
+        mkv_index_t *index = &t->indexes[i];
+        if ((int64_t)index->filepos <= min_pos)
+            continue;
+        for (int n = 0; n < mkv_d->num_tracks; n++) {
+            if (mkv_d->tracks[n]->tnum == index->tnum) {
+                add_block_position(demuxer, mkv_d->tracks[n], index->filepos,
+                                   index->timecode);
+            }
+        }
+    }
+    t->num_merged = t->num_indexes;
+    pthread_mutex_unlock(&t->lock);
+}
+
+#else
+
+static int start_index_thread(struct demuxer *demuxer)
+{
+    return DEMUXER_CTRL_NOTIMPL;
+}
+static void stop_index_thread(struct demuxer *demuxer) {}
+static void merge_background_index(struct demuxer *demuxer) {}
+
+#endif
+
+
 static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
 {
     struct mkv_demuxer *mkv_d = demuxer->priv;
@@ -2522,6 +3021,7 @@ static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
     if (mkv_d->index_complete)
         return 0;
 
+    merge_background_index(demuxer);
     mkv_index_t *index = get_highest_index_entry(demuxer);
 
     if (!index || index->timecode * mkv_d->tc_scale < timecode) {
@@ -2547,6 +3047,7 @@ static int create_index_until(struct demuxer *demuxer, uint64_t timecode)
             if (index && index->timecode * mkv_d->tc_scale >= timecode)
                 break;
         }
+        drop_cluster_chunk(demuxer);
         stream_seek(s, old_filepos);
         mkv_d->cluster_start = old_cluster_start;
         mkv_d->cluster_end = old_cluster_end;
@@ -2616,6 +3117,7 @@ static struct mkv_index *seek_with_cues(struct demuxer *demuxer, int seek_id,
 static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
 {
     mkv_demuxer_t *mkv_d = demuxer->priv;
+    drop_cluster_chunk(demuxer);
     int64_t old_pos = stream_tell(demuxer->stream);
     uint64_t v_tnum = -1;
     uint64_t a_tnum = -1;
@@ -2711,6 +3213,44 @@ static void demux_mkv_seek(demuxer_t *demuxer, float rel_seek_secs, int flags)
     }
 }
 
+// Tell the stream which part of the file a seek to the given time will read
+// first. This uses the cues only; no index is created for this. If the cues
+// haven't been read yet, don't read them here: this is called by the playloop,
+// and reading them would block playback for as long as the prefetch saves.
+static int prefetch_seek_target(demuxer_t *demuxer, double time)
+{
+    mkv_demuxer_t *mkv_d = demuxer->priv;
+    stream_t *s = demuxer->stream;
+
+    if (mkv_d->deferred_cues || !mkv_d->index_complete)
+        return DEMUXER_CTRL_DONTKNOW;
+
+    uint64_t target_timecode = FFMAX(time, 0) * 1e9 + 0.5;
+    mkv_index_t *index = NULL;
+    for (int i = 0; i < mkv_d->num_indexes; i++) {
+        mkv_index_t *cur = &mkv_d->indexes[i];
+        if (cur->timecode * mkv_d->tc_scale <= target_timecode &&
+            (!index || cur->timecode > index->timecode))
+            index = cur;
+    }
+    if (!index)
+        return DEMUXER_CTRL_DONTKNOW;
+
+    // Read until the next cue point, which is usually the next cluster.
+    uint64_t end = index->filepos + PREFETCH_MAX_BYTES;
+    for (int i = 0; i < mkv_d->num_indexes; i++) {
+        uint64_t pos = mkv_d->indexes[i].filepos;
+        if (pos > index->filepos && pos < end)
+            end = pos;
+    }
+    struct stream_prefetch_req req = {index->filepos, end};
+    mp_msg(MSGT_DEMUX, MSGL_V, "[mkv] prefetching %" PRIu64 "-%" PRIu64
+           " for %f\n", index->filepos, end, time);
+    if (stream_control(s, STREAM_CTRL_PREFETCH, &req) != STREAM_OK)
+        return DEMUXER_CTRL_NOTIMPL;
+    return DEMUXER_CTRL_OK;
+}
+
 static int demux_mkv_control(demuxer_t *demuxer, int cmd, void *arg)
 {
     mkv_demuxer_t *mkv_d = (mkv_demuxer_t *) demuxer->priv;
@@ -2722,6 +3262,10 @@ static int demux_mkv_control(demuxer_t *demuxer, int cmd, void *arg)
 
         *((double *) arg) = (double) mkv_d->duration;
         return DEMUXER_CTRL_OK;
+    case DEMUXER_CTRL_PREFETCH:
+        return prefetch_seek_target(demuxer, *(double *)arg);
+    case DEMUXER_CTRL_START_INDEXING:
+        return start_index_thread(demuxer);
     default:
         return DEMUXER_CTRL_NOTIMPL;
     }
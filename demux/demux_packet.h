@@ -32,8 +32,11 @@ typedef struct demux_packet {
     unsigned char *buffer;
     bool keyframe;
     struct demux_packet *next;
-    void *allocation;
+    void *allocation;            // refcounted data buffer (if buffer is in it)
     struct AVPacket *avpacket;   // original libavformat packet (demux_lavf)
+    bool spilled;                // data was moved to a temporary file...
+    int64_t spill_pos;           // ...at this position
+    int mem;                     // memory accounted for the data (or 0)
 } demux_packet_t;
 
 #endif /* MPLAYER_DEMUX_PACKET_H */
@@ -111,6 +111,58 @@ int64_t ebml_read_vlen_int(bstr *buffer)
     return unum - ((1 << ((7 * l) - 1)) - 1);
 }
 
+/*
+ * Read an element ID from the buffer.
+ */
+uint32_t ebml_read_vlen_id(bstr *buffer)
+{
+    int i, len_mask = 0x80;
+    uint32_t id;
+
+    if (buffer->len == 0)
+        return EBML_ID_INVALID;
+
+    for (i = 0, id = buffer->start[0]; i < 4 && !(id & len_mask); i++)
+        len_mask >>= 1;
+    if (i >= 4 || i + 1 > buffer->len)
+        return EBML_ID_INVALID;
+    for (int n = 0; n < i; n++)
+        id = (id << 8) | buffer->start[n + 1];
+    buffer->start += i + 1;
+    buffer->len -= i + 1;
+    return id;
+}
+
+/*
+ * Interpret the buffer as contents of an unsigned int element.
+ */
+uint64_t ebml_parse_bstr_uint(bstr data)
+{
+    uint64_t value = 0;
+
+    if (data.len < 1 || data.len > 8)
+        return EBML_UINT_INVALID;
+    for (int n = 0; n < data.len; n++)
+        value = (value << 8) | data.start[n];
+    return value;
+}
+
+/*
+ * Interpret the buffer as contents of a signed int element.
+ */
+int64_t ebml_parse_bstr_int(bstr data)
+{
+    int64_t value = 0;
+
+    if (data.len < 1 || data.len > 8)
+        return EBML_INT_INVALID;
+    if (data.start[0] & 0x80)
+        value = -1;
+    for (int n = 0; n < data.len; n++)
+        value = (value << 8) | data.start[n];
+    return value;
+}
+
 /*
  * Read: element content length.
  */
@@ -448,6 +500,24 @@ static double ebml_parse_float(uint8_t *data, int length)
 }
 
 
+// Return the index of the field with the given ID, or -1 if there is none.
+// TOOLS/matroska.pl generates the fields of each element sorted by ID.
+static int find_field(const struct ebml_elem_desc *type, uint32_t id)
+{
+    int lo = 0, hi = type->field_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        uint32_t mid_id = type->fields[mid].id;
+        if (mid_id == id)
+            return mid;
+        if (mid_id < id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
 // target must be initialized to zero
 static void ebml_parse_element(struct ebml_parse_ctx *ctx, void *target,
                                uint8_t *data, int size,
@@ -484,13 +554,9 @@ static void ebml_parse_element(struct ebml_parse_ctx *ctx, void *target,
         }
         p += len;
 
-        int field_idx = -1;
-        for (int i = 0; i < type->field_count; i++)
-            if (type->fields[i].id == id) {
-                field_idx = i;
-                num_elems[i]++;
-                break;
-            }
+        int field_idx = find_field(type, id);
+        if (field_idx >= 0)
+            num_elems[field_idx]++;
 
         if (length > end - p) {
             if (field_idx >= 0 && type->fields[field_idx].desc->type
@@ -567,12 +633,7 @@ static void ebml_parse_element(struct ebml_parse_ctx *ctx, void *target,
             mp_msg(MSGT_DEMUX, MSGL_DBG2, "[mkv] Next subelement content goes "
                    "past end of containing element, will be truncated\n");
         }
-        int field_idx = -1;
-        for (int i = 0; i < type->field_count; i++)
-            if (type->fields[i].id == id) {
-                field_idx = i;
-                break;
-            }
+        int field_idx = find_field(type, id);
         if (field_idx < 0) {
             if (id == 0xec)
                 mp_msg(MSGT_DEMUX, MSGL_DBG2, "%.*s[mkv] Ignoring Void element "
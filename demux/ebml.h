@@ -92,6 +92,9 @@ struct ebml_parse_ctx {
 uint32_t ebml_read_id (stream_t *s, int *length);
 uint64_t ebml_read_vlen_uint (bstr *buffer);
 int64_t ebml_read_vlen_int (bstr *buffer);
+uint32_t ebml_read_vlen_id (bstr *buffer);
+uint64_t ebml_parse_bstr_uint (bstr data);
+int64_t ebml_parse_bstr_int (bstr data);
 uint64_t ebml_read_length (stream_t *s, int *length);
 uint64_t ebml_read_uint (stream_t *s, uint64_t *length);
 int64_t ebml_read_int (stream_t *s, uint64_t *length);
@@ -106,6 +106,7 @@ typedef struct sh_audio {
     unsigned char *codecdata;
     int codecdata_len;
     int pts_bytes;   // bytes output by decoder after last known pts
+    struct ad_thread *dec_thread; // set if decoding in a thread (--ad-thread)
 } sh_audio_t;
 
 typedef struct sh_video {
@@ -134,6 +135,8 @@ typedef struct sh_video {
     long vf_reconfig_count; // incremented each mpcodecs_reconfig_vo() call
     struct mp_image_params *vf_input; // video filter input params
     struct mp_hwdec_info *hwdec_info; // video output hwdec handles
+    struct vd_thread *dec_thread; // set if decoding in a thread (--vd-thread)
+    double decode_time;   // time spent in decode_video() (any thread)
     // win32-compatible codec parameters:
     BITMAPINFOHEADER *bih;
 } sh_video_t;
@@ -20,6 +20,8 @@
 #include <libavutil/common.h>
 #include <libavcodec/avcodec.h>
 
+#include "config.h"
+
 #include "mpvcore/mp_talloc.h"
 #include "demux/demux_packet.h"
 #include "av_common.h"
@@ -75,6 +77,12 @@ void mp_set_av_packet(AVPacket *dst, struct demux_packet *mpkt)
     if (mpkt && mpkt->avpacket) {
         dst->side_data = mpkt->avpacket->side_data;
         dst->side_data_elems = mpkt->avpacket->side_data_elems;
+#if HAVE_AVUTIL_REFCOUNTING
+        // Lets the decoder reference the data instead of copying it. Not if
+        // the packet data was replaced (see recode_packet() in dec_sub.c).
+        if (mpkt->buffer == mpkt->avpacket->data)
+            dst->buf = mpkt->avpacket->buf;
+#endif
     }
 }
 
@@ -17,6 +17,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <string.h>
@@ -32,6 +33,7 @@
 #include "command.h"
 #include "input/input.h"
 #include "stream/stream.h"
+#include "stream/capture.h"
 #include "demux/demux.h"
 #include "demux/stheader.h"
 #include "resolve.h"
@@ -196,12 +198,33 @@ static int mp_property_stream_capture(m_option_t *prop, int action,
 
     if (action == M_PROPERTY_SET) {
         char *filename = *(char **)arg;
-        stream_set_capture_file(mpctx->stream, filename);
+        demux_pause(mpctx->demuxer);
+        stream_set_capture_file(mpctx->stream, filename, false);
+        demux_unpause(mpctx->demuxer);
         // fall through to mp_property_generic_option
     }
     return mp_property_generic_option(prop, action, arg, mpctx);
 }
 
+/// Stream capture statistics (RO)
+/// prop->offset is the offset of the field in struct stream_capture_stats.
+static int mp_property_stream_capture_stat(m_option_t *prop, int action,
+                                           void *arg, MPContext *mpctx)
+{
+    if (!mpctx->stream)
+        return M_PROPERTY_UNAVAILABLE;
+    struct stream_capture_stats st;
+    demux_pause(mpctx->demuxer);
+    struct stream_capture *capture = mpctx->stream->capture;
+    if (capture)
+        stream_capture_get_stats(capture, &st);
+    demux_unpause(mpctx->demuxer);
+    if (!capture)
+        return M_PROPERTY_UNAVAILABLE;
+    int64_t *field = (int64_t *)((char *)&st + prop->offset);
+    return m_property_int64_ro(prop, action, arg, *field);
+}
+
 /// Demuxer name (RO)
 static int mp_property_demuxer(m_option_t *prop, int action, void *arg,
                                MPContext *mpctx)
@@ -221,10 +244,14 @@ static int mp_property_stream_pos(m_option_t *prop, int action, void *arg,
         return M_PROPERTY_UNAVAILABLE;
     switch (action) {
     case M_PROPERTY_GET:
+        demux_pause(mpctx->demuxer);
         *(int64_t *) arg = stream_tell(stream);
+        demux_unpause(mpctx->demuxer);
         return M_PROPERTY_OK;
     case M_PROPERTY_SET:
+        demux_pause(mpctx->demuxer);
         stream_seek(stream, *(int64_t *) arg);
+        demux_unpause(mpctx->demuxer);
         return M_PROPERTY_OK;
     }
     return M_PROPERTY_NOT_IMPLEMENTED;
@@ -574,8 +601,8 @@ static int mp_property_titles(m_option_t *prop, int action, void *arg,
 {
     struct demuxer *demuxer = mpctx->master_demuxer;
     unsigned int num_titles;
-    if (!demuxer || stream_control(demuxer->stream, STREAM_CTRL_GET_NUM_TITLES,
-                                   &num_titles) < 1)
+    if (!demuxer || demux_stream_control(demuxer, STREAM_CTRL_GET_NUM_TITLES,
+                                         &num_titles) < 1)
         return M_PROPERTY_UNAVAILABLE;
     return m_property_int_ro(prop, action, arg, num_titles);
 }
@@ -747,6 +774,57 @@ static int mp_property_cache(m_option_t *prop, int action, void *arg,
     return m_property_int_ro(prop, action, arg, cache);
 }
 
+static bool get_cache_stats(MPContext *mpctx, struct stream_cache_stats *st)
+{
+    return mpctx->stream &&
+           stream_control(mpctx->stream, STREAM_CTRL_GET_CACHE_STATS, st) > 0;
+}
+
+/// Cache statistics (RO)
+/// prop->offset is the offset of the field in struct stream_cache_stats.
+static int mp_property_cache_stat(m_option_t *prop, int action, void *arg,
+                                  MPContext *mpctx)
+{
+    struct stream_cache_stats st;
+    if (!get_cache_stats(mpctx, &st))
+        return M_PROPERTY_UNAVAILABLE;
+    void *field = (char *)&st + prop->offset;
+    if (prop->type == CONF_TYPE_DOUBLE)
+        return m_property_double_ro(prop, action, arg, *(double *)field);
+    return m_property_int64_ro(prop, action, arg, *(int64_t *)field);
+}
+
+/// Cache fill state of the last seconds, comma separated (RO)
+static int mp_property_cache_fill_history(m_option_t *prop, int action,
+                                          void *arg, MPContext *mpctx)
+{
+    struct stream_cache_stats st;
+    if (!get_cache_stats(mpctx, &st))
+        return M_PROPERTY_UNAVAILABLE;
+    char *res = talloc_strdup(NULL, "");
+    for (int n = 0; n < STREAM_CACHE_HISTORY; n++) {
+        if (st.fill_history[n] >= 0)
+            res = talloc_asprintf_append(res, "%s%d", res[0] ? "," : "",
+                                         st.fill_history[n]);
+    }
+    int r = m_property_strdup_ro(prop, action, arg, res);
+    talloc_free(res);
+    return r;
+}
+
+/// Packet payload data copied in memory (RO)
+/// prop->offset is the offset of the field in struct demux_copy_stats.
+static int mp_property_packet_copy_stat(m_option_t *prop, int action,
+                                        void *arg, MPContext *mpctx)
+{
+    struct demux_copy_stats st;
+    demux_get_copy_stats(&st);
+    void *field = (char *)&st + prop->offset;
+    if (prop->type == CONF_TYPE_DOUBLE)
+        return m_property_double_ro(prop, action, arg, *(double *)field);
+    return m_property_int64_ro(prop, action, arg, *(int64_t *)field);
+}
+
 static int mp_property_clock(m_option_t *prop, int action, void *arg,
                              MPContext *mpctx)
 {
@@ -768,14 +846,19 @@ static int mp_property_volume(m_option_t *prop, int action, void *arg,
         mixer_getbothvolume(mpctx->mixer, arg);
         return M_PROPERTY_OK;
     case M_PROPERTY_SET:
+        // The mixer might change the audio filter chain.
+        audio_pause_thread(mpctx->sh_audio);
         mixer_setvolume(mpctx->mixer, *(float *) arg, *(float *) arg);
+        audio_unpause_thread(mpctx->sh_audio);
         return M_PROPERTY_OK;
     case M_PROPERTY_SWITCH: {
         struct m_property_switch_arg *sarg = arg;
+        audio_pause_thread(mpctx->sh_audio);
         if (sarg->inc <= 0)
             mixer_decvolume(mpctx->mixer);
         else
             mixer_incvolume(mpctx->mixer);
+        audio_unpause_thread(mpctx->sh_audio);
         return M_PROPERTY_OK;
     }
     }
@@ -788,7 +871,9 @@ static int mp_property_mute(m_option_t *prop, int action, void *arg,
 {
     switch (action) {
     case M_PROPERTY_SET:
+        audio_pause_thread(mpctx->sh_audio);
         mixer_setmute(mpctx->mixer, *(int *) arg);
+        audio_unpause_thread(mpctx->sh_audio);
         return M_PROPERTY_OK;
     case M_PROPERTY_GET:
         *(int *)arg =  mixer_getmute(mpctx->mixer);
@@ -926,7 +1011,9 @@ static int mp_property_balance(m_option_t *prop, int action, void *arg,
         return M_PROPERTY_OK;
     }
     case M_PROPERTY_SET:
+        audio_pause_thread(mpctx->sh_audio);
         mixer_setbalance(mpctx->mixer, *(float *)arg);
+        audio_unpause_thread(mpctx->sh_audio);
         return M_PROPERTY_OK;
     }
     return M_PROPERTY_NOT_IMPLEMENTED;
@@ -1372,6 +1459,24 @@ static int mp_property_framedrop(m_option_t *prop, int action,
     return mp_property_generic_option(prop, action, arg, mpctx);
 }
 
+/// Current --framedrop=adaptive level (RO)
+static int mp_property_framedrop_level(m_option_t *prop, int action,
+                                       void *arg, MPContext *mpctx)
+{
+    if (!mpctx->sh_video)
+        return M_PROPERTY_UNAVAILABLE;
+    return m_property_int_ro(prop, action, arg, mpctx->framedrop_level);
+}
+
+/// Number of frames dropped since the last seek (RO)
+static int mp_property_drop_frame_count(m_option_t *prop, int action,
+                                        void *arg, MPContext *mpctx)
+{
+    if (!mpctx->sh_video)
+        return M_PROPERTY_UNAVAILABLE;
+    return m_property_int_ro(prop, action, arg, mpctx->drop_frame_cnt);
+}
+
 static int mp_property_video_color(m_option_t *prop, int action, void *arg,
                                    MPContext *mpctx)
 {
@@ -1798,6 +1903,12 @@ static const m_option_t mp_properties[] = {
     { "stream-path", mp_property_stream_path, CONF_TYPE_STRING,
       0, 0, 0, NULL },
     M_OPTION_PROPERTY_CUSTOM("stream-capture", mp_property_stream_capture),
+#define CAPTURE_STAT_PROP(name, field) \
+    { name, mp_property_stream_capture_stat, CONF_TYPE_INT64, \
+      .offset = offsetof(struct stream_capture_stats, field) }
+    CAPTURE_STAT_PROP("stream-capture-written", bytes_written),
+    CAPTURE_STAT_PROP("stream-capture-queued", bytes_queued),
+    CAPTURE_STAT_PROP("stream-capture-dropped", bytes_dropped),
     { "demuxer", mp_property_demuxer, CONF_TYPE_STRING,
       0, 0, 0, NULL },
     { "stream-pos", mp_property_stream_pos, CONF_TYPE_INT64,
@@ -1832,6 +1943,22 @@ static const m_option_t mp_properties[] = {
     { "chapter-metadata", mp_property_chapter_metadata, CONF_TYPE_STRING_LIST },
     M_OPTION_PROPERTY_CUSTOM("pause", mp_property_pause),
     { "cache", mp_property_cache, CONF_TYPE_INT },
+#define CACHE_STAT_PROP(name, type, field) \
+    { name, mp_property_cache_stat, type, \
+      .offset = offsetof(struct stream_cache_stats, field) }
+    CACHE_STAT_PROP("cache-bytes-read", CONF_TYPE_INT64, bytes_read),
+    CACHE_STAT_PROP("cache-speed", CONF_TYPE_DOUBLE, speed_1s),
+    CACHE_STAT_PROP("cache-speed-10s", CONF_TYPE_DOUBLE, speed_10s),
+    CACHE_STAT_PROP("cache-speed-60s", CONF_TYPE_DOUBLE, speed_60s),
+    CACHE_STAT_PROP("cache-stalls", CONF_TYPE_INT64, stalls),
+    CACHE_STAT_PROP("cache-stall-time", CONF_TYPE_DOUBLE, stall_time),
+    CACHE_STAT_PROP("cache-seeks-cached", CONF_TYPE_INT64, seeks_cached),
+    CACHE_STAT_PROP("cache-seeks-stream", CONF_TYPE_INT64, seeks_stream),
+    { "cache-fill-history", mp_property_cache_fill_history, CONF_TYPE_STRING },
+    { "packet-bytes-copied", mp_property_packet_copy_stat, CONF_TYPE_INT64,
+      .offset = offsetof(struct demux_copy_stats, bytes_copied) },
+    { "packet-copy-speed", mp_property_packet_copy_stat, CONF_TYPE_DOUBLE,
+      .offset = offsetof(struct demux_copy_stats, speed) },
     M_OPTION_PROPERTY("pts-association-mode"),
     M_OPTION_PROPERTY("hr-seek"),
     { "clock", mp_property_clock, CONF_TYPE_STRING,
@@ -1877,6 +2004,10 @@ static const m_option_t mp_properties[] = {
     M_OPTION_PROPERTY_CUSTOM("ontop", mp_property_ontop),
     M_OPTION_PROPERTY_CUSTOM("border", mp_property_border),
     M_OPTION_PROPERTY_CUSTOM("framedrop", mp_property_framedrop),
+    { "framedrop-level", mp_property_framedrop_level, CONF_TYPE_INT,
+      0, 0, 0, NULL },
+    { "drop-frame-count", mp_property_drop_frame_count, CONF_TYPE_INT,
+      0, 0, 0, NULL },
     M_OPTION_PROPERTY_CUSTOM("gamma", mp_property_video_color),
     M_OPTION_PROPERTY_CUSTOM("brightness", mp_property_video_color),
     M_OPTION_PROPERTY_CUSTOM("contrast", mp_property_video_color),
@@ -156,6 +156,7 @@ typedef struct MPContext {
     struct timeline_part *timeline;
     int num_timeline_parts;
     int timeline_part;
+    int timeline_prefetch_part; // next part prefetching was requested for
     // NOTE: even if num_chapters==0, chapters being not NULL signifies presence
     //       of chapter metadata
     struct chapter *chapters;
@@ -192,6 +193,9 @@ typedef struct MPContext {
     /* Set if audio should be timed to start with video frame after seeking,
      * not set when e.g. playing cover art */
     bool sync_audio_to_video;
+    /* Set by update_video() if no frame was loaded because the decoder thread
+     * hasn't finished the next frame yet. The thread wakes up the playloop. */
+    bool video_decoder_waiting;
     /* After playback restart (above) or audio stream change, adjust audio
      * stream by cutting samples or adding silence at the beginning to make
      * audio playback position match video position. */
@@ -219,6 +223,12 @@ typedef struct MPContext {
     int drop_frame_cnt;
     // Number of frames dropped in a row.
     int dropped_frames;
+    // Adaptive framedrop (--framedrop=adaptive): how much work the decoder
+    // skips (0-3), and the state used to decide it.
+    int framedrop_level;
+    double framedrop_pressure;  // >0: seconds overloaded, <0: with headroom
+    double frame_cost;          // average decode+filter time per shown frame
+    double filter_time;         // filter time since the last shown frame
     // A-V sync difference when last frame was displayed. Kept to display
     // the same value if the status line is updated at a time where no new
     // video frame is shown.
@@ -57,6 +57,14 @@ struct mp_ring *mp_ring_new(void *talloc_ctx, int size)
     return ringbuffer;
 }
 
+int mp_ring_round_size(int size)
+{
+    int res = 1;
+    while (res < size && res < (1 << 30))
+        res *= 2;
+    return res;
+}
+
 int mp_ring_drain(struct mp_ring *buffer, int len)
 {
     int buffered  = mp_ring_buffered(buffer);
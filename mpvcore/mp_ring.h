@@ -36,6 +36,18 @@ struct mp_ring;
  */
 struct mp_ring *mp_ring_new(void *talloc_ctx, int size);
 
+/**
+ * Round a ringbuffer size up to a power of 2
+ *
+ * The read/write positions are 32 bit counters, which wrap around correctly
+ * only if the size is a power of 2. Ringbuffers that can see more than 4 GiB
+ * of data over their lifetime should be created with a size returned by this.
+ *
+ * size:   minimum size in bytes
+ * return: smallest power of 2 >= size, capped at 1 GiB
+ */
+int mp_ring_round_size(int size);
+
 /**
  * Read data from the ringbuffer
  *
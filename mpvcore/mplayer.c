@@ -43,6 +43,9 @@
 #include <windows.h>
 #endif
 #define WAKEUP_PERIOD 0.5
+// Time before the end of a timeline part at which the next part's data is
+// requested to be prefetched.
+#define TIMELINE_PREFETCH_TIME 5.0
 #include <string.h>
 #include <unistd.h>
 
@@ -198,6 +201,7 @@ static const char av_desync_help_text[] = _(
 
 #include "mpvcore/mp_common.h"
 #include "mpvcore/command.h"
+#include "mpvcore/mp_memory_barrier.h"
 
 static void reset_subtitles(struct MPContext *mpctx);
 static void reinit_subs(struct MPContext *mpctx);
@@ -452,6 +456,8 @@ void uninit_player(struct MPContext *mpctx, unsigned int mask)
 
     if (mask & INITIALIZED_ACODEC) {
         mpctx->initialized_flags &= ~INITIALIZED_ACODEC;
+        if (mpctx->sh_audio)
+            audio_stop_thread(mpctx->sh_audio);
         mixer_uninit_audio(mpctx->mixer);
         if (mpctx->sh_audio)
             uninit_audio(mpctx->sh_audio);
@@ -574,6 +580,8 @@ static MP_NORETURN void exit_player(struct MPContext *mpctx,
     mpctx->ass_library = NULL;
 #endif
 
+    demux_uninit_packet_pool();
+
     if (how != EXIT_NONE) {
         const char *reason;
         switch (how) {
@@ -1032,7 +1040,7 @@ static struct track *add_stream_track(struct MPContext *mpctx,
             .id = map_id_from_demuxer(track->demuxer, track->type,
                                       track->demuxer_id)
         };
-        stream_control(track->demuxer->stream, STREAM_CTRL_GET_LANG, &req);
+        demux_stream_control(track->demuxer, STREAM_CTRL_GET_LANG, &req);
         if (req.name[0])
             track->lang = talloc_strdup(track, req.name);
     }
@@ -1647,13 +1655,15 @@ int reinit_audio_filters(struct MPContext *mpctx)
     if (!sh_audio)
         return -2;
 
+    audio_pause_thread(sh_audio);
+    int r = 0;
     af_uninit(mpctx->sh_audio->afilter);
-    if (af_init(mpctx->sh_audio->afilter) < 0)
-        return -1;
-    if (recreate_audio_filters(mpctx) < 0)
-        return -1;
+    if (af_init(mpctx->sh_audio->afilter) < 0 ||
+        recreate_audio_filters(mpctx) < 0)
+        r = -1;
+    audio_unpause_thread(sh_audio);
 
-    return 0;
+    return r;
 }
 
 void reinit_audio_chain(struct MPContext *mpctx)
@@ -1671,6 +1681,11 @@ void reinit_audio_chain(struct MPContext *mpctx)
         mpctx->initialized_flags |= INITIALIZED_ACODEC;
     }
 
+    // Audio the decoder thread has already filtered is in the old output
+    // format or speed. Discard it; the thread is restarted when audio is
+    // needed again.
+    audio_stop_thread(mpctx->sh_audio);
+
     int ao_srate = opts->force_srate;
     int ao_format = opts->audio_output_format;
     struct mp_chmap ao_channels = {0};
@@ -1748,28 +1763,15 @@ static double written_audio_pts(struct MPContext *mpctx)
     if (!sh_audio)
         return MP_NOPTS_VALUE;
 
-    double bps = sh_audio->channels.num * sh_audio->samplerate *
-                 sh_audio->samplesize;
-
-    // first calculate the end pts of audio that has been output by decoder
-    double a_pts = sh_audio->pts;
+    // First calculate the end pts of audio that has been output by the
+    // filters. Data buffered in audio filters (and in the decoder thread's
+    // buffers) is returned as buffered_output, measured in bytes of
+    // "missing" output.
+    double buffered_output;
+    double a_pts = decoded_audio_pts(sh_audio, &buffered_output);
     if (a_pts == MP_NOPTS_VALUE)
         return MP_NOPTS_VALUE;
 
-    // sh_audio->pts is the timestamp of the latest input packet with
-    // known pts that the decoder has decoded. sh_audio->pts_bytes is
-    // the amount of bytes the decoder has written after that timestamp.
-    a_pts += sh_audio->pts_bytes / bps;
-
-    // Now a_pts hopefully holds the pts for end of audio from decoder.
-    // Subtract data in buffers between decoder and audio out.
-
-    // Decoded but not filtered
-    a_pts -= sh_audio->a_buffer_len / bps;
-
-    // Data buffered in audio filters, measured in bytes of "missing" output
-    double buffered_output = af_calc_delay(sh_audio->afilter);
-
     // Data that was ready for ao but was buffered because ao didn't fully
     // accept everything to internal buffers yet
     buffered_output += mpctx->ao->buffer.len;
@@ -1861,7 +1863,7 @@ static void update_subtitles(struct MPContext *mpctx)
                    "duration=%5.3f len=%d\n", curpts_s, pkt->pts, pkt->duration,
                    pkt->len);
             sub_decode(dec_sub, pkt);
-            talloc_free(pkt);
+            free_demux_packet(pkt);
         }
     }
 
@@ -1869,9 +1871,20 @@ static void update_subtitles(struct MPContext *mpctx)
         set_osd_subtitle(mpctx, sub_get_text(dec_sub, curpts_s));
 }
 
+// Decoder skip flags for each --framedrop=adaptive level.
+static const int framedrop_level_flags[] = {
+    0,
+    VD_SKIP_NONREF,
+    VD_SKIP_NONREF | VD_SKIP_LOOPFILTER,
+    VD_SKIP_NONKEY | VD_SKIP_LOOPFILTER,
+};
+
+#define MAX_FRAMEDROP_LEVEL ((int)MP_ARRAY_SIZE(framedrop_level_flags) - 1)
+
 static int check_framedrop(struct MPContext *mpctx, double frame_time)
 {
     struct MPOpts *opts = mpctx->opts;
+    int level_flags = framedrop_level_flags[mpctx->framedrop_level];
     // check for frame-drop:
     if (mpctx->sh_audio && !mpctx->ao->untimed &&
         !demux_stream_eof(mpctx->sh_audio->gsh))
@@ -1882,15 +1895,69 @@ static int check_framedrop(struct MPContext *mpctx, double frame_time)
             frame_time = mpctx->sh_video->fps > 0 ? 1.0 / mpctx->sh_video->fps : 0;
         // we should avoid dropping too many frames in sequence unless we
         // are too late. and we allow 100ms A-V delay here:
-        if (d < -mpctx->dropped_frames * frame_time - 0.100 && !mpctx->paused
+        double slack = mpctx->dropped_frames;
+        // Frames already inside the decoder are output before the effect of
+        // the last drop shows up in the A-V delay, so wait for them too
+        // (this matters with frame threading, which delays every frame).
+        if (mpctx->dropped_frames) {
+            int lag = get_current_video_decoder_lag(mpctx->sh_video);
+            if (lag > 0)
+                slack += lag;
+        }
+        if (d < -slack * frame_time - 0.100 && !mpctx->paused
             && !mpctx->restart_playback) {
             mpctx->drop_frame_cnt++;
             mpctx->dropped_frames++;
-            return mpctx->opts->frame_dropping;
+            int drop = opts->frame_dropping == 3 ? 1 : opts->frame_dropping;
+            return drop | level_flags;
         } else
             mpctx->dropped_frames = 0;
     }
-    return 0;
+    return level_flags;
+}
+
+// --framedrop=adaptive: compare the average time spent decoding and filtering
+// a frame with the frame duration, and make the decoder skip more or less work
+// if either state persists. Being late counts as overload too, because the
+// time spent in the VO is not measured.
+static void update_framedrop_level(struct MPContext *mpctx, double frame_time)
+{
+    struct MPOpts *opts = mpctx->opts;
+    if (frame_time <= 0)
+        return;
+    double cost = video_get_decode_time(mpctx->sh_video) + mpctx->filter_time;
+    mpctx->filter_time = 0;
+    if (opts->frame_dropping != 3) {
+        mpctx->framedrop_level = 0;
+        return;
+    }
+    // The first frames after a seek include the cost of seeking.
+    if (mpctx->restart_playback || mpctx->paused)
+        return;
+    mpctx->frame_cost = mpctx->frame_cost > 0 ?
+                        0.9 * mpctx->frame_cost + 0.1 * cost : cost;
+    double budget = frame_time / opts->playback_speed;
+    if (mpctx->frame_cost > 0.9 * budget || mpctx->dropped_frames) {
+        mpctx->framedrop_pressure = FFMAX(mpctx->framedrop_pressure, 0) + budget;
+    } else if (mpctx->frame_cost < 0.6 * budget) {
+        mpctx->framedrop_pressure = FFMIN(mpctx->framedrop_pressure, 0) - budget;
+    } else {
+        mpctx->framedrop_pressure = 0;
+    }
+    // Escalate quickly, but relax only after a longer time with headroom.
+    int level = mpctx->framedrop_level;
+    if (mpctx->framedrop_pressure >= 0.5 && level < MAX_FRAMEDROP_LEVEL)
+        level++;
+    if (mpctx->framedrop_pressure <= -3.0 && level > 0)
+        level--;
+    if (level != mpctx->framedrop_level) {
+        mp_msg(MSGT_CPLAYER, MSGL_V, "Framedrop level %d -> %d (frame cost "
+               "%.1f ms, budget %.1f ms)\n", mpctx->framedrop_level, level,
+               mpctx->frame_cost * 1e3, budget * 1e3);
+        mpctx->framedrop_level = level;
+        mpctx->framedrop_pressure = 0;
+        mp_notify_property(mpctx, "framedrop-level");
+    }
 }
 
 static double timing_sleep(struct MPContext *mpctx, double time_frame)
@@ -2194,7 +2261,7 @@ static int audio_start_sync(struct MPContext *mpctx, int playsize)
         bytes -= bytes % (ao->channels.num * af_fmt2bits(ao->format) / 8);
 
         // ogg demuxers give packets without timing
-        if (written_pts <= 1 && sh_audio->pts == MP_NOPTS_VALUE) {
+        if (written_pts == MP_NOPTS_VALUE) {
             if (!did_retry) {
                 // Try to read more data to see packets that have pts
                 res = decode_audio(sh_audio, &ao->buffer, ao->bps);
@@ -2262,6 +2329,9 @@ static int fill_audio_out_buffers(struct MPContext *mpctx, double endpts)
     bool modifiable_audio_format = !(ao->format & AF_FORMAT_SPECIAL_MASK);
     int unitsize = ao->channels.num * af_fmt2bits(ao->format) / 8;
 
+    if (opts->audio_decoder_thread && !sh_audio->dec_thread)
+        audio_start_thread(sh_audio, opts->audio_decoder_buffer);
+
     if (mpctx->paused)
         playsize = 1;   // just initialize things (audio pts at least)
     else
@@ -2380,6 +2450,12 @@ int reinit_video_filters(struct MPContext *mpctx)
     return sh_video->vf_initialized > 0 ? 0 : -1;
 }
 
+static void wakeup_playloop(void *ctx)
+{
+    struct MPContext *mpctx = ctx;
+    mp_input_wakeup(mpctx->input);
+}
+
 int reinit_video_chain(struct MPContext *mpctx)
 {
     struct MPOpts *opts = mpctx->opts;
@@ -2424,8 +2500,8 @@ int reinit_video_chain(struct MPContext *mpctx)
 
     vo_update_window_title(mpctx);
 
-    if (stream_control(mpctx->sh_video->gsh->demuxer->stream,
-                       STREAM_CTRL_GET_ASPECT_RATIO, &ar) != STREAM_UNSUPPORTED)
+    if (demux_stream_control(mpctx->sh_video->gsh->demuxer,
+                             STREAM_CTRL_GET_ASPECT_RATIO, &ar) != STREAM_UNSUPPORTED)
         mpctx->sh_video->stream_aspect = ar;
 
     recreate_video_filters(mpctx);
@@ -2437,6 +2513,10 @@ int reinit_video_chain(struct MPContext *mpctx)
 
     mpctx->initialized_flags |= INITIALIZED_VCODEC;
 
+    if (opts->video_decoder_thread && opts->correct_pts &&
+        !sh_video->gsh->attached_picture)
+        video_start_thread(sh_video, wakeup_playloop, mpctx);
+
     bool saver_state = opts->pause || !opts->stop_screensaver;
     vo_control(mpctx->video_out, saver_state ? VOCTRL_RESTORE_SCREENSAVER
                                              : VOCTRL_KILL_SCREENSAVER, NULL);
@@ -2563,10 +2643,12 @@ static void filter_video(struct MPContext *mpctx, struct mp_image *frame)
 
     init_filter_params(mpctx);
 
+    double t0 = mp_time_sec();
     frame->pts = sh_video->pts;
     mp_image_set_params(frame, sh_video->vf_input);
     vf_filter_frame(sh_video->vfilter, frame);
     filter_output_queued_frame(mpctx);
+    mpctx->filter_time += mp_time_sec() - t0;
 }
 
 
@@ -2629,7 +2711,7 @@ static double update_video_nocorrect_pts(struct MPContext *mpctx)
 
         void *decoded_frame = decode_video(sh_video, pkt, framedrop_type,
                                            sh_video->pts);
-        talloc_free(pkt);
+        free_demux_packet(pkt);
         if (decoded_frame) {
             filter_video(mpctx, decoded_frame);
         }
@@ -2655,41 +2737,63 @@ static double update_video_attached_pic(struct MPContext *mpctx)
     return 0;
 }
 
-static void determine_frame_pts(struct MPContext *mpctx)
+// Read the next video packet, and determine its pts and the framedrop mode
+// to decode it with. Returns NULL on EOF.
+static struct demux_packet *read_video_packet(struct MPContext *mpctx,
+                                              double *pts, int *framedrop_type)
+{
+    struct demux_packet *pkt = NULL;
+    while (1) {
+        pkt = demux_read_packet(mpctx->sh_video->gsh);
+        if (!pkt || pkt->len)
+            break;
+        /* Packets with size 0 are assumed to not correspond to frames,
+         * but to indicate the absence of a frame in formats like AVI
+         * that must have packets at fixed timecode intervals. */
+        free_demux_packet(pkt);
+    }
+    *pts = pkt ? pkt->pts : MP_NOPTS_VALUE;
+    if (*pts != MP_NOPTS_VALUE)
+        *pts += mpctx->video_offset;
+    if (*pts >= mpctx->hrseek_pts - .005)
+        mpctx->hrseek_framedrop = false;
+    *framedrop_type = mpctx->hrseek_active && mpctx->hrseek_framedrop ?
+                      1 : check_framedrop(mpctx, -1);
+    return pkt;
+}
+
+// Keep the decoder thread busy, and pass the next decoded frame (if any) to
+// the filters. Returns false on EOF.
+static bool update_video_thread(struct MPContext *mpctx)
 {
     struct sh_video *sh_video = mpctx->sh_video;
-    struct MPOpts *opts = mpctx->opts;
 
-    if (opts->user_pts_assoc_mode)
-        sh_video->pts_assoc_mode = opts->user_pts_assoc_mode;
-    else if (sh_video->pts_assoc_mode == 0) {
-        if (mpctx->sh_video->gsh->demuxer->timestamp_type == TIMESTAMP_TYPE_PTS
-            && sh_video->codec_reordered_pts != MP_NOPTS_VALUE)
-            sh_video->pts_assoc_mode = 1;
-        else
-            sh_video->pts_assoc_mode = 2;
+    while (video_needs_packet(sh_video)) {
+        double pts;
+        int framedrop_type;
+        struct demux_packet *pkt =
+            read_video_packet(mpctx, &pts, &framedrop_type);
+        video_queue_packet(sh_video, pkt, framedrop_type, pts);
+    }
+
+    bool eof;
+    struct mp_image *decoded_frame = video_get_decoded_frame(sh_video, &eof);
+    if (decoded_frame) {
+        sh_video->pts = decoded_frame->pts;
+        filter_video(mpctx, decoded_frame);
+    } else if (eof) {
+        return load_next_vo_frame(mpctx, true);
     } else {
-        int probcount1 = sh_video->num_reordered_pts_problems;
-        int probcount2 = sh_video->num_sorted_pts_problems;
-        if (sh_video->pts_assoc_mode == 2) {
-            int tmp = probcount1;
-            probcount1 = probcount2;
-            probcount2 = tmp;
-        }
-        if (probcount1 >= probcount2 * 1.5 + 2) {
-            sh_video->pts_assoc_mode = 3 - sh_video->pts_assoc_mode;
-            mp_msg(MSGT_CPLAYER, MSGL_V, "Switching to pts association mode "
-                   "%d.\n", sh_video->pts_assoc_mode);
-        }
+        mpctx->video_decoder_waiting = sh_video->vf_initialized >= 0;
     }
-    sh_video->pts = sh_video->pts_assoc_mode == 1 ?
-                    sh_video->codec_reordered_pts : sh_video->sorted_pts;
+    return true;
 }
 
 static double update_video(struct MPContext *mpctx, double endpts)
 {
     struct sh_video *sh_video = mpctx->sh_video;
     struct vo *video_out = mpctx->video_out;
+    mpctx->video_decoder_waiting = false;
     sh_video->vfilter->control(sh_video->vfilter, VFCTRL_SET_OSD_OBJ,
                                mpctx->osd); // for vf_sub
     if (!mpctx->opts->correct_pts)
@@ -2703,30 +2807,19 @@ static double update_video(struct MPContext *mpctx, double endpts)
     while (1) {
         if (load_next_vo_frame(mpctx, false))
             break;
-        pts = MP_NOPTS_VALUE;
-        struct demux_packet *pkt = NULL;
-        while (1) {
-            pkt = demux_read_packet(mpctx->sh_video->gsh);
-            if (!pkt || pkt->len)
-                break;
-            /* Packets with size 0 are assumed to not correspond to frames,
-             * but to indicate the absence of a frame in formats like AVI
-             * that must have packets at fixed timecode intervals. */
-            talloc_free(pkt);
+        if (sh_video->dec_thread) {
+            if (!update_video_thread(mpctx))
+                return -1;
+            break;
         }
-        if (pkt)
-            pts = pkt->pts;
-        if (pts != MP_NOPTS_VALUE)
-            pts += mpctx->video_offset;
-        if (pts >= mpctx->hrseek_pts - .005)
-            mpctx->hrseek_framedrop = false;
-        int framedrop_type = mpctx->hrseek_active && mpctx->hrseek_framedrop ?
-                             1 : check_framedrop(mpctx, -1);
+        int framedrop_type;
+        struct demux_packet *pkt =
+            read_video_packet(mpctx, &pts, &framedrop_type);
         struct mp_image *decoded_frame =
             decode_video(sh_video, pkt, framedrop_type, pts);
-        talloc_free(pkt);
+        free_demux_packet(pkt);
         if (decoded_frame) {
-            determine_frame_pts(mpctx);
+            sh_video->pts = determine_frame_pts(sh_video);
             filter_video(mpctx, decoded_frame);
         } else if (!pkt) {
             if (!load_next_vo_frame(mpctx, true))
@@ -2879,7 +2972,6 @@ static void seek_reset(struct MPContext *mpctx, bool reset_ao, bool reset_ac)
         vo_seek_reset(mpctx->video_out);
         if (mpctx->sh_video->vf_initialized == 1)
             vf_chain_seek_reset(mpctx->sh_video->vfilter);
-        mpctx->sh_video->num_buffered_pts = 0;
         mpctx->sh_video->last_pts = MP_NOPTS_VALUE;
         mpctx->sh_video->pts = MP_NOPTS_VALUE;
         mpctx->video_pts = MP_NOPTS_VALUE;
@@ -2903,6 +2995,9 @@ static void seek_reset(struct MPContext *mpctx, bool reset_ao, bool reset_ac)
     mpctx->total_avsync_change = 0;
     mpctx->drop_frame_cnt = 0;
     mpctx->dropped_frames = 0;
+    mpctx->framedrop_pressure = 0;
+    mpctx->frame_cost = 0;
+    mpctx->filter_time = 0;
     mpctx->playback_pts = MP_NOPTS_VALUE;
 
 #ifdef CONFIG_ENCODING
@@ -2915,6 +3010,7 @@ static bool timeline_set_part(struct MPContext *mpctx, int i, bool force)
     struct timeline_part *p = mpctx->timeline + mpctx->timeline_part;
     struct timeline_part *n = mpctx->timeline + i;
     mpctx->timeline_part = i;
+    mpctx->timeline_prefetch_part = 0;
     mpctx->video_offset = n->start - n->source_start;
     if (n->source == p->source && !force)
         return false;
@@ -2973,6 +3069,10 @@ static int seek(MPContext *mpctx, struct seek_params seek,
 
     if (mpctx->stop_play == AT_END_OF_FILE)
         mpctx->stop_play = KEEP_PLAYING;
+    // The audio decoder thread would read packets from the new position
+    // before the decoder is reset. It's restarted when audio is needed again.
+    if (mpctx->sh_audio)
+        audio_stop_thread(mpctx->sh_audio);
     bool hr_seek = mpctx->demuxer->accurate_seek && opts->correct_pts;
     hr_seek &= seek.exact >= 0 && seek.type != MPSEEK_FACTOR;
     hr_seek &= (opts->hr_seek == 0 && seek.type == MPSEEK_ABSOLUTE) ||
@@ -3217,8 +3317,13 @@ double get_current_pos_ratio(struct MPContext *mpctx, bool use_range)
         ans = av_clipf((pos - start) / len, 0, 1);
     } else {
         int64_t size = (demuxer->movi_end - demuxer->movi_start);
-        int64_t fpos = demuxer->filepos > 0 ?
-                       demuxer->filepos : stream_tell(demuxer->stream);
+        int64_t fpos = demuxer->filepos;
+        if (fpos <= 0) {
+            // The demuxer thread might be reading from the stream.
+            demux_pause(demuxer);
+            fpos = stream_tell(demuxer->stream);
+            demux_unpause(demuxer);
+        }
         if (size > 0)
             ans = av_clipf((double)(fpos - demuxer->movi_start) / size, 0, 1);
     }
@@ -3634,12 +3739,33 @@ static void run_playloop(struct MPContext *mpctx)
     if (!mpctx->timeline && mpctx->demuxer)
         add_demuxer_tracks(mpctx, mpctx->demuxer);
 
+    if (mpctx->stream &&
+        mp_atomic_add_and_fetch(&mpctx->stream->capture_failed, 0))
+    {
+        demux_pause(mpctx->demuxer);
+        stream_set_capture_file(mpctx->stream, NULL, false);
+        demux_unpause(mpctx->demuxer);
+    }
+
     if (mpctx->timeline) {
         double end = mpctx->timeline[mpctx->timeline_part + 1].start;
         if (endpts == MP_NOPTS_VALUE || end < endpts) {
             endpts = end;
             end_is_chapter = true;
         }
+        // Give the source of the next part time to prefetch the data it
+        // needs when switching to it.
+        int next = mpctx->timeline_part + 1;
+        double now = get_current_time(mpctx);
+        if (next < mpctx->num_timeline_parts &&
+            next != mpctx->timeline_prefetch_part &&
+            end - now < TIMELINE_PREFETCH_TIME)
+        {
+            struct timeline_part *n = mpctx->timeline + next;
+            mpctx->timeline_prefetch_part = next;
+            demux_control(n->source, DEMUXER_CTRL_PREFETCH,
+                          &(double){n->source_start});
+        }
     }
 
     if (opts->chapterrange[1] > 0) {
@@ -3685,6 +3811,7 @@ static void run_playloop(struct MPContext *mpctx)
                 break;
             }
             video_left = frame_time >= 0;
+            update_framedrop_level(mpctx, frame_time);
             if (video_left && !mpctx->restart_playback) {
                 mpctx->time_frame += frame_time / opts->playback_speed;
                 adjust_sync(mpctx, frame_time);
@@ -3703,7 +3830,8 @@ static void run_playloop(struct MPContext *mpctx)
         if (!video_left || (mpctx->paused && !mpctx->restart_playback))
             break;
         if (!vo->frame_loaded) {
-            sleeptime = 0;
+            if (!mpctx->video_decoder_waiting)
+                sleeptime = 0;
             break;
         }
 
@@ -4313,7 +4441,7 @@ static void stream_dump(struct MPContext *mpctx)
     stream_t *stream = mpctx->stream;
     assert(stream && filename);
 
-    stream_set_capture_file(stream, filename);
+    stream_set_capture_file(stream, filename, true);
 
     while (mpctx->stop_play == KEEP_PLAYING && !stream->eof) {
         if (!opts->quiet && ((stream->pos / (1024 * 1024)) % 2) == 1) {
@@ -4325,6 +4453,8 @@ static void stream_dump(struct MPContext *mpctx)
             talloc_free(line);
         }
         stream_fill_buffer(stream);
+        if (stream->capture_failed)
+            break;
         for (;;) {
             mp_cmd_t *cmd = mp_input_get_cmd(mpctx->input, 0, false);
             if (!cmd)
@@ -4468,7 +4598,7 @@ static void play_current_file(struct MPContext *mpctx)
         if (demux_was_interrupted(mpctx))
             goto terminate_playback;
 
-    stream_set_capture_file(mpctx->stream, opts->stream_capture);
+    stream_set_capture_file(mpctx->stream, opts->stream_capture, false);
 
 #ifdef CONFIG_DVBIN
 goto_reopen_demuxer: ;
@@ -4554,6 +4684,15 @@ goto_reopen_demuxer: ;
 
     preselect_demux_streams(mpctx);
 
+    // Not done on open, because timeline sources and probed files are opened
+    // the same way, but aren't necessarily played.
+    demux_control(mpctx->master_demuxer, DEMUXER_CTRL_START_INDEXING, NULL);
+
+    if (opts->demuxer_thread) {
+        for (int n = 0; n < mpctx->num_sources; n++)
+            demux_start_thread(mpctx->sources[n]);
+    }
+
 #ifdef CONFIG_ENCODING
     if (mpctx->encode_lavc_ctx && mpctx->current_track[STREAM_VIDEO])
         encode_lavc_expect_stream(mpctx->encode_lavc_ctx, AVMEDIA_TYPE_VIDEO);
@@ -4600,6 +4739,10 @@ goto_reopen_demuxer: ;
 
     mpctx->drop_frame_cnt = 0;
     mpctx->dropped_frames = 0;
+    mpctx->framedrop_level = 0;
+    mpctx->framedrop_pressure = 0;
+    mpctx->frame_cost = 0;
+    mpctx->filter_time = 0;
     mpctx->max_frames = opts->play_frames;
 
     if (mpctx->max_frames == 0) {
@@ -365,6 +365,9 @@ const m_option_t mp_opts[] = {
     OPT_FLOATRANGE("cache-seek-min", stream_cache_seek_min_percent, 0, 0, 99),
     OPT_CHOICE_OR_INT("cache-pause", stream_cache_pause, 0,
                       0, 40, ({"no", -1})),
+    OPT_FLAG("cache-sparse", stream_cache_sparse, 0),
+    OPT_STRING("cache-file", stream_cache_file, 0),
+    OPT_INTRANGE("cache-file-size", stream_cache_file_size, 0, 0, 0x7fffffff),
 #endif /* CONFIG_STREAM_CACHE */
     {"cdrom-device", &cdrom_device, CONF_TYPE_STRING, 0, 0, 0, NULL},
 #ifdef CONFIG_DVDREAD
@@ -477,7 +480,10 @@ const m_option_t mp_opts[] = {
                 {"yes", 1}, {"", 1})),
 
     OPT_STRING("ad", audio_decoders, 0),
+    OPT_FLAG("ad-thread", audio_decoder_thread, 0),
+    OPT_FLOATRANGE("ad-thread-buffer", audio_decoder_buffer, 0, 0.05, 10),
     OPT_STRING("vd", video_decoders, 0),
+    OPT_FLAG("vd-thread", video_decoder_thread, 0),
 
     OPT_FLAG("ad-spdif-dtshd", dtshd, 0),
     OPT_FLAG("dtshd", dtshd, 0), // old alias
@@ -518,8 +524,14 @@ const m_option_t mp_opts[] = {
     {"demuxer-rawaudio", (void *)&demux_rawaudio_opts, CONF_TYPE_SUBCONFIG},
     {"demuxer-rawvideo", (void *)&demux_rawvideo_opts, CONF_TYPE_SUBCONFIG},
 
+    OPT_FLAG("demuxer-thread", demuxer_thread, 0),
+    OPT_INTRANGE("demuxer-queue-size", demuxer_queue_size, 0, 1024, 1024*1024),
+    OPT_INTRANGE("demuxer-back-buffer", demuxer_back_buffer, 0, 0, 1024*1024),
+    OPT_FLAG("demuxer-index-cache", demuxer_index_cache, 0),
     OPT_FLAG("demuxer-mkv-subtitle-preroll", mkv_subtitle_preroll, 0),
     OPT_FLAG("mkv-subtitle-preroll", mkv_subtitle_preroll, 0), // old alias
+    OPT_FLAG("demuxer-mkv-index-cache", mkv_index_cache, 0),
+    OPT_FLAG("demuxer-mkv-index-thread", mkv_index_thread, 0),
 
 // ------------------------- subtitles options --------------------
 
@@ -670,11 +682,13 @@ const m_option_t mp_opts[] = {
     OPT_CHOICE("framedrop", frame_dropping, 0,
                ({"no", 0},
                 {"yes", 1},
-                {"hard", 2})),
+                {"hard", 2},
+                {"adaptive", 3})),
 
     OPT_FLAG("untimed", untimed, 0),
 
     OPT_STRING("stream-capture", stream_capture, 0),
+    OPT_INTRANGE("stream-capture-buffer", stream_capture_buffer, 0, 64, 1024*1024),
     OPT_STRING("stream-dump", stream_dump, 0),
 
 #ifdef CONFIG_LIRC
@@ -689,6 +703,7 @@ const m_option_t mp_opts[] = {
     OPT_FLAG("save-position-on-quit", position_save_on_quit, 0),
 
     OPT_FLAG("ordered-chapters", ordered_chapters, 0),
+    OPT_FLAG("ordered-chapters-cache", ordered_chapters_cache, 0),
     OPT_INTRANGE("chapter-merge-threshold", chapter_merge_threshold, 0, 0, 10000),
 
     OPT_DOUBLE("chapter-seek-threshold", chapter_seek_threshold, 0),
@@ -811,6 +826,10 @@ const struct MPOpts mp_default_opts = {
     .stream_cache_min_percent = 20.0,
     .stream_cache_seek_min_percent = 50.0,
     .stream_cache_pause = 10.0,
+    .stream_cache_file_size = 1024 * 1024,
+    .stream_capture_buffer = 8192,
+    .demuxer_queue_size = 128 * 1024,
+    .audio_decoder_buffer = 0.5,
     .network_rtsp_transport = 2,
     .chapterrange = {-1, -1},
     .edition_id = -1,
@@ -87,10 +87,12 @@ typedef struct MPOpts {
     int osd_fractions;
     int untimed;
     char *stream_capture;
+    int stream_capture_buffer;
     char *stream_dump;
     int loop_times;
     int shuffle;
     int ordered_chapters;
+    int ordered_chapters_cache;
     int chapter_merge_threshold;
     double chapter_seek_threshold;
     int load_unsafe_playlists;
@@ -103,6 +105,9 @@ typedef struct MPOpts {
     float stream_cache_seek_min_percent;
     int network_rtsp_transport;
     int stream_cache_pause;
+    int stream_cache_sparse;
+    char *stream_cache_file;
+    int stream_cache_file_size;
     int chapterrange[2];
     int edition_id;
     int correct_pts;
@@ -159,7 +164,16 @@ typedef struct MPOpts {
     char *demuxer_name;
     char *audio_demuxer_name;
     char *sub_demuxer_name;
+    int demuxer_thread;
+    int video_decoder_thread;
+    int audio_decoder_thread;
+    float audio_decoder_buffer;
+    int demuxer_queue_size;
+    int demuxer_back_buffer;
+    int demuxer_index_cache;
     int mkv_subtitle_preroll;
+    int mkv_index_cache;
+    int mkv_index_thread;
 
     struct image_writer_opts *screenshot_image_opts;
     char *screenshot_template;
@@ -217,6 +231,7 @@ typedef struct MPOpts {
         char *skip_frame_str;
         int threads;
         int bitexact;
+        int dr;
         char *avopt;
     } lavc_param;
 
@@ -26,6 +26,12 @@
 #include <unistd.h>
 #include <libavutil/common.h>
 
+#include "config.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include "osdep/io.h"
 
 #include "talloc.h"
@@ -34,6 +40,7 @@
 #include "mpvcore/mp_msg.h"
 #include "demux/demux.h"
 #include "mpvcore/path.h"
+#include "mpvcore/user_cache.h"
 #include "mpvcore/bstr.h"
 #include "mpvcore/mp_common.h"
 #include "stream/stream.h"
@@ -201,6 +208,301 @@ static void check_file(struct MPContext *mpctx, struct demuxer **sources,
     }
 }
 
+// Maximum number of files probed for their segment UIDs at the same time.
+#define MAX_PROBE_THREADS 4
+
+#define UID_CACHE_FILE "segment_uids"
+#define UID_CACHE_HEADER "mpv-segment-uids 1"
+#define UID_CACHE_MAX_ENTRIES 10000
+#define UID_CACHE_MAX_LINE (4096 + 1024)
+
+struct segment_uid {
+    unsigned char uid[16];  // all 0 if the segment has none
+};
+
+// Segment UIDs of all segments in a file. The cache file has one line per
+// file: size, mtime, the UIDs in hex concatenated (or "-"), and the path.
+struct file_uids {
+    char *filename;         // for opening the file
+    char *path;             // absolute path (cache key)
+    int64_t size, mtime;
+    struct segment_uid *uids;
+    int num_uids;
+    bool done;              // UIDs were probed or read from the cache
+    bool probed;
+};
+
+struct probe_ctx {
+    struct MPOpts *opts;
+    struct file_uids *files;
+    int num_files;
+#if HAVE_PTHREADS
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;  // a file was probed
+    int next;               // next file to probe
+    bool stop;              // all sources found
+#endif
+};
+
+// Read the UIDs of all segments without opening them completely (demux_mkv
+// stops after reading the segment info if the UID is not wanted).
+static void probe_file(struct MPOpts *opts, struct file_uids *f)
+{
+    struct stream *s = stream_open(f->filename, opts);
+    if (!s)
+        return;
+    unsigned char none[1][16];
+    for (int segment = 0; ; segment++) {
+        bool was_valid = false;
+        struct segment_uid uid = {{0}};
+        struct demuxer_params params = {
+            .matroska_num_wanted_uids = 0,
+            .matroska_wanted_uids = none,
+            .matroska_wanted_segment = segment,
+            .matroska_was_valid = &was_valid,
+            .matroska_found_uid = uid.uid,
+        };
+        free_demuxer(demux_open(s, "mkv", &params, opts));
+        if (!was_valid)
+            break;
+        MP_TARRAY_APPEND(NULL, f->uids, f->num_uids, uid);
+    }
+    free_stream(s);
+    f->probed = true;
+}
+
+#if HAVE_PTHREADS
+static void *probe_thread(void *arg)
+{
+    struct probe_ctx *ctx = arg;
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->stop && ctx->next < ctx->num_files) {
+        struct file_uids *f = &ctx->files[ctx->next++];
+        if (f->done)
+            continue;
+        pthread_mutex_unlock(&ctx->lock);
+        probe_file(ctx->opts, f);
+        pthread_mutex_lock(&ctx->lock);
+        f->done = true;
+        pthread_cond_broadcast(&ctx->wakeup);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+#endif
+
+static bool parse_uids(struct file_uids *f, bstr hex)
+{
+    if (bstr_equals0(hex, "-"))
+        return true;
+    if (!hex.len || hex.len % 32 ||
+        bstrspn(hex, "0123456789abcdefABCDEF") != hex.len)
+        return false;
+    for (int n = 0; n < hex.len / 32; n++) {
+        struct segment_uid uid;
+        for (int i = 0; i < 16; i++) {
+            bstr digits = bstr_splice(hex, n * 32 + i * 2, n * 32 + i * 2 + 2);
+            uid.uid[i] = bstrtoll(digits, NULL, 16);
+        }
+        MP_TARRAY_APPEND(NULL, f->uids, f->num_uids, uid);
+    }
+    return true;
+}
+
+// Length of the cache line for f, including the newline.
+static size_t uid_cache_line_length(struct file_uids *f)
+{
+    char buf[64];
+    int len = snprintf(buf, sizeof(buf), "%"PRId64" %"PRId64" ", f->size,
+                       f->mtime);
+    return len + (f->num_uids ? f->num_uids * 32 : 1) + 1 + strlen(f->path) + 1;
+}
+
+static void load_uid_cache(void *ta_parent, struct file_uids **entries,
+                           int *num_entries)
+{
+    FILE *fp = mp_user_cache_open(UID_CACHE_FILE, UID_CACHE_HEADER);
+    if (!fp)
+        return;
+    char line[UID_CACHE_MAX_LINE + 1];
+    while (fgets(line, sizeof(line), fp)) {
+        size_t len = strcspn(line, "\n");
+        if (!line[len] && !feof(fp)) {
+            // Not written by save_uid_cache(); skip the rest of the line.
+            int c;
+            while ((c = fgetc(fp)) != EOF && c != '\n') {}
+            continue;
+        }
+        line[len] = '\0';
+        struct file_uids f = {0};
+        int pos = 0;
+        if (sscanf(line, "%"SCNd64" %"SCNd64" %n", &f.size, &f.mtime,
+                   &pos) != 2 || !pos)
+            continue;
+        bstr hex, path;
+        if (!bstr_split_tok(bstr0(line + pos), " ", &hex, &path) ||
+            !path.len || !parse_uids(&f, hex))
+        {
+            talloc_free(f.uids);
+            continue;
+        }
+        f.path = bstrdup0(ta_parent, path);
+        talloc_steal(ta_parent, f.uids);
+        MP_TARRAY_APPEND(ta_parent, *entries, *num_entries, f);
+    }
+    fclose(fp);
+}
+
+// Write the entries for the current files first, so that they're kept if the
+// cache gets too large. Entries with too many segments (or too long paths)
+// to be read back by load_uid_cache() are left out.
+static void save_uid_cache(struct probe_ctx *ctx, struct file_uids *cached,
+                           int num_cached)
+{
+    struct mp_user_cache_writer *w =
+        mp_user_cache_create(UID_CACHE_FILE, UID_CACHE_HEADER);
+    if (!w)
+        return;
+    int num = 0;
+    for (int n = 0; n < ctx->num_files + num_cached; n++) {
+        struct file_uids *f = n < ctx->num_files ? &ctx->files[n]
+                                                 : &cached[n - ctx->num_files];
+        if (!f->done || !f->path || num >= UID_CACHE_MAX_ENTRIES ||
+            uid_cache_line_length(f) > UID_CACHE_MAX_LINE)
+            continue;
+        bool dup = false;
+        for (int i = 0; i < ctx->num_files && n >= ctx->num_files; i++)
+            dup |= ctx->files[i].done && strcmp(ctx->files[i].path, f->path) == 0;
+        if (dup)
+            continue;
+        fprintf(w->f, "%"PRId64" %"PRId64" ", f->size, f->mtime);
+        for (int i = 0; i < f->num_uids; i++) {
+            for (int b = 0; b < 16; b++)
+                fprintf(w->f, "%02x", f->uids[i].uid[b]);
+        }
+        fprintf(w->f, "%s %s\n", f->num_uids ? "" : "-", f->path);
+        num++;
+    }
+    mp_user_cache_commit(w);
+}
+
+static void init_file_uids(struct probe_ctx *ctx, char **filenames,
+                           int num_filenames, struct file_uids *cached,
+                           int num_cached)
+{
+    char *cwd = mp_getcwd(ctx);
+    ctx->files = talloc_zero_array(ctx, struct file_uids, num_filenames);
+    ctx->num_files = num_filenames;
+    for (int n = 0; n < num_filenames; n++) {
+        struct file_uids *f = &ctx->files[n];
+        f->filename = filenames[n];
+        if (!cwd || !mp_user_cache_stat(filenames[n], &f->size, &f->mtime))
+            continue;
+        f->path = mp_path_join(ctx, bstr0(cwd), bstr0(filenames[n]));
+        for (int i = 0; i < num_cached; i++) {
+            struct file_uids *c = &cached[i];
+            if (c->size == f->size && c->mtime == f->mtime &&
+                strcmp(c->path, f->path) == 0)
+            {
+                f->uids = c->uids;
+                f->num_uids = c->num_uids;
+                f->done = true;
+                break;
+            }
+        }
+    }
+}
+
+static void match_file(struct MPContext *mpctx, struct demuxer **sources,
+                       int num_sources, unsigned char uid_map[][16],
+                       struct file_uids *f)
+{
+    for (int segment = 0; segment < f->num_uids; segment++) {
+        for (int i = 1; i < num_sources; i++) {
+            if (!sources[i] && !memcmp(uid_map[i], f->uids[segment].uid, 16)) {
+                check_file_seg(mpctx, sources, num_sources, uid_map,
+                               f->filename, segment);
+                break;
+            }
+        }
+    }
+}
+
+static bool missing(struct demuxer **sources, int num_sources);
+
+// Check the files in order of filenames[], while up to MAX_PROBE_THREADS
+// threads read the segment UIDs of the following files.
+static void check_files(struct MPContext *mpctx, struct demuxer **sources,
+                        int num_sources, unsigned char uid_map[][16],
+                        char **filenames, int num_filenames)
+{
+    struct MPOpts *opts = mpctx->opts;
+    struct probe_ctx *ctx = talloc_ptrtype(NULL, ctx);
+    *ctx = (struct probe_ctx) { .opts = opts };
+
+    struct file_uids *cached = NULL;
+    int num_cached = 0;
+    if (opts->ordered_chapters_cache)
+        load_uid_cache(ctx, &cached, &num_cached);
+    init_file_uids(ctx, filenames, num_filenames, cached, num_cached);
+
+    int num_threads = 0;
+#if HAVE_PTHREADS
+    pthread_t threads[MAX_PROBE_THREADS];
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->wakeup, NULL);
+    for (int n = 0; n < MAX_PROBE_THREADS && n < num_filenames; n++) {
+        if (pthread_create(&threads[n], NULL, probe_thread, ctx))
+            break;
+        num_threads++;
+    }
+    pthread_mutex_lock(&ctx->lock);
+#endif
+
+    for (int n = 0; n < num_filenames; n++) {
+        struct file_uids *f = &ctx->files[n];
+        if (!missing(sources, num_sources))
+            break;
+        while (!f->done) {
+#if HAVE_PTHREADS
+            if (num_threads) {
+                pthread_cond_wait(&ctx->wakeup, &ctx->lock);
+                continue;
+            }
+#endif
+            probe_file(opts, f);
+            f->done = true;
+        }
+#if HAVE_PTHREADS
+        pthread_mutex_unlock(&ctx->lock);
+#endif
+        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Checking file %s\n", f->filename);
+        talloc_steal(ctx, f->uids);
+        match_file(mpctx, sources, num_sources, uid_map, f);
+#if HAVE_PTHREADS
+        pthread_mutex_lock(&ctx->lock);
+#endif
+    }
+
+#if HAVE_PTHREADS
+    ctx->stop = true;
+    pthread_mutex_unlock(&ctx->lock);
+    for (int n = 0; n < num_threads; n++)
+        pthread_join(threads[n], NULL);
+    pthread_cond_destroy(&ctx->wakeup);
+    pthread_mutex_destroy(&ctx->lock);
+#endif
+
+    bool probed = false;
+    for (int n = 0; n < num_filenames; n++) {
+        talloc_steal(ctx, ctx->files[n].uids);
+        probed |= ctx->files[n].probed;
+    }
+    if (opts->ordered_chapters_cache && probed)
+        save_uid_cache(ctx, cached, num_cached);
+    talloc_free(ctx);
+}
+
 static bool missing(struct demuxer **sources, int num_sources)
 {
     for (int i = 0; i < num_sources; i++) {
@@ -234,12 +536,7 @@ static int find_ordered_chapter_sources(struct MPContext *mpctx,
         check_file(mpctx, sources, num_sources, uid_map, main_filename, 1);
     }
 
-    for (int i = 0; i < num_filenames; i++) {
-        if (!missing(sources, num_sources))
-            break;
-        mp_msg(MSGT_CPLAYER, MSGL_INFO, "Checking file %s\n", filenames[i]);
-        check_file(mpctx, sources, num_sources, uid_map, filenames[i], 0);
-    }
+    check_files(mpctx, sources, num_sources, uid_map, filenames, num_filenames);
 
     talloc_free(filenames);
     if (missing(sources, num_sources)) {
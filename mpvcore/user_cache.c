@@ -0,0 +1,124 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "talloc.h"
+#include "osdep/io.h"
+#include "mpvcore/mp_msg.h"
+#include "mpvcore/path.h"
+#include "mpvcore/bstr.h"
+#include "stream/stream.h"
+#include "mpvcore/user_cache.h"
+
+const char *mp_user_cache_stream_file(struct stream *s)
+{
+    if (s->uncached_type != STREAMTYPE_FILE)
+        return NULL;
+    stream_t *file = s->uncached_stream ? s->uncached_stream : s;
+    return file->path;
+}
+
+bool mp_user_cache_stat(const char *path, int64_t *size, int64_t *mtime)
+{
+    struct stat st;
+    if (!path || mp_stat(path, &st) != 0)
+        return false;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+    return true;
+}
+
+FILE *mp_user_cache_open(const char *name, const char *header)
+{
+    char *filename = mp_find_user_config_file(name);
+    FILE *f = filename ? fopen(filename, "rb") : NULL;
+    talloc_free(filename);
+    if (!f)
+        return NULL;
+    size_t len = strlen(header);
+    char line[256];
+    if (len + 2 > sizeof(line) || !fgets(line, sizeof(line), f) ||
+        strncmp(line, header, len) != 0 || strcmp(line + len, "\n") != 0)
+    {
+        mp_msg(MSGT_GLOBAL, MSGL_V, "Ignoring cache file %s with unknown "
+               "format.\n", name);
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+struct mp_user_cache_writer *mp_user_cache_create(const char *name,
+                                                  const char *header)
+{
+    struct mp_user_cache_writer *w = talloc_zero(NULL, struct mp_user_cache_writer);
+    w->filename = mp_find_user_config_file(name);
+    if (!w->filename)
+        goto error;
+    talloc_steal(w, w->filename);
+    bstr dir = mp_dirname(name);
+    if (!bstr_equals0(dir, ".")) {
+        char *dirname = bstrdup0(w, dir);
+        char *path = mp_find_user_config_file(dirname);
+        if (path)
+            mkdir(path, 0777);
+        talloc_free(path);
+    }
+    // Unique per writer, so that concurrent writers don't clobber each other.
+    w->tmpname = talloc_asprintf(w, "%s.%d-%p.tmp", w->filename, (int)getpid(),
+                                 (void *)w);
+    w->f = fopen(w->tmpname, "wb");
+    if (!w->f)
+        goto error;
+    fprintf(w->f, "%s\n", header);
+    return w;
+error:
+    talloc_free(w);
+    return NULL;
+}
+
+bool mp_user_cache_commit(struct mp_user_cache_writer *w)
+{
+    bool ok = !ferror(w->f);
+    if (fclose(w->f) != 0)
+        ok = false;
+#ifdef _WIN32
+    // Windows rename() doesn't replace existing files.
+    if (ok)
+        unlink(w->filename);
+#endif
+    if (ok && rename(w->tmpname, w->filename) != 0)
+        ok = false;
+    if (!ok) {
+        mp_msg(MSGT_GLOBAL, MSGL_WARN, "Could not write %s.\n", w->filename);
+        unlink(w->tmpname);
+    }
+    talloc_free(w);
+    return ok;
+}
+
+void mp_user_cache_abort(struct mp_user_cache_writer *w)
+{
+    fclose(w->f);
+    unlink(w->tmpname);
+    talloc_free(w);
+}
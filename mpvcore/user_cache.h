@@ -0,0 +1,65 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MP_USER_CACHE_H
+#define MP_USER_CACHE_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Sidecar cache files in the user config directory, which store data derived
+// from media files (like seek indexes), so that it doesn't have to be created
+// again the next time. Cache files are text files starting with a header
+// line, which identifies the format and version.
+
+struct stream;
+
+// Return the filename of the local file s reads from, or NULL.
+const char *mp_user_cache_stream_file(struct stream *s);
+
+// Get size and mtime of a local file; cache files store them to detect if the
+// file was changed. Returns false if path is NULL or the file doesn't exist.
+bool mp_user_cache_stat(const char *path, int64_t *size, int64_t *mtime);
+
+// Open the cache file name (relative to the user config directory) for
+// reading. The header line has already been read from the returned file.
+// Returns NULL if the file doesn't exist or has a different header.
+FILE *mp_user_cache_open(const char *name, const char *header);
+
+struct mp_user_cache_writer {
+    FILE *f;            // write the contents after the header line to this
+    char *filename;
+    char *tmpname;
+};
+
+// Start writing the cache file name. The directory part of name is created
+// if needed. The contents are written to a temporary file, which replaces
+// the cache file only on mp_user_cache_commit(), so that readers (including
+// other mpv instances) never see a partially written file.
+// Returns NULL on failure.
+struct mp_user_cache_writer *mp_user_cache_create(const char *name,
+                                                  const char *header);
+
+// Finish writing and replace the cache file. On error, the old cache file is
+// left alone. w is always freed. Returns success.
+bool mp_user_cache_commit(struct mp_user_cache_writer *w);
+
+// Discard the contents written so far, and free w.
+void mp_user_cache_abort(struct mp_user_cache_writer *w);
+
+#endif
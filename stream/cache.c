@@ -52,11 +52,25 @@
 #include "osdep/timer.h"
 
 #include "mpvcore/mp_msg.h"
+#include "mpvcore/options.h"
 
 #include "stream.h"
 #include "mpvcore/mp_common.h"
 
 
+// Statistics for each second.
+struct cache_history {
+    int64_t bytes_read;
+    int fill;               // fill state at the start of the second in percent
+};
+
+// Dropped data in the ringbuffer, which wasn't written to the spill file yet.
+struct spill_pending {
+    int64_t pos;            // stream position of the first byte
+    int64_t buf_pos;        // position in priv.buffer (the range doesn't wrap)
+    int64_t len;
+};
+
 // Note: (struct priv*)(cache->priv)->cache == cache
 struct priv {
     pthread_t cache_thread;
@@ -79,7 +93,11 @@ struct priv {
     stream_t *stream;       // "real" stream, used to read from the source media
 
     // All the following members are shared between the threads.
-    // You must lock the mutex to access them.
+    // You must lock the mutex to access them. Exception: in ringbuffer mode,
+    // the reader can read data without locking (see cache_fill_buffer()).
+    // For this, the cache thread changes min_filepos, max_filepos, offset and
+    // idle only with store64()/__sync builtins (and while holding the mutex),
+    // and read_filepos is accessed with load64()/store64() everywhere.
 
     // Ringbuffer
     int64_t min_filepos;    // range of file that is cached in the buffer
@@ -87,7 +105,45 @@ struct priv {
     bool eof;               // true if max_filepos = EOF
     int64_t offset;         // buffer[offset] correponds to max_filepos
 
-    bool idle;              // cache thread has stopped reading
+    // Sparse mode (if blocks is set): instead of the ringbuffer, the buffer
+    // is split into blocks of CACHE_BLOCK_SIZE bytes, each caching a part of
+    // the file aligned to the block size. The cached parts don't need to be
+    // contiguous, and blocks are reused in LRU order. min_filepos/max_filepos
+    // and offset are not used in this mode, except that max_filepos is the
+    // end of the cached data starting at read_filepos.
+    struct cache_block *blocks;
+    int num_blocks;
+    int last_block;         // index of the last block found (lookup hint)
+    uint64_t use_counter;
+
+    // Spill file (if spill_file is set): data evicted from the buffer is
+    // written to it. If the reader seeks back to data that is in the file,
+    // it's read from the file instead of the stream. Owned by the cache
+    // thread, like the stream.
+    FILE *spill_file;
+    int64_t spill_size;         // max. size of the spill file
+    int64_t spill_write_pos;    // file offset where the next data is written
+    struct spill_range *spill;  // parts of the stream stored in the file
+    int num_spill;
+    // Ringbuffer contents dropped on a seek, which are written to the spill
+    // file only when new data overwrites them (see spill_defer_buffer()).
+    struct spill_pending *pending_spill;
+    int num_pending_spill;
+
+    // Byte range hinted with STREAM_CTRL_PREFETCH (prefetch_end == 0: none)
+    int64_t prefetch_start, prefetch_end;
+    bool prefetch_new;      // not passed to the stream yet
+
+    // Statistics (STREAM_CTRL_GET_CACHE_STATS)
+    int64_t stat_bytes_read;
+    int64_t stat_stalls;
+    double stat_stall_time;
+    int64_t stat_seeks_cached, stat_seeks_stream;
+    int64_t stat_slot;      // history[stat_slot % STREAM_CACHE_HISTORY] is
+                            // the current second (in mp_time_sec() units)
+    struct cache_history history[STREAM_CACHE_HISTORY];
+
+    int idle;               // cache thread has stopped reading
 
     int64_t read_filepos;   // client read position (mirrors cache->pos)
     int control;            // requested STREAM_CTRL_... or CACHE_CTRL_...
@@ -112,8 +168,25 @@ struct byte_meta {
     float stream_pts;
 };
 
+// Sparse mode only. The data is at buffer[index * CACHE_BLOCK_SIZE].
+struct cache_block {
+    int64_t pos;            // file position of the first byte, -1 if unused
+    int64_t len;            // number of valid bytes
+    uint64_t last_use;      // for LRU eviction
+    float stream_pts;
+};
+
+// A contiguous part of the stream stored in the spill file. Ranges never
+// overlap, neither in the stream nor in the file, and are unordered.
+struct spill_range {
+    int64_t pos;            // stream position of the first byte
+    int64_t offset;         // file offset of the first byte
+    int64_t len;
+};
+
 enum {
     BYTE_META_CHUNK_SIZE = 8 * 1024,
+    CACHE_BLOCK_SIZE = 64 * 1024,
 
     CACHE_INTERRUPTED = -1,
 
@@ -122,6 +195,25 @@ enum {
     CACHE_CTRL_PING = -2,
 };
 
+// The __sync builtins are full memory barriers, and make 64 bit accesses
+// atomic on 32 bit systems too.
+static int64_t load64(int64_t *p)
+{
+    return __sync_fetch_and_add(p, 0);
+}
+
+static void store64(int64_t *p, int64_t val)
+{
+    int64_t old = *p;
+    while (!__sync_bool_compare_and_swap(p, old, val))
+        old = *p;
+}
+
+static void set_idle(struct priv *s, bool idle)
+{
+    __sync_lock_test_and_set(&s->idle, idle);
+}
+
 static int64_t mp_clipi64(int64_t val, int64_t min, int64_t max)
 {
     val = FFMIN(val, max);
@@ -180,37 +272,388 @@ static int cache_wakeup_and_wait(struct priv *s, double *retry_time)
     return 0;
 }
 
+static int cache_fill_percent(struct priv *s)
+{
+    int64_t fill = s->max_filepos - load64(&s->read_filepos);
+    return FFMAX(fill, 0) / (s->buffer_size / 100);
+}
+
+// Start new entries in s->history for each second passed since the last call.
+static void update_history(struct priv *s)
+{
+    int64_t now = mp_time_sec();
+    s->stat_slot = FFMAX(s->stat_slot, now - STREAM_CACHE_HISTORY);
+    while (s->stat_slot < now) {
+        s->stat_slot++;
+        s->history[s->stat_slot % STREAM_CACHE_HISTORY] =
+            (struct cache_history){ .fill = cache_fill_percent(s) };
+    }
+}
+
+// Runs in the cache thread
+static void account_read(struct priv *s, int len)
+{
+    if (len > 0) {
+        update_history(s);
+        s->stat_bytes_read += len;
+        s->history[s->stat_slot % STREAM_CACHE_HISTORY].bytes_read += len;
+    }
+}
+
+// Runs in the main thread
+// Called after the reader waited for data for wait_time seconds.
+static void account_stall(struct priv *s, double wait_time)
+{
+    if (wait_time > 0) {
+        s->stat_stalls++;
+        s->stat_stall_time += wait_time;
+    }
+}
+
+// Average read speed over the last num_secs seconds (not including the
+// current second).
+static double get_speed(struct priv *s, int num_secs)
+{
+    int64_t bytes = 0;
+    for (int n = 1; n <= num_secs; n++)
+        bytes += s->history[(s->stat_slot - n) % STREAM_CACHE_HISTORY].bytes_read;
+    return bytes / (double)num_secs;
+}
+
+static void get_stats(struct priv *s, struct stream_cache_stats *st)
+{
+    update_history(s);
+    *st = (struct stream_cache_stats){
+        .bytes_read = s->stat_bytes_read,
+        .speed_1s = get_speed(s, 1),
+        .speed_10s = get_speed(s, 10),
+        .speed_60s = get_speed(s, STREAM_CACHE_HISTORY - 1),
+        .stalls = s->stat_stalls,
+        .stall_time = s->stat_stall_time,
+        .seeks_cached = s->stat_seeks_cached,
+        .seeks_stream = s->stat_seeks_stream,
+    };
+    for (int n = 0; n < STREAM_CACHE_HISTORY; n++) {
+        int64_t slot = s->stat_slot - (STREAM_CACHE_HISTORY - 1) + n;
+        st->fill_history[n] = s->history[slot % STREAM_CACHE_HISTORY].fill;
+    }
+}
+
 // Runs in the cache thread
 static void cache_drop_contents(struct priv *s)
 {
-    s->offset = s->min_filepos = s->max_filepos = s->read_filepos;
+    int64_t read = load64(&s->read_filepos);
+    store64(&s->offset, read);
+    store64(&s->min_filepos, read);
+    store64(&s->max_filepos, read);
     s->eof = false;
+    for (int n = 0; n < s->num_blocks; n++)
+        s->blocks[n] = (struct cache_block){ .pos = -1 };
 }
 
-// Runs in the main thread
-// mutex must be held, but is sometimes temporarily dropped
-static int cache_read(struct priv *s, unsigned char *buf, int size)
+// Runs in the cache thread
+static void spill_close(struct priv *s)
 {
-    if (size <= 0)
+    if (s->spill_file)
+        fclose(s->spill_file);
+    s->spill_file = NULL;
+    s->num_spill = 0;
+    s->num_pending_spill = 0;
+}
+
+// Remove start..end from the spill ranges. If by_offset is set, start and end
+// are file offsets, otherwise stream positions. Ranges are split if needed.
+static void spill_remove(struct priv *s, int64_t start, int64_t end,
+                         bool by_offset)
+{
+    for (int n = s->num_spill - 1; n >= 0; n--) {
+        struct spill_range r = s->spill[n];
+        int64_t r_start = by_offset ? r.offset : r.pos;
+        int64_t r_end = r_start + r.len;
+        if (r_end <= start || r_start >= end)
+            continue;
+        MP_TARRAY_REMOVE_AT(s->spill, s->num_spill, n);
+        if (r_start < start) {
+            MP_TARRAY_APPEND(s, s->spill, s->num_spill, (struct spill_range){
+                .pos = r.pos, .offset = r.offset, .len = start - r_start });
+        }
+        if (r_end > end) {
+            int64_t skip = end - r_start;
+            MP_TARRAY_APPEND(s, s->spill, s->num_spill, (struct spill_range){
+                .pos = r.pos + skip, .offset = r.offset + skip,
+                .len = r_end - end });
+        }
+    }
+}
+
+// Return the spill range containing the stream position pos, or NULL.
+static struct spill_range *spill_find(struct priv *s, int64_t pos)
+{
+    for (int n = 0; n < s->num_spill; n++) {
+        struct spill_range *r = &s->spill[n];
+        if (pos >= r->pos && pos < r->pos + r->len)
+            return r;
+    }
+    return NULL;
+}
+
+// Store data evicted from the buffer in the spill file. The file is used
+// as ringbuffer: if it's full, the oldest data is overwritten.
+// Runs in the cache thread
+// mutex must be held, but is temporarily dropped while writing the file (data
+// must not be changed by other threads)
+static void spill_write(struct priv *s, int64_t pos, unsigned char *data,
+                        int64_t len)
+{
+    if (!s->spill_file || len <= 0)
+        return;
+
+    // Keep the end, which is closest to the position data was evicted at.
+    if (len > s->spill_size) {
+        data += len - s->spill_size;
+        pos += len - s->spill_size;
+        len = s->spill_size;
+    }
+
+    struct spill_range *r = spill_find(s, pos);
+    if (r && pos + len <= r->pos + r->len)
+        return; // was read from the spill file, and is still there
+
+    if (s->spill_write_pos + len > s->spill_size)
+        s->spill_write_pos = 0;
+    int64_t offset = s->spill_write_pos;
+
+    spill_remove(s, pos, pos + len, false);
+    spill_remove(s, offset, offset + len, true);
+
+    // The spill file and the ranges are changed by the cache thread only.
+    pthread_mutex_unlock(&s->mutex);
+    bool ok = fseeko(s->spill_file, offset, SEEK_SET) == 0 &&
+              fwrite(data, len, 1, s->spill_file) == 1;
+    pthread_mutex_lock(&s->mutex);
+    if (!ok) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Writing to cache file failed: %s. "
+               "Disabling it.\n", strerror(errno));
+        spill_close(s);
+        return;
+    }
+    s->spill_write_pos += len;
+
+    // Extend the range that ends where the new data starts, if any.
+    for (int n = 0; n < s->num_spill; n++) {
+        r = &s->spill[n];
+        if (r->pos + r->len == pos && r->offset + r->len == offset) {
+            r->len += len;
+            return;
+        }
+    }
+    MP_TARRAY_APPEND(s, s->spill, s->num_spill, (struct spill_range){
+        .pos = pos, .offset = offset, .len = len });
+}
+
+// Return the position in the ringbuffer of the stream position pos, with
+// offset being the value of s->offset the position refers to.
+static int64_t buffer_pos(struct priv *s, int64_t pos, int64_t offset)
+{
+    pos -= offset;
+    if (pos < 0)
+        pos += s->buffer_size;
+    else if (pos >= s->buffer_size)
+        pos -= s->buffer_size;
+    return pos;
+}
+
+// Store the part start..end of the ringbuffer in the spill file. offset is the
+// value of s->offset the range refers to. The range must not be accessible to
+// the reader anymore (see spill_write()).
+// Runs in the cache thread
+static void spill_write_buffer(struct priv *s, int64_t start, int64_t end,
+                               int64_t offset)
+{
+    while (s->spill_file && start < end) {
+        int64_t pos = buffer_pos(s, start, offset);
+        int64_t len = FFMIN(end - start, s->buffer_size - pos);
+        spill_write(s, start, &s->buffer[pos], len);
+        start += len;
+    }
+}
+
+// Write the deferred data stored in the buffer area before buf_end to the
+// spill file. Must be called before overwriting buffer data.
+// Runs in the cache thread
+static void spill_flush_pending(struct priv *s, int64_t buf_end)
+{
+    for (int n = s->num_pending_spill - 1; n >= 0 && s->spill_file; n--) {
+        struct spill_pending p = s->pending_spill[n];
+        int64_t len = FFMIN(buf_end - p.buf_pos, p.len);
+        if (len <= 0)
+            continue;
+        // spill_write() drops the mutex, so update this first.
+        if (len == p.len) {
+            MP_TARRAY_REMOVE_AT(s->pending_spill, s->num_pending_spill, n);
+        } else {
+            s->pending_spill[n].pos += len;
+            s->pending_spill[n].buf_pos += len;
+            s->pending_spill[n].len -= len;
+        }
+        spill_write(s, p.pos, &s->buffer[p.buf_pos], len);
+    }
+}
+
+// Like spill_write_buffer(), but don't write the data yet. The buffer is
+// refilled from its start after the cache contents are dropped, so the data
+// is written piece by piece with spill_flush_pending() as it's overwritten,
+// instead of all at once before the data at the new position can be read.
+// Data deferred by earlier seeks is kept; it's in a different part of the
+// buffer, which the new data didn't reach yet.
+// Runs in the cache thread
+static void spill_defer_buffer(struct priv *s, int64_t start, int64_t end,
+                               int64_t offset)
+{
+    while (s->spill_file && start < end) {
+        int64_t pos = buffer_pos(s, start, offset);
+        int64_t len = FFMIN(end - start, s->buffer_size - pos);
+        MP_TARRAY_APPEND(s, s->pending_spill, s->num_pending_spill,
+                         (struct spill_pending){start, pos, len});
+        start += len;
+    }
+}
+
+// Read data at the stream position pos from the spill file. Returns the number
+// of bytes read, or 0 if the spill file doesn't contain pos.
+// Runs in the cache thread
+// mutex must be held, but is temporarily dropped while reading the file (buf
+// must not be accessed by other threads)
+static int spill_read(struct priv *s, int64_t pos, unsigned char *buf,
+                      int64_t len)
+{
+    struct spill_range *r = s->spill_file ? spill_find(s, pos) : NULL;
+    if (!r)
         return 0;
+    len = FFMIN(len, r->pos + r->len - pos);
+    int64_t offset = r->offset + (pos - r->pos);
+    pthread_mutex_unlock(&s->mutex);
+    bool ok = fseeko(s->spill_file, offset, SEEK_SET) == 0 &&
+              fread(buf, len, 1, s->spill_file) == 1;
+    pthread_mutex_lock(&s->mutex);
+    if (!ok) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Reading from cache file failed. "
+               "Disabling it.\n");
+        spill_close(s);
+        return 0;
+    }
+    mp_msg(MSGT_CACHE, MSGL_DBG2, "Read 0x%" PRIX64 " from cache file.\n",
+           pos);
+    return len;
+}
+
+// Sparse mode: return the index of the block containing pos, or -1.
+static int find_block(struct priv *s, int64_t pos)
+{
+    int64_t block_pos = pos - pos % CACHE_BLOCK_SIZE;
+    // Reads are mostly sequential, so check the last block and its successor.
+    for (int n = 0; n < 2; n++) {
+        int i = (s->last_block + n) % s->num_blocks;
+        if (s->blocks[i].pos == block_pos)
+            return i;
+    }
+    for (int i = 0; i < s->num_blocks; i++) {
+        if (s->blocks[i].pos == block_pos) {
+            s->last_block = i;
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Sparse mode: get an unused block for the data at block_pos, or reuse the
+// least recently used block. Blocks overlapping with the range start..end
+// are never reused. Returns -1 if no block is available.
+// The mutex is temporarily dropped if the old block contents are spilled.
+static int alloc_block(struct priv *s, int64_t block_pos, int64_t start,
+                       int64_t end)
+{
+    int best = -1;
+    for (int i = 0; i < s->num_blocks; i++) {
+        struct cache_block *b = &s->blocks[i];
+        if (b->pos < 0) {
+            best = i;
+            break;
+        }
+        if (b->pos + CACHE_BLOCK_SIZE > start && b->pos <= end)
+            continue;
+        if (best < 0 || b->last_use < s->blocks[best].last_use)
+            best = i;
+    }
+    if (best >= 0) {
+        struct cache_block *b = &s->blocks[best];
+        if (b->pos >= 0) {
+            spill_write(s, b->pos, &s->buffer[best * (int64_t)CACHE_BLOCK_SIZE],
+                        b->len);
+        }
+        s->blocks[best] = (struct cache_block){
+            .pos = block_pos,
+            .last_use = ++s->use_counter,
+        };
+    }
+    return best;
+}
 
+// Runs in the main thread
+// mutex must be held, but is sometimes temporarily dropped
+static int cache_read_sparse(struct priv *s, unsigned char *buf, int size)
+{
     double retry = 0;
-    while (s->read_filepos >= s->max_filepos ||
-           s->read_filepos < s->min_filepos)
-    {
-        if (s->eof && s->read_filepos >= s->max_filepos)
+    int index;
+    for (;;) {
+        int64_t read = load64(&s->read_filepos);
+        index = find_block(s, read);
+        if (index >= 0 && read < s->blocks[index].pos + s->blocks[index].len) {
+            account_stall(s, retry);
+            break;
+        }
+        if (s->eof && read >= s->max_filepos)
             return 0;
         if (cache_wakeup_and_wait(s, &retry) == CACHE_INTERRUPTED)
             return 0;
     }
 
-    int64_t newb = s->max_filepos - s->read_filepos; // new bytes in the buffer
+    struct cache_block *b = &s->blocks[index];
+    int64_t read = load64(&s->read_filepos);
+    int64_t offset = read - b->pos;
+    int64_t newb = FFMIN(b->len - offset, size);
+
+    memcpy(buf, &s->buffer[index * (int64_t)CACHE_BLOCK_SIZE + offset], newb);
+
+    b->last_use = ++s->use_counter;
+    store64(&s->read_filepos, read + newb);
+    return newb;
+}
+
+// Runs in the main thread
+// Ringbuffer mode: copy data at read_filepos to buf. Returns 0 if no data
+// is available at read_filepos.
+// This doesn't need the mutex. The cache thread never changes the part
+// read_filepos..max_filepos of the buffer, because it moves min_filepos only
+// up to read_filepos (which is only increased here), and writes new data
+// before increasing max_filepos. offset changes by buffer_size only, except
+// when the contents are dropped - which happens only if read_filepos is
+// outside of the cached range.
+static int cache_read_ring(struct priv *s, unsigned char *buf, int size)
+{
+    // The order matters: when dropping the contents, the cache thread sets
+    // offset, min_filepos and max_filepos in this order.
+    int64_t read = load64(&s->read_filepos);
+    int64_t min = load64(&s->min_filepos);
+    int64_t max = load64(&s->max_filepos);
+    if (read < min || read >= max)
+        return 0;
+
+    int64_t newb = max - read; // new bytes in the buffer
 
-    int64_t pos = s->read_filepos - s->offset; // file pos to buffer memory pos
+    int64_t pos = (read - load64(&s->offset)) % s->buffer_size;
     if (pos < 0)
-        pos += s->buffer_size;
-    else if (pos >= s->buffer_size)
-        pos -= s->buffer_size;
+        pos += s->buffer_size; // file pos to buffer memory pos
 
     if (newb > s->buffer_size - pos)
         newb = s->buffer_size - pos; // handle wrap...
@@ -219,17 +662,167 @@ static int cache_read(struct priv *s, unsigned char *buf, int size)
 
     memcpy(buf, &s->buffer[pos], newb);
 
-    s->read_filepos += newb;
+    store64(&s->read_filepos, read + newb);
     return newb;
 }
 
+// Runs in the main thread
+// mutex must be held, but is sometimes temporarily dropped
+static int cache_read(struct priv *s, unsigned char *buf, int size)
+{
+    if (size <= 0)
+        return 0;
+
+    if (s->blocks)
+        return cache_read_sparse(s, buf, size);
+
+    double retry = 0;
+    for (;;) {
+        int len = cache_read_ring(s, buf, size);
+        if (len > 0) {
+            account_stall(s, retry);
+            return len;
+        }
+        if (s->eof && load64(&s->read_filepos) >= s->max_filepos)
+            return 0;
+        if (cache_wakeup_and_wait(s, &retry) == CACHE_INTERRUPTED)
+            return 0;
+    }
+}
+
+// Runs in the cache thread.
+// Sparse mode: find the end of the cached data starting at pos. Any of the
+// blocks might be partially filled. *index is set to the block containing the
+// end, or -1 if no such block exists.
+static int64_t find_cached_end(struct priv *s, int64_t pos, int *index)
+{
+    for (;;) {
+        *index = find_block(s, pos);
+        if (*index < 0)
+            break;
+        struct cache_block *b = &s->blocks[*index];
+        pos = b->pos + b->len;
+        if (b->len < CACHE_BLOCK_SIZE)
+            break;
+    }
+    return pos;
+}
+
+// Runs in the cache thread.
+// Returns true if reading was attempted, and the mutex was shortly unlocked.
+static bool cache_fill_sparse(struct priv *s)
+{
+    int64_t read = load64(&s->read_filepos);
+
+    int index;
+    int64_t pos = find_cached_end(s, read, &index);
+    s->max_filepos = FFMAX(pos, read);
+
+    int64_t readahead = s->max_filepos - read;
+    int64_t readahead_limit = s->buffer_size - s->back_size;
+
+    // Fetch the range hinted with STREAM_CTRL_PREFETCH, as soon as there is
+    // enough data to read from the current position.
+    bool prefetch = false;
+    if (s->prefetch_end > 0 && readahead >= readahead_limit / 4) {
+        int p_index;
+        int64_t p_pos = find_cached_end(s, s->prefetch_start, &p_index);
+        if (p_pos < s->prefetch_end) {
+            prefetch = true;
+            pos = p_pos;
+            index = p_index;
+        } else {
+            mp_msg(MSGT_CACHE, MSGL_DBG2, "Prefetching done.\n");
+            s->prefetch_end = 0;
+        }
+    }
+
+    if (!prefetch && readahead >= readahead_limit) {
+        set_idle(s, true);
+        return false;
+    }
+
+    if (index < 0) {
+        pos -= pos % CACHE_BLOCK_SIZE;
+        index = alloc_block(s, pos, read, s->max_filepos);
+        if (index < 0) {
+            set_idle(s, true);
+            return false;
+        }
+    }
+    struct cache_block *b = &s->blocks[index];
+    assert(b->pos + b->len == pos);
+
+    int64_t space = CACHE_BLOCK_SIZE - b->len;
+    space = FFMIN(space, s->stream->read_chunk);
+    unsigned char *dst = &s->buffer[index * (int64_t)CACHE_BLOCK_SIZE + b->len];
+
+    double pts = MP_NOPTS_VALUE;
+    int len = spill_read(s, pos, dst, space);
+    if (len <= 0 && stream_tell(s->stream) != pos) {
+        mp_msg(MSGT_CACHE, MSGL_DBG2, "Seeking to 0x%" PRIX64 "\n", pos);
+        stream_seek(s->stream, pos);
+        // Data read from another position would end up in the wrong block.
+        if (stream_tell(s->stream) != pos) {
+            mp_msg(MSGT_CACHE, MSGL_V, "Seeking to 0x%" PRIX64 " failed.\n",
+                   pos);
+            if (!b->len)
+                *b = (struct cache_block){ .pos = -1 };
+            if (prefetch) {
+                s->prefetch_end = 0;
+            } else {
+                s->eof = read == load64(&s->read_filepos);
+                set_idle(s, s->eof);
+                pthread_cond_signal(&s->wakeup);
+            }
+            return true;
+        }
+    }
+    if (len <= 0) {
+        // Only the cache thread writes to or reuses blocks, and the reader
+        // never accesses data past b->len.
+        pthread_mutex_unlock(&s->mutex);
+        len = stream_read_partial(s->stream, dst, space);
+        pthread_mutex_lock(&s->mutex);
+        account_read(s, len);
+
+        if (stream_control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pts) <= 0)
+            pts = MP_NOPTS_VALUE;
+    }
+    if (!b->len || pts != MP_NOPTS_VALUE)
+        b->stream_pts = pts;
+
+    b->len += len;
+    b->last_use = ++s->use_counter;
+
+    if (prefetch) {
+        if (len <= 0)
+            s->prefetch_end = 0; // EOF or error, give up
+        set_idle(s, false);
+        return true;
+    }
+
+    s->max_filepos = FFMAX(pos + len, read);
+
+    // Don't report EOF for a position the reader has moved away from.
+    s->eof = len <= 0 && read == load64(&s->read_filepos);
+    set_idle(s, s->eof);
+
+    pthread_cond_signal(&s->wakeup);
+
+    return true;
+}
+
 // Runs in the cache thread.
 // Returns true if reading was attempted, and the mutex was shortly unlocked.
 static bool cache_fill(struct priv *s)
 {
-    int64_t read = s->read_filepos;
+    int64_t read = load64(&s->read_filepos);
     int len;
 
+    if (s->blocks)
+        return cache_fill_sparse(s);
+
     if (read < s->min_filepos || read > s->max_filepos) {
         // seek...
         mp_msg(MSGT_CACHE, MSGL_DBG2,
@@ -242,8 +835,22 @@ static bool cache_fill(struct priv *s)
             mp_msg(MSGT_CACHE, MSGL_V, "Dropping cache at pos %"PRId64", "
                    "cached range: %"PRId64"-%"PRId64".\n", read,
                    s->min_filepos, s->max_filepos);
+            int64_t min = s->min_filepos, max = s->max_filepos;
+            int64_t offset = s->offset;
+            // Drop first, so that the reader doesn't access the old data
+            // while it's written to the spill file with the mutex unlocked.
             cache_drop_contents(s);
-            stream_seek(s->stream, read);
+            spill_defer_buffer(s, min, max, offset);
+            // Seeking back to data dropped by an earlier seek.
+            for (int n = 0; n < s->num_pending_spill; n++) {
+                struct spill_pending *p = &s->pending_spill[n];
+                if (read >= p->pos && read < p->pos + p->len) {
+                    spill_flush_pending(s, s->buffer_size);
+                    break;
+                }
+            }
+            if (!spill_find(s, read))
+                stream_seek(s->stream, read);
         }
     }
 
@@ -262,7 +869,7 @@ static bool cache_fill(struct priv *s)
         pos -= s->buffer_size; // wrap-around
 
     if (space < s->fill_limit) {
-        s->idle = true;
+        set_idle(s, true);
         return false;
     }
 
@@ -275,29 +882,43 @@ static bool cache_fill(struct priv *s)
 
     // back+newb+space <= buffer_size
     int64_t back2 = s->buffer_size - (space + newb); // max back size
-    if (s->min_filepos < (read - back2))
-        s->min_filepos = read - back2;
+    if (s->min_filepos < (read - back2)) {
+        int64_t min = s->min_filepos;
+        store64(&s->min_filepos, read - back2);
+        spill_write_buffer(s, min, read - back2, s->offset);
+    }
 
-    // The read call might take a long time and block, so drop the lock.
-    pthread_mutex_unlock(&s->mutex);
-    len = stream_read_partial(s->stream, &s->buffer[pos], space);
-    pthread_mutex_lock(&s->mutex);
+    spill_flush_pending(s, pos + space);
+
+    double pts = MP_NOPTS_VALUE;
+    len = spill_read(s, s->max_filepos, &s->buffer[pos], space);
+    if (len <= 0) {
+        // The stream is not at max_filepos if data was read from the spill
+        // file before.
+        if (s->spill_size && stream_tell(s->stream) != s->max_filepos)
+            stream_seek(s->stream, s->max_filepos);
 
-    double pts;
-    if (stream_control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pts) <= 0)
-        pts = MP_NOPTS_VALUE;
+        // The read call might take a long time and block, so drop the lock.
+        pthread_mutex_unlock(&s->mutex);
+        len = stream_read_partial(s->stream, &s->buffer[pos], space);
+        pthread_mutex_lock(&s->mutex);
+        account_read(s, len);
+
+        if (stream_control(s->stream, STREAM_CTRL_GET_CURRENT_TIME, &pts) <= 0)
+            pts = MP_NOPTS_VALUE;
+    }
     for (int64_t b_pos = pos; b_pos < pos + len + BYTE_META_CHUNK_SIZE;
          b_pos += BYTE_META_CHUNK_SIZE)
     {
         s->bm[b_pos / BYTE_META_CHUNK_SIZE] = (struct byte_meta){.stream_pts = pts};
     }
 
-    s->max_filepos += len;
+    store64(&s->max_filepos, s->max_filepos + len);
     if (pos + len == s->buffer_size)
-        s->offset += s->buffer_size; // wrap...
+        store64(&s->offset, s->offset + s->buffer_size); // wrap...
 
     s->eof = len > 0 ? 0 : 1;
-    s->idle = s->eof;
+    set_idle(s, s->eof);
 
     pthread_cond_signal(&s->wakeup);
 
@@ -338,11 +959,14 @@ static int cache_get_cached_control(stream_t *cache, int cmd, void *arg)
         *(int64_t *)arg = s->buffer_size;
         return STREAM_OK;
     case STREAM_CTRL_GET_CACHE_FILL:
-        *(int64_t *)arg = s->max_filepos - s->read_filepos;
+        *(int64_t *)arg = s->max_filepos - load64(&s->read_filepos);
         return STREAM_OK;
     case STREAM_CTRL_GET_CACHE_IDLE:
         *(int *)arg = s->idle;
         return STREAM_OK;
+    case STREAM_CTRL_GET_CACHE_STATS:
+        get_stats(s, arg);
+        return STREAM_OK;
     case STREAM_CTRL_GET_TIME_LENGTH:
         *(double *)arg = s->stream_time_length;
         return s->stream_time_length ? STREAM_OK : STREAM_UNSUPPORTED;
@@ -359,11 +983,19 @@ static int cache_get_cached_control(stream_t *cache, int cmd, void *arg)
         *(unsigned int *)arg = s->stream_num_chapters;
         return STREAM_OK;
     case STREAM_CTRL_GET_CURRENT_TIME: {
-        if (s->read_filepos >= s->min_filepos &&
-            s->read_filepos <= s->max_filepos &&
+        if (s->blocks) {
+            int index = find_block(s, load64(&s->read_filepos));
+            if (index < 0 || !s->blocks[index].len)
+                return STREAM_UNSUPPORTED;
+            double pts = s->blocks[index].stream_pts;
+            *(double *)arg = pts;
+            return pts == MP_NOPTS_VALUE ? STREAM_UNSUPPORTED : STREAM_OK;
+        }
+        int64_t read = load64(&s->read_filepos);
+        if (read >= s->min_filepos && read <= s->max_filepos &&
             s->min_filepos < s->max_filepos)
         {
-            int64_t fpos = FFMIN(s->read_filepos, s->max_filepos - 1);
+            int64_t fpos = FFMIN(read, s->max_filepos - 1);
             int64_t pos = fpos - s->offset;
             if (pos < 0)
                 pos += s->buffer_size;
@@ -420,15 +1052,36 @@ static void cache_execute_control(struct priv *s)
                "returned error, this is not allowed!\n");
     } else if (pos_changed || (ok && control_needs_flush(s->control))) {
         mp_msg(MSGT_CACHE, MSGL_V, "Dropping cache due to control()\n");
-        s->read_filepos = stream_tell(s->stream);
+        store64(&s->read_filepos, stream_tell(s->stream));
         s->control_flush = true;
+        s->prefetch_end = 0;
         cache_drop_contents(s);
+        // Stream positions might refer to different data now.
+        s->num_spill = 0;
+        s->num_pending_spill = 0;
     }
 
     s->control = CACHE_CTRL_NONE;
     pthread_cond_signal(&s->wakeup);
 }
 
+// Runs in the cache thread
+static void cache_start_prefetch(struct priv *s)
+{
+    s->prefetch_new = false;
+    set_idle(s, false);
+    struct stream_prefetch_req req = {s->prefetch_start, s->prefetch_end};
+    stream_control(s->stream, STREAM_CTRL_PREFETCH, &req);
+    // Only sparse mode can cache a range unrelated to the read position.
+    // Limit the amount so the prefetched data doesn't evict itself.
+    if (s->blocks) {
+        s->prefetch_end = FFMIN(s->prefetch_end,
+                                s->prefetch_start + s->back_size / 2);
+    } else {
+        s->prefetch_end = 0;
+    }
+}
+
 static void *cache_thread(void *arg)
 {
     struct priv *s = arg;
@@ -440,7 +1093,9 @@ static void *cache_thread(void *arg)
             update_cached_controls(s);
             last = mp_time_sec();
         }
-        if (s->control > 0) {
+        if (s->prefetch_new) {
+            cache_start_prefetch(s);
+        } else if (s->control > 0) {
             cache_execute_control(s);
         } else {
             cache_fill(s);
@@ -463,9 +1118,23 @@ static int cache_fill_buffer(struct stream *cache, char *buffer, int max_len)
     struct priv *s = cache->priv;
     assert(s->cache_thread_running);
 
+    // Fast path: read without locking if possible. The cache thread needs to
+    // be woken up only if it stopped reading.
+    if (!s->blocks && max_len > 0) {
+        int t = cache_read_ring(s, buffer, max_len);
+        if (t > 0) {
+            if (__sync_fetch_and_add(&s->idle, 0)) {
+                pthread_mutex_lock(&s->mutex);
+                pthread_cond_signal(&s->wakeup);
+                pthread_mutex_unlock(&s->mutex);
+            }
+            return t;
+        }
+    }
+
     pthread_mutex_lock(&s->mutex);
 
-    if (cache->pos != s->read_filepos)
+    if (cache->pos != load64(&s->read_filepos))
         mp_msg(MSGT_CACHE, MSGL_ERR,
                "!!! read_filepos differs !!! report this bug...\n");
 
@@ -485,9 +1154,24 @@ static int cache_seek(stream_t *cache, int64_t pos)
 
     mp_msg(MSGT_CACHE, MSGL_DBG2, "CACHE2_SEEK: 0x%" PRIX64 " <= 0x%" PRIX64
            " (0x%" PRIX64 ") <= 0x%" PRIX64 "  \n",
-           s->min_filepos, pos, s->read_filepos, s->max_filepos);
+           s->min_filepos, pos, load64(&s->read_filepos), s->max_filepos);
+
+    bool cached;
+    if (s->blocks) {
+        int index = find_block(s, pos);
+        cached = index >= 0 && pos < s->blocks[index].pos + s->blocks[index].len;
+    } else {
+        cached = pos >= s->min_filepos && pos <= s->max_filepos;
+    }
+    cached |= !!spill_find(s, pos);
+    if (cached) {
+        s->stat_seeks_cached++;
+    } else {
+        s->stat_seeks_stream++;
+    }
 
-    cache->pos = s->read_filepos = pos;
+    cache->pos = pos;
+    store64(&s->read_filepos, pos);
     s->eof = false; // so that cache_read() will actually wait for new data
     pthread_cond_signal(&s->wakeup);
     pthread_mutex_unlock(&s->mutex);
@@ -504,6 +1188,21 @@ static int cache_control(stream_t *cache, int cmd, void *arg)
 
     pthread_mutex_lock(&s->mutex);
 
+    if (cmd == STREAM_CTRL_PREFETCH) {
+        // Don't wait for the cache thread; it picks up the hint when it can.
+        struct stream_prefetch_req *req = arg;
+        mp_msg(MSGT_CACHE, MSGL_DBG2, "Prefetch hint: 0x%" PRIX64 "-0x%"
+               PRIX64 "\n", req->start, req->end);
+        if (req->start < req->end) {
+            s->prefetch_start = req->start;
+            s->prefetch_end = req->end;
+            s->prefetch_new = true;
+            pthread_cond_signal(&s->wakeup);
+        }
+        r = STREAM_OK;
+        goto done;
+    }
+
     r = cache_get_cached_control(cache, cmd, arg);
     if (r != STREAM_ERROR)
         goto done;
@@ -522,7 +1221,7 @@ static int cache_control(stream_t *cache, int cmd, void *arg)
     }
     r = s->control_res;
     if (s->control_flush) {
-        cache->pos = s->read_filepos;
+        cache->pos = load64(&s->read_filepos);
         cache->eof = 0;
         cache->buf_pos = cache->buf_len = 0;
     }
@@ -543,6 +1242,7 @@ static void cache_uninit(stream_t *cache)
         pthread_mutex_unlock(&s->mutex);
         pthread_join(s->cache_thread, NULL);
     }
+    spill_close(s);
     pthread_mutex_destroy(&s->mutex);
     pthread_cond_destroy(&s->wakeup);
     free(s->buffer);
@@ -550,6 +1250,39 @@ static void cache_uninit(stream_t *cache)
     talloc_free(s);
 }
 
+// Switch to sparse mode (see struct priv). Only useful if the stream can seek.
+static void cache_init_sparse(struct priv *s)
+{
+    s->num_blocks = s->buffer_size / CACHE_BLOCK_SIZE;
+    s->blocks = talloc_array(s, struct cache_block, s->num_blocks);
+    for (int n = 0; n < s->num_blocks; n++)
+        s->blocks[n] = (struct cache_block){ .pos = -1 };
+    mp_msg(MSGT_CACHE, MSGL_V, "Using sparse cache with %d blocks.\n",
+           s->num_blocks);
+}
+
+// Open the file for --cache-file. Failure is not fatal; the cache works
+// without it.
+static void cache_init_spill(struct priv *s, struct MPOpts *opts)
+{
+    char *path = opts->stream_cache_file;
+    if (!path || !path[0] || opts->stream_cache_file_size < 1)
+        return;
+    if (strcmp(path, "TMP") == 0) {
+        s->spill_file = tmpfile();
+    } else {
+        s->spill_file = fopen(path, "w+b");
+    }
+    if (!s->spill_file) {
+        mp_msg(MSGT_CACHE, MSGL_ERR, "Could not open cache file '%s': %s\n",
+               path, strerror(errno));
+        return;
+    }
+    s->spill_size = opts->stream_cache_file_size * (int64_t)1024;
+    mp_msg(MSGT_CACHE, MSGL_V, "Using cache file '%s' with up to %d KiB.\n",
+           path, opts->stream_cache_file_size);
+}
+
 // return 1 on success, 0 if the function was interrupted and -1 on error, or
 // if the cache is disabled
 int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
@@ -569,9 +1302,16 @@ int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
 
     struct priv *s = talloc_zero(NULL, struct priv);
 
+    bool sparse = cache->opts && cache->opts->stream_cache_sparse &&
+                  (stream->flags & MP_STREAM_SEEK) == MP_STREAM_SEEK;
+
     //64kb min_size
     s->fill_limit = FFMAX(16 * 1024, BYTE_META_CHUNK_SIZE * 2);
     s->buffer_size = FFMAX(size, s->fill_limit * 4);
+    if (sparse) {
+        s->buffer_size = FFMAX(s->buffer_size, CACHE_BLOCK_SIZE * 4);
+        s->buffer_size -= s->buffer_size % CACHE_BLOCK_SIZE;
+    }
     s->back_size = s->buffer_size / 2;
 
     s->buffer = malloc(s->buffer_size);
@@ -588,10 +1328,19 @@ int stream_cache_init(stream_t *cache, stream_t *stream, int64_t size,
     pthread_mutex_init(&s->mutex, NULL);
     pthread_cond_init(&s->wakeup, NULL);
 
+    s->stat_slot = mp_time_sec();
+    for (int n = 0; n < STREAM_CACHE_HISTORY; n++)
+        s->history[n] = (struct cache_history){ .fill = -1 };
+
     cache->priv = s;
     s->cache = cache;
     s->stream = stream;
 
+    if (sparse)
+        cache_init_sparse(s);
+    if (cache->opts)
+        cache_init_spill(s, cache->opts);
+
     cache->seek = cache_seek;
     cache->fill_buffer = cache_fill_buffer;
     cache->control = cache_control;
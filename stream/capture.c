@@ -0,0 +1,242 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Writes captured stream data (--stream-capture, --stream-dump) to a file.
+// With pthreads, the data is appended to a queue, which is written to the
+// file by a separate thread, so that a slow disk doesn't block reading the
+// stream. If the queue is full, the data is dropped (unless blocking mode
+// is used, which waits until there is free space).
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "config.h"
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "talloc.h"
+
+#include "mpvcore/mp_msg.h"
+#include "mpvcore/mp_common.h"
+#include "mpvcore/mp_ring.h"
+#include "capture.h"
+
+// Maximum amount of data written to the file at once.
+#define WRITE_CHUNK (64 * 1024)
+
+struct stream_capture {
+    FILE *file;
+    char *filename;
+    bool blocking;          // never drop data, wait for the writer instead
+
+#if HAVE_PTHREADS
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;  // signals both queue fill and drain
+    struct mp_ring *queue;
+    bool terminate;
+#endif
+
+    // Protected by lock (if pthreads are used)
+    bool failed;            // writing failed, all further data is discarded
+    int64_t bytes_written;
+    int64_t bytes_dropped;
+
+    // Accessed by the producer only
+    bool overflowing;       // last chunk was dropped
+};
+
+static bool write_data(struct stream_capture *c, void *buf, int len)
+{
+    if (fwrite(buf, len, 1, c->file) < 1) {
+        mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Error writing capture file: %s\n",
+                strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#if HAVE_PTHREADS
+
+static void *writer_thread(void *arg)
+{
+    struct stream_capture *c = arg;
+    unsigned char *buf = talloc_size(NULL, WRITE_CHUNK);
+
+    pthread_mutex_lock(&c->lock);
+    for (;;) {
+        if (!mp_ring_buffered(c->queue)) {
+            if (c->terminate)
+                break;
+            pthread_cond_wait(&c->wakeup, &c->lock);
+            continue;
+        }
+        bool failed = c->failed;
+        pthread_mutex_unlock(&c->lock);
+
+        int len = mp_ring_read(c->queue, buf, WRITE_CHUNK);
+        // On failure, keep draining the queue, so that a blocking producer
+        // can't get stuck.
+        bool ok = !failed && write_data(c, buf, len);
+
+        pthread_mutex_lock(&c->lock);
+        if (ok) {
+            c->bytes_written += len;
+        } else {
+            c->failed = true;
+        }
+        pthread_cond_broadcast(&c->wakeup);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    talloc_free(buf);
+    return NULL;
+}
+
+#endif
+
+// queue_size is the maximum amount of data (in bytes) that can be queued
+// before data is dropped or (if blocking is set) write calls block.
+struct stream_capture *stream_capture_open(const char *filename,
+                                           int queue_size, bool blocking)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Error opening capture file: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+
+    struct stream_capture *c = talloc_ptrtype(NULL, c);
+    *c = (struct stream_capture) {
+        .file = file,
+        .filename = talloc_strdup(c, filename),
+        .blocking = blocking,
+    };
+
+#if HAVE_PTHREADS
+    int size = mp_ring_round_size(MPMAX(queue_size, WRITE_CHUNK));
+    c->queue = mp_ring_new(c, size);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->wakeup, NULL);
+    if (pthread_create(&c->thread, NULL, writer_thread, c)) {
+        mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Starting capture thread failed.\n");
+        pthread_cond_destroy(&c->wakeup);
+        pthread_mutex_destroy(&c->lock);
+        fclose(c->file);
+        talloc_free(c);
+        return NULL;
+    }
+#endif
+
+    return c;
+}
+
+// Append the data to the capture file. Returns false if the capture file is
+// not usable anymore (i.e. writing failed).
+bool stream_capture_write(struct stream_capture *c, void *buf, int len)
+{
+#if HAVE_PTHREADS
+    unsigned char *data = buf;
+    pthread_mutex_lock(&c->lock);
+    if (c->blocking) {
+        while (len > 0 && !c->failed) {
+            int written = mp_ring_write(c->queue, data, len);
+            data += written;
+            len -= written;
+            pthread_cond_broadcast(&c->wakeup);
+            if (len > 0)
+                pthread_cond_wait(&c->wakeup, &c->lock);
+        }
+    } else if (mp_ring_available(c->queue) < len) {
+        // Drop the whole chunk, so that the gap in the captured data is at
+        // a read boundary.
+        if (!c->overflowing) {
+            mp_tmsg(MSGT_GLOBAL, MSGL_WARN, "Capture file can't keep up, "
+                    "dropping data.\n");
+        }
+        c->overflowing = true;
+        c->bytes_dropped += len;
+    } else {
+        mp_ring_write(c->queue, data, len);
+        c->overflowing = false;
+        pthread_cond_broadcast(&c->wakeup);
+    }
+    bool ok = !c->failed;
+    pthread_mutex_unlock(&c->lock);
+    return ok;
+#else
+    if (!c->failed) {
+        if (write_data(c, buf, len)) {
+            c->bytes_written += len;
+        } else {
+            c->failed = true;
+        }
+    }
+    return !c->failed;
+#endif
+}
+
+void stream_capture_get_stats(struct stream_capture *c,
+                              struct stream_capture_stats *st)
+{
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&c->lock);
+    *st = (struct stream_capture_stats) {
+        .bytes_written = c->bytes_written,
+        .bytes_queued = mp_ring_buffered(c->queue),
+        .bytes_dropped = c->bytes_dropped,
+    };
+    pthread_mutex_unlock(&c->lock);
+#else
+    *st = (struct stream_capture_stats) {
+        .bytes_written = c->bytes_written,
+    };
+#endif
+}
+
+// Write all queued data and close the file.
+void stream_capture_close(struct stream_capture *c)
+{
+    if (!c)
+        return;
+
+#if HAVE_PTHREADS
+    pthread_mutex_lock(&c->lock);
+    c->terminate = true;
+    pthread_cond_broadcast(&c->wakeup);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+    pthread_cond_destroy(&c->wakeup);
+    pthread_mutex_destroy(&c->lock);
+#endif
+
+    if (fclose(c->file) != 0 && !c->failed) {
+        mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Error writing capture file: %s\n",
+                strerror(errno));
+    }
+    if (c->bytes_dropped > 0) {
+        mp_tmsg(MSGT_GLOBAL, MSGL_WARN, "Capture file %s: %lld bytes were "
+                "dropped.\n", c->filename, (long long)c->bytes_dropped);
+    }
+    mp_msg(MSGT_GLOBAL, MSGL_V, "Capture file %s: %lld bytes written.\n",
+           c->filename, (long long)c->bytes_written);
+    talloc_free(c);
+}
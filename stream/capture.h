@@ -0,0 +1,39 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MPLAYER_STREAM_CAPTURE_H
+#define MPLAYER_STREAM_CAPTURE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct stream_capture;
+
+struct stream_capture_stats {
+    int64_t bytes_written;  // bytes written to the capture file
+    int64_t bytes_queued;   // bytes waiting to be written
+    int64_t bytes_dropped;  // bytes discarded because the queue was full
+};
+
+struct stream_capture *stream_capture_open(const char *filename,
+                                           int queue_size, bool blocking);
+bool stream_capture_write(struct stream_capture *c, void *buf, int len);
+void stream_capture_get_stats(struct stream_capture *c,
+                              struct stream_capture_stats *st);
+void stream_capture_close(struct stream_capture *c);
+
+#endif /* MPLAYER_STREAM_CAPTURE_H */
@@ -41,10 +41,13 @@
 #include "mpvcore/bstr.h"
 #include "mpvcore/mp_msg.h"
 #include "mpvcore/path.h"
+#include "mpvcore/mp_memory_barrier.h"
 #include "osdep/timer.h"
 #include "stream.h"
+#include "capture.h"
 #include "demux/demux.h"
 
+#include "mpvcore/options.h"
 #include "mpvcore/m_option.h"
 #include "mpvcore/m_config.h"
 
@@ -411,34 +414,32 @@ static int stream_reconnect(stream_t *s)
     return 0;
 }
 
-void stream_set_capture_file(stream_t *s, const char *filename)
+// Start writing all data read from the stream to the given file (or stop if
+// filename is NULL). The file is written asynchronously. If blocking is false,
+// data is dropped if writing the file can't keep up with reading the stream.
+void stream_set_capture_file(stream_t *s, const char *filename, bool blocking)
 {
     if (!bstr_equals(bstr0(s->capture_filename), bstr0(filename))) {
-        if (s->capture_file)
-            fclose(s->capture_file);
+        stream_capture_close(s->capture);
         talloc_free(s->capture_filename);
-        s->capture_file = NULL;
+        s->capture = NULL;
         s->capture_filename = NULL;
+        s->capture_failed = 0;
         if (filename) {
-            s->capture_file = fopen(filename, "wb");
-            if (s->capture_file) {
+            int queue_size = s->opts ? s->opts->stream_capture_buffer : 0;
+            s->capture = stream_capture_open(filename, queue_size * 1024,
+                                             blocking);
+            if (s->capture)
                 s->capture_filename = talloc_strdup(NULL, filename);
-            } else {
-                mp_tmsg(MSGT_GLOBAL, MSGL_ERR,
-                        "Error opening capture file: %s\n", strerror(errno));
-            }
         }
     }
 }
 
-static void stream_capture_write(stream_t *s, void *buf, size_t len)
+static void stream_capture_data(stream_t *s, void *buf, int len)
 {
-    if (s->capture_file && len > 0) {
-        if (fwrite(buf, len, 1, s->capture_file) < 1) {
-            mp_tmsg(MSGT_GLOBAL, MSGL_ERR, "Error writing capture file: %s\n",
-                    strerror(errno));
-            stream_set_capture_file(s, NULL);
-        }
+    if (s->capture && !s->capture_failed && len > 0) {
+        if (!stream_capture_write(s->capture, buf, len))
+            mp_atomic_add_and_fetch(&s->capture_failed, 1);
     }
 }
 
@@ -474,7 +475,7 @@ eof_out:
     // When reading succeeded we are obviously not at eof.
     s->eof = 0;
     s->pos += len;
-    stream_capture_write(s, buf, len);
+    stream_capture_data(s, buf, len);
     return len;
 }
 
@@ -721,7 +722,7 @@ void free_stream(stream_t *s)
     if (!s)
         return;
 
-    stream_set_capture_file(s, NULL);
+    stream_set_capture_file(s, NULL, false);
 
     if (s->close)
         s->close(s);
@@ -99,6 +99,9 @@ enum stream_ctrl {
     STREAM_CTRL_GET_DVD_INFO,
     STREAM_CTRL_SET_CONTENTS,
     STREAM_CTRL_GET_METADATA,
+    // Hint that a byte range will be read soon (struct stream_prefetch_req)
+    STREAM_CTRL_PREFETCH,
+    STREAM_CTRL_GET_CACHE_STATS,    // struct stream_cache_stats
 };
 
 struct stream_lang_req {
@@ -112,6 +115,27 @@ struct stream_dvd_info_req {
     int num_subs;
 };
 
+struct stream_prefetch_req {
+    int64_t start, end;     // byte range start..end (end exclusive)
+};
+
+// Number of seconds covered by stream_cache_stats.fill_history
+#define STREAM_CACHE_HISTORY 60
+
+struct stream_cache_stats {
+    int64_t bytes_read;     // total bytes read from the source stream
+    double speed_1s;        // bytes/second read in the last second
+    double speed_10s;       // ... in the last 10 seconds
+    double speed_60s;       // ... in the last 60 seconds
+    int64_t stalls;         // number of times the reader had to wait for data
+    double stall_time;      // total time the reader waited for data (seconds)
+    int64_t seeks_cached;   // seeks to data that was in the cache
+    int64_t seeks_stream;   // seeks which had to be done on the source stream
+    // Cache fill state in percent (like STREAM_CTRL_GET_CACHE_FILL), sampled
+    // once per second, oldest first. -1 if unknown.
+    int fill_history[STREAM_CACHE_HISTORY];
+};
+
 struct stream;
 typedef struct stream_info_st {
     const char *name;
@@ -160,8 +184,12 @@ typedef struct stream {
     bool safe_origin; // used for playlists that can be opened safely
     struct MPOpts *opts;
 
-    FILE *capture_file;
+    struct stream_capture *capture;
     char *capture_filename;
+    // Set if writing the capture file failed. The capture is not closed by
+    // the thread reading the stream, but with stream_set_capture_file() by
+    // the player, which might be accessing it at the same time.
+    int capture_failed;
 
     struct stream *uncached_stream; // underlying stream for cache wrapper
     struct stream *source;
@@ -172,7 +200,7 @@ typedef struct stream {
 
 int stream_fill_buffer(stream_t *s);
 
-void stream_set_capture_file(stream_t *s, const char *filename);
+void stream_set_capture_file(stream_t *s, const char *filename, bool blocking);
 
 int stream_enable_cache_percent(stream_t **stream, int64_t stream_cache_size,
                                 int64_t stream_cache_def_size,
@@ -79,7 +79,18 @@ static int control(stream_t *s, int cmd, void *arg)
             *(uint64_t *)arg = size;
             return 1;
         }
+        break;
     }
+#ifdef POSIX_FADV_WILLNEED
+    case STREAM_CTRL_PREFETCH: {
+        struct stream_prefetch_req *req = arg;
+        // Let the OS read the data into the page cache in the background.
+        if (posix_fadvise(p->fd, req->start, req->end - req->start,
+                          POSIX_FADV_WILLNEED) == 0)
+            return STREAM_OK;
+        break;
+    }
+#endif
     }
     return STREAM_UNSUPPORTED;
 }
@@ -390,7 +390,7 @@ bool sub_read_all_packets(struct dec_sub *sub, struct sh_sub *sh)
             break;
         if (preprocess) {
             decode_chain(sub->sd, preprocess, pkt);
-            talloc_free(pkt);
+            free_demux_packet(pkt);
             while (1) {
                 pkt = get_decoded_packet(sub->sd[preprocess - 1]);
                 if (!pkt)
@@ -399,7 +399,7 @@ bool sub_read_all_packets(struct dec_sub *sub, struct sh_sub *sh)
             }
         } else {
             add_packet(subs, pkt);
-            talloc_free(pkt);
+            free_demux_packet(pkt);
         }
     }
 
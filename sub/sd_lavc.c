@@ -137,9 +137,7 @@ static void decode(struct sd *sd, struct demux_packet *packet)
     AVPacket pkt;
 
     clear(priv);
-    av_init_packet(&pkt);
-    pkt.data = packet->buffer;
-    pkt.size = packet->len;
+    mp_set_av_packet(&pkt, packet);
     pkt.pts = pts * 1000;
     if (duration >= 0)
         pkt.convergence_duration = duration * 1000;
@@ -24,11 +24,18 @@
 #include <stdbool.h>
 #include <assert.h>
 
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "talloc.h"
+
 #include "mpvcore/mp_msg.h"
 
 #include "osdep/timer.h"
 
 #include "stream/stream.h"
+#include "demux/demux.h"
 #include "demux/demux_packet.h"
 
 #include "mpvcore/codecs.h"
@@ -42,8 +49,51 @@
 
 #include "video/decode/dec_video.h"
 
+// Maximum number of packets queued for the decoder thread.
+#define MAX_QUEUED_PACKETS 8
+// Maximum number of decoded frames waiting to be picked up by the player.
+#define MAX_QUEUED_FRAMES 3
+
+#if HAVE_PTHREADS
+
+struct vd_queued_packet {
+    struct demux_packet *packet;    // NULL: EOF, drain the decoder
+    int drop_frame;
+    double pts;
+};
+
+// With --vd-thread, decode_video() is called by a separate thread. The player
+// still reads the packets (and decides about framedropping), and queues them
+// with video_queue_packet(). Decoded frames are returned in order by
+// video_get_decoded_frame(), which also reconfigures the filter chain if the
+// image parameters change, so that the filters and the VO are accessed by
+// the playloop only.
+struct vd_thread {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;          // signals queue changes in both directions
+    void (*wakeup_cb)(void *ctx);   // called when the player should poll
+    void *wakeup_ctx;
+
+    // Protected by lock
+    struct vd_queued_packet packets[MAX_QUEUED_PACKETS];
+    int num_packets;
+    struct mp_image *frames[MAX_QUEUED_FRAMES];
+    int num_frames;
+    bool decoding;                  // decoder used by the thread (lock released)
+    int decoder_lag;                // lag reported after the last decode call
+    double decode_time;             // see video_get_decode_time()
+    bool eof_queued;                // EOF packet was queued
+    bool eof;                       // decoder fully drained
+    bool terminate;
+
+    // Accessed by the player only
+    struct mp_image_params vo_params; // params of the last returned frame
+};
 
-int vd_control(struct sh_video *sh_video, int cmd, void *arg)
+#endif
+
+static int driver_control(struct sh_video *sh_video, int cmd, void *arg)
 {
     const struct vd_functions *vd = sh_video->vd_driver;
     if (vd)
@@ -51,6 +101,38 @@ int vd_control(struct sh_video *sh_video, int cmd, void *arg)
     return CONTROL_UNKNOWN;
 }
 
+#if HAVE_PTHREADS
+// Wait until the decoder thread has left the decoder. Since the thread enters
+// it only with the lock held, the decoder can be used by the caller until the
+// lock is released.
+static void wait_decoder_idle(struct vd_thread *t)
+{
+    while (t->decoding)
+        pthread_cond_wait(&t->wakeup, &t->lock);
+}
+#endif
+
+int vd_control(struct sh_video *sh_video, int cmd, void *arg)
+{
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (t) {
+        // The decoder's idea of the current parameters can be ahead of the
+        // frames that actually reached the filters.
+        if (cmd == VDCTRL_GET_PARAMS) {
+            *(struct mp_image_params *)arg = t->vo_params;
+            return t->vo_params.imgfmt ? CONTROL_TRUE : CONTROL_NA;
+        }
+        pthread_mutex_lock(&t->lock);
+        wait_decoder_idle(t);
+        int r = driver_control(sh_video, cmd, arg);
+        pthread_mutex_unlock(&t->lock);
+        return r;
+    }
+#endif
+    return driver_control(sh_video, cmd, arg);
+}
+
 int get_video_quality_max(sh_video_t *sh_video)
 {
     vf_instance_t *vf = sh_video->vfilter;
@@ -101,29 +183,105 @@ int get_video_colors(sh_video_t *sh_video, const char *item, int *value)
     return 0;
 }
 
+#if HAVE_PTHREADS
+// Discard all queued packets and frames. Must be called with the lock held.
+static void flush_queues(struct vd_thread *t)
+{
+    wait_decoder_idle(t);
+    for (int n = 0; n < t->num_packets; n++)
+        free_demux_packet(t->packets[n].packet);
+    t->num_packets = 0;
+    for (int n = 0; n < t->num_frames; n++)
+        talloc_free(t->frames[n]);
+    t->num_frames = 0;
+    t->eof_queued = false;
+    t->eof = false;
+    t->decoder_lag = 0;
+}
+#endif
+
 void resync_video_stream(sh_video_t *sh_video)
 {
-    vd_control(sh_video, VDCTRL_RESYNC_STREAM, NULL);
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (t) {
+        pthread_mutex_lock(&t->lock);
+        flush_queues(t);
+    }
+#endif
+    driver_control(sh_video, VDCTRL_RESYNC_STREAM, NULL);
     sh_video->prev_codec_reordered_pts = MP_NOPTS_VALUE;
     sh_video->prev_sorted_pts = MP_NOPTS_VALUE;
+    sh_video->num_buffered_pts = 0;
+#if HAVE_PTHREADS
+    if (t)
+        pthread_mutex_unlock(&t->lock);
+#endif
 }
 
 void video_reinit_vo(struct sh_video *sh_video)
 {
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (t) {
+        if (t->vo_params.imgfmt)
+            mpcodecs_reconfig_vo(sh_video, &t->vo_params);
+        return;
+    }
+#endif
     vd_control(sh_video, VDCTRL_REINIT_VO, NULL);
 }
 
-int get_current_video_decoder_lag(sh_video_t *sh_video)
+static int query_decoder_lag(sh_video_t *sh_video)
 {
     int ret = -1;
-    vd_control(sh_video, VDCTRL_QUERY_UNSEEN_FRAMES, &ret);
+    driver_control(sh_video, VDCTRL_QUERY_UNSEEN_FRAMES, &ret);
     return ret;
 }
 
+// Return the number of frames fed to the decoder which were not output yet,
+// or -1 if unknown. With the decoder thread, this includes the packets and
+// frames queued between the player and the thread.
+int get_current_video_decoder_lag(sh_video_t *sh_video)
+{
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (t) {
+        pthread_mutex_lock(&t->lock);
+        int lag = t->num_packets + t->num_frames;
+        if (t->decoder_lag > 0)
+            lag += t->decoder_lag;
+        pthread_mutex_unlock(&t->lock);
+        return lag;
+    }
+#endif
+    return query_decoder_lag(sh_video);
+}
+
+// Return the time spent decoding since the last call (in seconds).
+double video_get_decode_time(sh_video_t *sh_video)
+{
+    double r;
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (t) {
+        pthread_mutex_lock(&t->lock);
+        r = t->decode_time;
+        t->decode_time = 0;
+        pthread_mutex_unlock(&t->lock);
+        return r;
+    }
+#endif
+    r = sh_video->decode_time;
+    sh_video->decode_time = 0;
+    return r;
+}
+
 void uninit_video(sh_video_t *sh_video)
 {
     if (!sh_video->initialized)
         return;
+    video_stop_thread(sh_video);
     mp_tmsg(MSGT_DECVIDEO, MSGL_V, "Uninit video.\n");
     sh_video->vd_driver->uninit(sh_video);
     vf_uninit_filter_chain(sh_video->vfilter);
@@ -225,7 +383,7 @@ void *decode_video(sh_video_t *sh_video, struct demux_packet *packet,
     struct MPOpts *opts = sh_video->opts;
 
     if (opts->correct_pts && pts != MP_NOPTS_VALUE) {
-        int delay = get_current_video_decoder_lag(sh_video);
+        int delay = query_decoder_lag(sh_video);
         if (delay >= 0) {
             if (delay > sh_video->num_buffered_pts)
 #if 0
@@ -254,11 +412,13 @@ void *decode_video(sh_video_t *sh_video, struct demux_packet *packet,
         }
     }
 
+    double t0 = mp_time_sec();
     mpi = sh_video->vd_driver->decode(sh_video, packet, drop_frame, &pts);
+    sh_video->decode_time += mp_time_sec() - t0;
 
     //------------------------ frame decoded. --------------------
 
-    if (!mpi || drop_frame) {
+    if (!mpi || (drop_frame & VD_DROP_MASK)) {
         talloc_free(mpi);
         return NULL;            // error / skipped frame
     }
@@ -292,3 +452,215 @@ void *decode_video(sh_video_t *sh_video, struct demux_packet *packet,
         sh_video->num_sorted_pts_problems++;
     return mpi;
 }
+
+// Return the pts of the frame returned by the last decode_video() call.
+double determine_frame_pts(sh_video_t *sh_video)
+{
+    struct MPOpts *opts = sh_video->opts;
+
+    if (opts->user_pts_assoc_mode)
+        sh_video->pts_assoc_mode = opts->user_pts_assoc_mode;
+    else if (sh_video->pts_assoc_mode == 0) {
+        if (sh_video->gsh->demuxer->timestamp_type == TIMESTAMP_TYPE_PTS
+            && sh_video->codec_reordered_pts != MP_NOPTS_VALUE)
+            sh_video->pts_assoc_mode = 1;
+        else
+            sh_video->pts_assoc_mode = 2;
+    } else {
+        int probcount1 = sh_video->num_reordered_pts_problems;
+        int probcount2 = sh_video->num_sorted_pts_problems;
+        if (sh_video->pts_assoc_mode == 2) {
+            int tmp = probcount1;
+            probcount1 = probcount2;
+            probcount2 = tmp;
+        }
+        if (probcount1 >= probcount2 * 1.5 + 2) {
+            sh_video->pts_assoc_mode = 3 - sh_video->pts_assoc_mode;
+            mp_msg(MSGT_CPLAYER, MSGL_V, "Switching to pts association mode "
+                   "%d.\n", sh_video->pts_assoc_mode);
+        }
+    }
+    return sh_video->pts_assoc_mode == 1 ?
+           sh_video->codec_reordered_pts : sh_video->sorted_pts;
+}
+
+#if HAVE_PTHREADS
+
+static void *decoder_thread(void *arg)
+{
+    struct sh_video *sh_video = arg;
+    struct vd_thread *t = sh_video->dec_thread;
+
+    pthread_mutex_lock(&t->lock);
+    while (!t->terminate) {
+        if (!t->num_packets || t->num_frames >= MAX_QUEUED_FRAMES) {
+            pthread_cond_wait(&t->wakeup, &t->lock);
+            continue;
+        }
+        struct vd_queued_packet p = t->packets[0];
+        t->decoding = true;
+        pthread_mutex_unlock(&t->lock);
+
+        struct mp_image *mpi =
+            decode_video(sh_video, p.packet, p.drop_frame, p.pts);
+        if (mpi)
+            mpi->pts = determine_frame_pts(sh_video);
+        int lag = query_decoder_lag(sh_video);
+
+        pthread_mutex_lock(&t->lock);
+        t->decoding = false;
+        t->decoder_lag = lag;
+        t->decode_time += sh_video->decode_time;
+        sh_video->decode_time = 0;
+        // The EOF packet stays queued until the decoder is fully drained.
+        if (p.packet || !mpi) {
+            free_demux_packet(p.packet);
+            t->num_packets--;
+            for (int n = 0; n < t->num_packets; n++)
+                t->packets[n] = t->packets[n + 1];
+            t->eof = !p.packet;
+        }
+        if (mpi)
+            t->frames[t->num_frames++] = mpi;
+        pthread_cond_broadcast(&t->wakeup);
+        if (mpi || !t->num_packets)
+            t->wakeup_cb(t->wakeup_ctx);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+#endif
+
+// Decode in a separate thread. Only software decoders are run in a thread,
+// because hardware decoding interacts with the VO. wakeup is called from the
+// thread if a frame is available, or if more packets are needed.
+// Returns false if the thread is not used.
+bool video_start_thread(sh_video_t *sh_video, void (*wakeup)(void *ctx),
+                        void *ctx)
+{
+#if HAVE_PTHREADS
+    assert(!sh_video->dec_thread);
+    if (driver_control(sh_video, VDCTRL_QUERY_HWDEC, NULL) == CONTROL_TRUE) {
+        mp_msg(MSGT_DECVIDEO, MSGL_V, "Not using a decoder thread with "
+               "hardware decoding.\n");
+        return false;
+    }
+    struct vd_thread *t = talloc_ptrtype(NULL, t);
+    *t = (struct vd_thread) {
+        .wakeup_cb = wakeup,
+        .wakeup_ctx = ctx,
+    };
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->wakeup, NULL);
+    sh_video->dec_thread = t;
+    if (pthread_create(&t->thread, NULL, decoder_thread, sh_video)) {
+        mp_tmsg(MSGT_DECVIDEO, MSGL_ERR, "Starting decoder thread failed.\n");
+        sh_video->dec_thread = NULL;
+        pthread_cond_destroy(&t->wakeup);
+        pthread_mutex_destroy(&t->lock);
+        talloc_free(t);
+        return false;
+    }
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "Started video decoder thread.\n");
+    return true;
+#else
+    return false;
+#endif
+}
+
+void video_stop_thread(sh_video_t *sh_video)
+{
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    if (!t)
+        return;
+    pthread_mutex_lock(&t->lock);
+    t->terminate = true;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_mutex_lock(&t->lock);
+    flush_queues(t);
+    pthread_mutex_unlock(&t->lock);
+    pthread_cond_destroy(&t->wakeup);
+    pthread_mutex_destroy(&t->lock);
+    talloc_free(t);
+    sh_video->dec_thread = NULL;
+#endif
+}
+
+// Whether the decoder thread accepts another packet. Once EOF was queued,
+// no packets are accepted until the next resync_video_stream().
+bool video_needs_packet(sh_video_t *sh_video)
+{
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    pthread_mutex_lock(&t->lock);
+    bool r = t->num_packets < MAX_QUEUED_PACKETS && !t->eof_queued;
+    pthread_mutex_unlock(&t->lock);
+    return r;
+#else
+    return false;
+#endif
+}
+
+// Pass a packet to the decoder thread (same arguments as decode_video(); a
+// NULL packet signals EOF). Takes ownership of the packet.
+void video_queue_packet(sh_video_t *sh_video, struct demux_packet *packet,
+                        int drop_frame, double pts)
+{
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    pthread_mutex_lock(&t->lock);
+    assert(t->num_packets < MAX_QUEUED_PACKETS && !t->eof_queued);
+    t->packets[t->num_packets++] = (struct vd_queued_packet) {
+        .packet = packet,
+        // Draining the decoder can't be interrupted by dropped frames.
+        .drop_frame = packet ? drop_frame : 0,
+        .pts = pts,
+    };
+    t->eof_queued = !packet;
+    pthread_cond_broadcast(&t->wakeup);
+    pthread_mutex_unlock(&t->lock);
+#endif
+}
+
+// Return the next frame decoded by the thread, with the pts set as determined
+// by determine_frame_pts(). Returns NULL if no frame is available (yet), or if
+// reconfiguring the filter chain failed. *eof is set if the decoder was
+// drained after EOF.
+struct mp_image *video_get_decoded_frame(sh_video_t *sh_video, bool *eof)
+{
+    *eof = false;
+#if HAVE_PTHREADS
+    struct vd_thread *t = sh_video->dec_thread;
+    pthread_mutex_lock(&t->lock);
+    struct mp_image *mpi = NULL;
+    if (t->num_frames) {
+        mpi = t->frames[0];
+        t->num_frames--;
+        for (int n = 0; n < t->num_frames; n++)
+            t->frames[n] = t->frames[n + 1];
+        pthread_cond_broadcast(&t->wakeup);
+    } else {
+        *eof = t->eof;
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    if (mpi) {
+        struct mp_image_params params;
+        mp_image_params_from_image(&params, mpi);
+        if (!mp_image_params_equals(&params, &t->vo_params)) {
+            t->vo_params = params;
+            if (mpcodecs_reconfig_vo(sh_video, &params) < 0) {
+                talloc_free(mpi);
+                return NULL;
+            }
+        }
+    }
+    return mpi;
+#else
+    return NULL;
+#endif
+}
@@ -19,6 +19,8 @@
 #ifndef MPLAYER_DEC_VIDEO_H
 #define MPLAYER_DEC_VIDEO_H
 
+#include <stdbool.h>
+
 #include "demux/stheader.h"
 
 struct osd_state;
@@ -40,7 +42,17 @@ int set_video_colors(sh_video_t *sh_video, const char *item, int value);
 void resync_video_stream(sh_video_t *sh_video);
 void video_reinit_vo(struct sh_video *sh_video);
 int get_current_video_decoder_lag(sh_video_t *sh_video);
+double video_get_decode_time(sh_video_t *sh_video);
 int vd_control(struct sh_video *sh_video, int cmd, void *arg);
+double determine_frame_pts(sh_video_t *sh_video);
+
+bool video_start_thread(sh_video_t *sh_video, void (*wakeup)(void *ctx),
+                        void *ctx);
+void video_stop_thread(sh_video_t *sh_video);
+bool video_needs_packet(sh_video_t *sh_video);
+void video_queue_packet(sh_video_t *sh_video, struct demux_packet *packet,
+                        int drop_frame, double pts);
+struct mp_image *video_get_decoded_frame(sh_video_t *sh_video, bool *eof);
 
 extern int divx_quality;
 
@@ -32,10 +32,12 @@ typedef struct lavc_ctx {
     struct mp_image_params vo_image_params;
     AVRational last_sample_aspect_ratio;
     enum AVDiscard skip_frame;
+    enum AVDiscard skip_loop_filter;
     const char *software_fallback_decoder;
 
     // From VO
     struct mp_hwdec_info *hwdec_info;
+    struct mp_dr_pool *dr_pool;
 
     // For free use by hwdec implementation
     void *hwdec_priv;
@@ -45,6 +45,18 @@ enum vd_ctrl {
     VDCTRL_RESYNC_STREAM, // reset decode state after seeking
     VDCTRL_QUERY_UNSEEN_FRAMES, // current decoder lag
     VDCTRL_REINIT_VO, // reinit filter/VO chain
+    VDCTRL_QUERY_HWDEC, // CONTROL_TRUE if a hardware decoder is used
+};
+
+// Flags for the decode() callback, in addition to the framedrop values 1
+// (drop this frame, skip non-reference frames) and 2 (skip decoding). These
+// are set by the adaptive framedrop controller, and don't drop the decoded
+// frame itself.
+enum vd_skip_flags {
+    VD_DROP_MASK        = 3,    // the framedrop values (frame is dropped)
+    VD_SKIP_NONREF      = 4,    // don't decode non-reference frames
+    VD_SKIP_LOOPFILTER  = 8,    // skip the in-loop deblocking filter
+    VD_SKIP_NONKEY      = 16,   // decode keyframes only
 };
 
 int mpcodecs_reconfig_vo(sh_video_t *sh, const struct mp_image_params *params);
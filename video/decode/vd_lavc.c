@@ -45,6 +45,7 @@
 #include "vd.h"
 #include "video/img_format.h"
 #include "video/mp_image_pool.h"
+#include "video/dr_pool.h"
 #include "video/filter/vf.h"
 #include "demux/stheader.h"
 #include "demux/demux_packet.h"
@@ -63,12 +64,18 @@ static void init_avctx(sh_video_t *sh, const char *decoder,
                        struct vd_lavc_hwdec *hwdec);
 static void uninit_avctx(sh_video_t *sh);
 static void setup_refcounting_hw(struct AVCodecContext *s);
+#if HAVE_AVUTIL_REFCOUNTING
+static void setup_dr(sh_video_t *sh);
+#endif
 
 static enum PixelFormat get_format_hwdec(struct AVCodecContext *avctx,
                                          const enum PixelFormat *pix_fmt);
 
 static void uninit(struct sh_video *sh);
 
+// Upper limit for the decoder thread count.
+#define MAX_THREADS 32
+
 #define OPT_BASE_STRUCT struct MPOpts
 
 const m_option_t lavc_decode_opts_conf[] = {
@@ -76,8 +83,9 @@ const m_option_t lavc_decode_opts_conf[] = {
     OPT_STRING("skiploopfilter", lavc_param.skip_loop_filter_str, 0),
     OPT_STRING("skipidct", lavc_param.skip_idct_str, 0),
     OPT_STRING("skipframe", lavc_param.skip_frame_str, 0),
-    OPT_INTRANGE("threads", lavc_param.threads, 0, 0, 16),
+    OPT_INTRANGE("threads", lavc_param.threads, 0, 0, MAX_THREADS),
     OPT_FLAG_CONSTANTS("bitexact", lavc_param.bitexact, 0, 0, CODEC_FLAG_BITEXACT),
+    OPT_FLAG("dr", lavc_param.dr, 0),
     OPT_STRING("o", lavc_param.avopt, 0),
     {NULL, NULL, 0, 0, 0, 0, NULL}
 };
@@ -324,6 +332,41 @@ static void set_from_bih(AVCodecContext *avctx, uint32_t format,
     avctx->coded_height = bih->biHeight;
 }
 
+// Pick thread count and type for --vd-lavc-threads=0. Frame threading scales
+// best, but each thread adds a frame of decoder delay and keeps a frame's
+// worth of memory, so the number of threads is limited by the resolution.
+// Slice threading is limited by the number of slices per frame, which is
+// not known in advance.
+static void set_auto_threads(AVCodecContext *avctx, AVCodec *codec,
+                             int w, int h)
+{
+    int threads = default_thread_count();
+    if (threads < 1) {
+        mp_msg(MSGT_DECVIDEO, MSGL_WARN, "[VD_FFMPEG] Could not determine "
+               "thread count to use, defaulting to 1.\n");
+        threads = 1;
+    }
+    int64_t pixels = (int64_t)w * h;
+    if (codec->capabilities & CODEC_CAP_FRAME_THREADS) {
+        int max = 16;
+        if (pixels > 0 && pixels <= 1024 * 576)
+            max = 8;
+        else if (pixels > 1920 * 1088)
+            max = MAX_THREADS;
+        avctx->thread_type = FF_THREAD_FRAME;
+        avctx->thread_count = FFMIN(threads, max);
+    } else if (codec->capabilities & CODEC_CAP_SLICE_THREADS) {
+        avctx->thread_type = FF_THREAD_SLICE;
+        avctx->thread_count = FFMIN(threads, 16);
+    } else {
+        avctx->thread_count = 1;
+        return;
+    }
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "[VD_FFMPEG] Using %d %s threads.\n",
+           avctx->thread_count,
+           avctx->thread_type == FF_THREAD_FRAME ? "frame" : "slice");
+}
+
 static void init_avctx(sh_video_t *sh, const char *decoder,
                        struct vd_lavc_hwdec *hwdec)
 {
@@ -371,6 +414,8 @@ static void init_avctx(sh_video_t *sh, const char *decoder,
     } else {
 #if HAVE_AVUTIL_REFCOUNTING
         avctx->refcounted_frames = 1;
+        if (lavc_param->dr && (lavc_codec->capabilities & CODEC_CAP_DR1))
+            setup_dr(sh);
 #else
         if (lavc_codec->capabilities & CODEC_CAP_DR1) {
             ctx->do_dr1            = true;
@@ -380,16 +425,8 @@ static void init_avctx(sh_video_t *sh, const char *decoder,
 #endif
     }
 
-    if (avctx->thread_count == 0) {
-        int threads = default_thread_count();
-        if (threads < 1) {
-            mp_msg(MSGT_DECVIDEO, MSGL_WARN, "[VD_FFMPEG] Could not determine "
-                   "thread count to use, defaulting to 1.\n");
-            threads = 1;
-        }
-        threads = FFMIN(threads, 16);
-        avctx->thread_count = threads;
-    }
+    if (avctx->thread_count == 0)
+        set_auto_threads(avctx, lavc_codec, sh->disp_w, sh->disp_h);
 
     avctx->flags |= lavc_param->bitexact;
 
@@ -410,6 +447,7 @@ static void init_avctx(sh_video_t *sh, const char *decoder,
 
     // Do this after the above avopt handling in case it changes values
     ctx->skip_frame = avctx->skip_frame;
+    ctx->skip_loop_filter = avctx->skip_loop_filter;
 
     avctx->codec_tag = sh->format;
     avctx->coded_width  = sh->disp_w;
@@ -457,6 +495,8 @@ static void uninit_avctx(sh_video_t *sh)
 #if !HAVE_AVUTIL_REFCOUNTING
     mp_buffer_pool_free(&ctx->dr1_buffer_pool);
 #endif
+    mp_dr_pool_unref(ctx->dr_pool);
+    ctx->dr_pool = NULL;
     ctx->last_sample_aspect_ratio = (AVRational){0, 0};
 }
 
@@ -606,6 +646,58 @@ static void setup_refcounting_hw(AVCodecContext *avctx)
     avctx->refcounted_frames = 1;
 }
 
+// Allocate frames from the DR pool provided by the VO (or a filter), if a
+// free image with the required size and alignment is available. Can be
+// called from libavcodec worker threads.
+static int get_buffer2_dr(AVCodecContext *avctx, AVFrame *pic, int flags)
+{
+    sh_video_t *sh = avctx->opaque;
+    vd_ffmpeg_ctx *ctx = sh->context;
+
+    int imgfmt = pixfmt2imgfmt(pic->format);
+    int w = pic->width;
+    int h = pic->height;
+    int linesize_align[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(avctx, &w, &h, linesize_align);
+    int align = 1;
+    for (int n = 0; n < AV_NUM_DATA_POINTERS; n++)
+        align = FFMAX(align, linesize_align[n]);
+
+    struct mp_image *img = NULL;
+    if (imgfmt)
+        img = mp_dr_pool_get(ctx->dr_pool, imgfmt, w, h, align);
+    if (!img)
+        return avcodec_default_get_buffer2(avctx, pic, flags);
+
+    AVFrame *frame = mp_image_to_av_frame_and_unref(img);
+    for (int n = 0; n < AV_NUM_DATA_POINTERS; n++) {
+        pic->data[n] = frame->data[n];
+        pic->linesize[n] = frame->linesize[n];
+        pic->buf[n] = frame->buf[n];
+        frame->buf[n] = NULL;
+    }
+    pic->extended_data = pic->data;
+    av_frame_free(&frame);
+    return 0;
+}
+
+static void setup_dr(sh_video_t *sh)
+{
+    vd_ffmpeg_ctx *ctx = sh->context;
+    AVCodecContext *avctx = ctx->avctx;
+
+    if (!sh->vfilter ||
+        vf_control(sh->vfilter, VFCTRL_GET_DR_POOL, &ctx->dr_pool) != CONTROL_TRUE)
+    {
+        ctx->dr_pool = NULL;
+        return;
+    }
+    mp_msg(MSGT_DECVIDEO, MSGL_V, "[VD_FFMPEG] Using direct rendering.\n");
+    avctx->get_buffer2 = get_buffer2_dr;
+    // The pool images have no room for the edges libavcodec draws otherwise.
+    avctx->flags |= CODEC_FLAG_EMU_EDGE;
+}
+
 #else /* HAVE_AVUTIL_REFCOUNTING */
 
 static int get_buffer_hwdec(AVCodecContext *avctx, AVFrame *pic)
@@ -718,10 +810,14 @@ static int decode(struct sh_video *sh, struct demux_packet *packet,
 
     if (flags & 2)
         avctx->skip_frame = AVDISCARD_ALL;
-    else if (flags & 1)
-        avctx->skip_frame = AVDISCARD_NONREF;
+    else if (flags & VD_SKIP_NONKEY)
+        avctx->skip_frame = FFMAX(ctx->skip_frame, AVDISCARD_NONKEY);
+    else if (flags & (1 | VD_SKIP_NONREF))
+        avctx->skip_frame = FFMAX(ctx->skip_frame, AVDISCARD_NONREF);
     else
         avctx->skip_frame = ctx->skip_frame;
+    avctx->skip_loop_filter = flags & VD_SKIP_LOOPFILTER ?
+                              AVDISCARD_ALL : ctx->skip_loop_filter;
 
     mp_set_av_packet(&pkt, packet);
 
@@ -751,7 +847,9 @@ static int decode(struct sh_video *sh, struct demux_packet *packet,
     mp_image_params_from_image(&vo_params, mpi);
 
     if (!mp_image_params_equals(&vo_params, &ctx->vo_image_params)) {
-        if (mpcodecs_reconfig_vo(sh, &vo_params) < 0) {
+        // With a decoder thread, the player reconfigures the filters when it
+        // picks up the frame (see video_get_decoded_frame()).
+        if (!sh->dec_thread && mpcodecs_reconfig_vo(sh, &vo_params) < 0) {
             talloc_free(mpi);
             return -1;
         }
@@ -815,6 +913,8 @@ static int control(sh_video_t *sh, int cmd, void *arg)
     case VDCTRL_GET_PARAMS:
         *(struct mp_image_params *)arg = ctx->vo_image_params;
         return ctx->vo_image_params.imgfmt ? true : CONTROL_NA;
+    case VDCTRL_QUERY_HWDEC:
+        return ctx->hwdec ? CONTROL_TRUE : CONTROL_FALSE;
     }
     return CONTROL_UNKNOWN;
 }
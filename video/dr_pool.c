@@ -0,0 +1,265 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+// Pool of image buffers for direct rendering. The VO (or a filter) creates
+// the pool and adds buffers it can display without copying them (e.g. shared
+// memory images). The decoder allocates its frames from the pool, and falls
+// back to normal memory if no suitable buffer is free. Failed allocations are
+// recorded, so that the owner can add buffers with the right parameters.
+//
+// Thread-safety: mp_dr_pool_get(), mp_dr_pool_ref() and mp_dr_pool_unref() can
+// be called from any thread, and so can the destructors of the returned
+// images. The other functions are meant to be called by the pool owner only.
+// The free callbacks passed to mp_dr_pool_add() can be called from any thread.
+
+#include "config.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+#if HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
+#include "talloc.h"
+
+#include "mpvcore/mp_common.h"
+#include "video/mp_image.h"
+
+#include "dr_pool.h"
+
+#if HAVE_PTHREADS
+#define pool_lock(p) pthread_mutex_lock(&(p)->lock)
+#define pool_unlock(p) pthread_mutex_unlock(&(p)->lock)
+#else
+#define pool_lock(p) do {} while (0)
+#define pool_unlock(p) do {} while (0)
+#endif
+
+struct dr_buffer {
+    struct mp_dr_pool *pool;
+    struct mp_image img;        // describes the buffer, not refcounted
+    void *priv;
+    void (*free)(void *priv);
+    bool in_use;                // referenced by an image returned to the user
+    bool retired;               // removed by mp_dr_pool_clear() while in use
+};
+
+struct mp_dr_pool {
+#if HAVE_PTHREADS
+    pthread_mutex_t lock;
+#endif
+    // Protected by lock
+    int refcount;               // users + buffers in use
+    struct dr_buffer **buffers;
+    int num_buffers;
+    struct mp_dr_request request;
+};
+
+static void free_buffer(struct dr_buffer *buf)
+{
+    if (buf->free)
+        buf->free(buf->priv);
+    talloc_free(buf);
+}
+
+struct mp_dr_pool *mp_dr_pool_new(void)
+{
+    struct mp_dr_pool *pool = talloc_ptrtype(NULL, pool);
+    *pool = (struct mp_dr_pool) {
+        .refcount = 1,
+    };
+#if HAVE_PTHREADS
+    pthread_mutex_init(&pool->lock, NULL);
+#endif
+    return pool;
+}
+
+struct mp_dr_pool *mp_dr_pool_ref(struct mp_dr_pool *pool)
+{
+    pool_lock(pool);
+    assert(pool->refcount > 0);
+    pool->refcount++;
+    pool_unlock(pool);
+    return pool;
+}
+
+void mp_dr_pool_unref(struct mp_dr_pool *pool)
+{
+    if (!pool)
+        return;
+    pool_lock(pool);
+    assert(pool->refcount > 0);
+    bool dead = --pool->refcount == 0;
+    pool_unlock(pool);
+    if (!dead)
+        return;
+    // No buffer can be in use at this point.
+    for (int n = 0; n < pool->num_buffers; n++)
+        free_buffer(pool->buffers[n]);
+#if HAVE_PTHREADS
+    pthread_mutex_destroy(&pool->lock);
+#endif
+    talloc_free(pool);
+}
+
+static bool image_is_aligned(struct mp_image *img, int align)
+{
+    for (int n = 0; n < img->num_planes; n++) {
+        if ((uintptr_t)img->planes[n] % align || img->stride[n] % align)
+            return false;
+    }
+    return true;
+}
+
+static void release_buffer(void *arg)
+{
+    struct dr_buffer *buf = arg;
+    struct mp_dr_pool *pool = buf->pool;
+    bool remove = false;
+    pool_lock(pool);
+    assert(buf->in_use);
+    buf->in_use = false;
+    if (buf->retired) {
+        for (int n = 0; n < pool->num_buffers; n++) {
+            if (pool->buffers[n] == buf) {
+                MP_TARRAY_REMOVE_AT(pool->buffers, pool->num_buffers, n);
+                break;
+            }
+        }
+        remove = true;
+    }
+    pool_unlock(pool);
+    if (remove)
+        free_buffer(buf);
+    mp_dr_pool_unref(pool);
+}
+
+// Return a free buffer with the given format and size, whose planes and strides
+// are aligned to align bytes. Returns NULL if there is none. The image can be
+// free'd with talloc_free().
+struct mp_image *mp_dr_pool_get(struct mp_dr_pool *pool, int imgfmt,
+                                int w, int h, int align)
+{
+    struct dr_buffer *buf = NULL;
+    pool_lock(pool);
+    for (int n = 0; n < pool->num_buffers; n++) {
+        struct dr_buffer *cur = pool->buffers[n];
+        if (!cur->in_use && !cur->retired && cur->img.imgfmt == imgfmt &&
+            cur->img.w == w && cur->img.h == h &&
+            image_is_aligned(&cur->img, align))
+        {
+            buf = cur;
+            break;
+        }
+    }
+    if (buf) {
+        buf->in_use = true;
+        pool->refcount++;
+    } else {
+        struct mp_dr_request *req = &pool->request;
+        if (req->imgfmt != imgfmt || req->w != w || req->h != h ||
+            req->align != align)
+        {
+            *req = (struct mp_dr_request) {imgfmt, w, h, align};
+        }
+        req->count++;
+    }
+    pool_unlock(pool);
+    if (!buf)
+        return NULL;
+    return mp_image_new_custom_ref(&buf->img, buf, release_buffer);
+}
+
+// Return the parameters of the last failed allocations, and reset the failure
+// count. Returns false if no allocation failed since the last call.
+bool mp_dr_pool_get_request(struct mp_dr_pool *pool, struct mp_dr_request *req)
+{
+    pool_lock(pool);
+    *req = pool->request;
+    pool->request.count = 0;
+    pool_unlock(pool);
+    return req->count > 0;
+}
+
+// Add a buffer described by img (only format, size, planes and strides are
+// used). free is called with priv when the buffer is removed from the pool
+// and not in use anymore.
+void mp_dr_pool_add(struct mp_dr_pool *pool, struct mp_image *img,
+                    void *priv, void (*free)(void *priv))
+{
+    struct dr_buffer *buf = talloc_ptrtype(NULL, buf);
+    *buf = (struct dr_buffer) {
+        .pool = pool,
+        .img = *img,
+        .priv = priv,
+        .free = free,
+    };
+    buf->img.refcount = NULL;
+    pool_lock(pool);
+    MP_TARRAY_APPEND(pool, pool->buffers, pool->num_buffers, buf);
+    pool_unlock(pool);
+}
+
+// If img references a buffer in the pool (which was not removed by
+// mp_dr_pool_clear()), return the priv value of that buffer, else NULL.
+void *mp_dr_pool_lookup(struct mp_dr_pool *pool, struct mp_image *img)
+{
+    void *priv = NULL;
+    pool_lock(pool);
+    for (int n = 0; n < pool->num_buffers; n++) {
+        struct dr_buffer *buf = pool->buffers[n];
+        if (buf->retired || buf->img.imgfmt != img->imgfmt)
+            continue;
+        bool match = true;
+        for (int p = 0; p < img->num_planes; p++) {
+            match &= buf->img.planes[p] == img->planes[p] &&
+                     buf->img.stride[p] == img->stride[p];
+        }
+        if (match) {
+            priv = buf->priv;
+            break;
+        }
+    }
+    pool_unlock(pool);
+    return priv;
+}
+
+// Remove all buffers from the pool. Buffers still in use are free'd when the
+// last image referencing them is released.
+void mp_dr_pool_clear(struct mp_dr_pool *pool)
+{
+    struct dr_buffer **unused = NULL;
+    int num_unused = 0;
+    pool_lock(pool);
+    for (int n = pool->num_buffers - 1; n >= 0; n--) {
+        struct dr_buffer *buf = pool->buffers[n];
+        if (buf->in_use) {
+            buf->retired = true;
+        } else {
+            MP_TARRAY_APPEND(NULL, unused, num_unused, buf);
+            MP_TARRAY_REMOVE_AT(pool->buffers, pool->num_buffers, n);
+        }
+    }
+    pool->request = (struct mp_dr_request) {0};
+    pool_unlock(pool);
+    for (int n = 0; n < num_unused; n++)
+        free_buffer(unused[n]);
+    talloc_free(unused);
+}
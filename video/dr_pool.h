@@ -0,0 +1,49 @@
+/*
+ * This file is part of mpv.
+ *
+ * mpv is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * mpv is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with mpv; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MPV_DR_POOL_H
+#define MPV_DR_POOL_H
+
+#include <stdbool.h>
+
+struct mp_image;
+struct mp_dr_pool;
+
+// Parameters of the images the decoder failed to get from the pool.
+struct mp_dr_request {
+    int imgfmt;
+    int w, h;
+    int align;          // required alignment of plane pointers and strides
+    int count;          // number of failed mp_dr_pool_get() calls
+};
+
+struct mp_dr_pool *mp_dr_pool_new(void);
+struct mp_dr_pool *mp_dr_pool_ref(struct mp_dr_pool *pool);
+void mp_dr_pool_unref(struct mp_dr_pool *pool);
+
+struct mp_image *mp_dr_pool_get(struct mp_dr_pool *pool, int imgfmt,
+                                int w, int h, int align);
+
+bool mp_dr_pool_get_request(struct mp_dr_pool *pool,
+                            struct mp_dr_request *req);
+void mp_dr_pool_add(struct mp_dr_pool *pool, struct mp_image *img,
+                    void *priv, void (*free)(void *priv));
+void *mp_dr_pool_lookup(struct mp_dr_pool *pool, struct mp_image *img);
+void mp_dr_pool_clear(struct mp_dr_pool *pool);
+
+#endif
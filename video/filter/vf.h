@@ -108,6 +108,7 @@ enum vf_ctrl {
      * access OSD/subtitle state outside of normal OSD draw time. */
     VFCTRL_SET_OSD_OBJ,
     VFCTRL_GET_HWDEC_INFO,   // for hwdec filters
+    VFCTRL_GET_DR_POOL,      // for direct rendering (struct mp_dr_pool**)
 };
 
 int vf_control(struct vf_instance *vf, int cmd, void *arg);
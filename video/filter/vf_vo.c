@@ -85,6 +85,8 @@ static int control(struct vf_instance *vf, int request, void *data)
     }
     case VFCTRL_GET_HWDEC_INFO:
         return vo_control(video_out, VOCTRL_GET_HWDEC_INFO, data) == VO_TRUE;
+    case VFCTRL_GET_DR_POOL:
+        return vo_control(video_out, VOCTRL_GET_DR_POOL, data) == VO_TRUE;
     }
     return CONTROL_UNKNOWN;
 }
@@ -53,6 +53,9 @@ enum mp_voctrl {
     /* for hardware decoding */
     VOCTRL_GET_HWDEC_INFO,              // struct mp_hwdec_info*
 
+    /* for direct rendering; returns a new reference to the VO's pool */
+    VOCTRL_GET_DR_POOL,                 // struct mp_dr_pool**
+
     VOCTRL_NEWFRAME,
     VOCTRL_SKIPFRAME,
     VOCTRL_REDRAW_FRAME,
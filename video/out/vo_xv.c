@@ -47,6 +47,7 @@
 #include "vo.h"
 #include "video/vfcap.h"
 #include "video/mp_image.h"
+#include "video/dr_pool.h"
 #include "video/img_fourcc.h"
 #include "x11_common.h"
 #include "video/memcpy_pic.h"
@@ -63,6 +64,9 @@ static const vo_info_t info = {
     ""
 };
 
+// Maximum number of shared memory images used for direct rendering.
+#define MAX_DR_BUFFERS 24
+
 #define CK_METHOD_NONE       0 // no colorkey drawing
 #define CK_METHOD_BACKGROUND 1 // set colorkey as window background
 #define CK_METHOD_AUTOPAINT  2 // let xv draw the colorkey
@@ -99,6 +103,21 @@ struct xvctx {
 #ifdef HAVE_SHM
     XShmSegmentInfo Shminfo[2];
     int Shm_Warned_Slow;
+#endif
+    // Direct rendering: the decoder renders into shared memory images, which
+    // are displayed without copying them (unless OSD has to be drawn).
+    struct mp_dr_pool *dr_pool;
+    struct xv_dr_buffer *dr_buffers[MAX_DR_BUFFERS];
+    int num_dr_buffers;
+    bool dr_failed;             // server-allocated images are unusable
+    XvImage *dr_xvimage;        // DR image of the current frame, or NULL
+    struct mp_draw_sub_cache *osd_cache;
+};
+
+struct xv_dr_buffer {
+    XvImage *xvimage;
+#ifdef HAVE_SHM
+    XShmSegmentInfo shminfo;
 #endif
 };
 
@@ -117,6 +136,7 @@ static const struct fmt_entry fmt_table[] = {
 static void allocate_xvimage(struct vo *, int);
 static void deallocate_xvimage(struct vo *vo, int foo);
 static struct mp_image get_xv_buffer(struct vo *vo, int buf_index);
+static void clear_dr_buffers(struct vo *vo);
 
 static int find_xv_format(int imgfmt)
 {
@@ -433,6 +453,7 @@ static int config(struct vo *vo, uint32_t width, uint32_t height,
     int i;
 
     mp_image_unrefp(&ctx->original_image);
+    clear_dr_buffers(vo);
 
     ctx->image_height = height;
     ctx->image_width = width;
@@ -576,10 +597,9 @@ static inline void put_xvimage(struct vo *vo, XvImage *xvi)
     }
 }
 
-static struct mp_image get_xv_buffer(struct vo *vo, int buf_index)
+static struct mp_image get_xv_image(struct vo *vo, XvImage *xv_image)
 {
     struct xvctx *ctx = vo->priv;
-    XvImage *xv_image = ctx->xvimage[buf_index];
 
     struct mp_image img = {0};
     mp_image_set_size(&img, ctx->image_width, ctx->image_height);
@@ -597,11 +617,142 @@ static struct mp_image get_xv_buffer(struct vo *vo, int buf_index)
     return img;
 }
 
-static void draw_osd(struct vo *vo, struct osd_state *osd)
+static struct mp_image get_xv_buffer(struct vo *vo, int buf_index)
 {
     struct xvctx *ctx = vo->priv;
+    return get_xv_image(vo, ctx->xvimage[buf_index]);
+}
+
+#ifdef HAVE_SHM
+
+// Called by the image pool, possibly from another thread. The X side of the
+// buffer was already released by clear_dr_buffers().
+static void free_dr_buffer(void *p)
+{
+    struct xv_dr_buffer *buf = p;
+    shmdt(buf->shminfo.shmaddr);
+    talloc_free(buf);
+}
+
+static struct xv_dr_buffer *create_dr_buffer(struct vo *vo, int w, int h)
+{
+    struct xvctx *ctx = vo->priv;
+    struct vo_x11_state *x11 = vo->x11;
+    struct xv_dr_buffer *buf = talloc_zero(NULL, struct xv_dr_buffer);
+    buf->xvimage = (XvImage *) XvShmCreateImage(x11->display, ctx->xv_port,
+                                                ctx->xv_format, NULL, w, h,
+                                                &buf->shminfo);
+    if (!buf->xvimage)
+        goto error;
+    buf->shminfo.shmid = shmget(IPC_PRIVATE, buf->xvimage->data_size,
+                                IPC_CREAT | 0777);
+    if (buf->shminfo.shmid < 0)
+        goto error;
+    buf->shminfo.shmaddr = (char *) shmat(buf->shminfo.shmid, 0, 0);
+    shmctl(buf->shminfo.shmid, IPC_RMID, 0);
+    if (buf->shminfo.shmaddr == (char *) -1)
+        goto error;
+    buf->shminfo.readOnly = False;
+    buf->xvimage->data = buf->shminfo.shmaddr;
+    XShmAttach(x11->display, &buf->shminfo);
+    XSync(x11->display, False);
+    return buf;
+
+error:
+    if (buf->xvimage)
+        XFree(buf->xvimage);
+    talloc_free(buf);
+    return NULL;
+}
+
+// Add the images the decoder asked for since the last call.
+static void add_dr_buffers(struct vo *vo)
+{
+    struct xvctx *ctx = vo->priv;
+    struct mp_dr_request req;
+    if (!ctx->dr_pool || !mp_dr_pool_get_request(ctx->dr_pool, &req))
+        return;
+    if (!ctx->Shmem_Flag || ctx->dr_failed || req.imgfmt != IMGFMT_420P ||
+        req.imgfmt != ctx->image_format || req.w < ctx->image_width ||
+        req.h < ctx->image_height)
+        return;
+    for (int n = 0; n < req.count && ctx->num_dr_buffers < MAX_DR_BUFFERS; n++)
+    {
+        struct xv_dr_buffer *buf = create_dr_buffer(vo, req.w, req.h);
+        if (!buf)
+            break;
+        struct mp_image img = get_xv_image(vo, buf->xvimage);
+        mp_image_set_size(&img, req.w, req.h);
+        bool aligned = true;
+        for (int p = 0; p < img.num_planes; p++) {
+            aligned &= (uintptr_t)img.planes[p] % req.align == 0 &&
+                       img.stride[p] % req.align == 0;
+        }
+        if (!aligned) {
+            MP_VERBOSE(vo, "Xv image layout not usable for direct "
+                       "rendering.\n");
+            ctx->dr_failed = true;
+            XShmDetach(vo->x11->display, &buf->shminfo);
+            XFree(buf->xvimage);
+            free_dr_buffer(buf);
+            break;
+        }
+        ctx->dr_buffers[ctx->num_dr_buffers++] = buf;
+        mp_dr_pool_add(ctx->dr_pool, &img, buf, free_dr_buffer);
+    }
+}
+
+// Remove all DR images. Images still referenced by the decoder remain
+// mapped until they are released, but are not displayed directly anymore.
+static void clear_dr_buffers(struct vo *vo)
+{
+    struct xvctx *ctx = vo->priv;
+    if (!ctx->dr_pool)
+        return;
+    for (int n = 0; n < ctx->num_dr_buffers; n++) {
+        struct xv_dr_buffer *buf = ctx->dr_buffers[n];
+        XShmDetach(vo->x11->display, &buf->shminfo);
+        XFree(buf->xvimage);
+        buf->xvimage = NULL;
+    }
+    XSync(vo->x11->display, False);
+    ctx->num_dr_buffers = 0;
+    ctx->dr_xvimage = NULL;
+    ctx->dr_failed = false;
+    mp_dr_pool_clear(ctx->dr_pool);
+}
+
+#else /* HAVE_SHM */
+
+static void add_dr_buffers(struct vo *vo)
+{
+}
+
+static void clear_dr_buffers(struct vo *vo)
+{
+}
+
+#endif /* HAVE_SHM */
+
+static void draw_osd_cb(void *pctx, struct sub_bitmaps *imgs)
+{
+    struct vo *vo = pctx;
+    struct xvctx *ctx = vo->priv;
+
+    // The DR image is still used by the decoder, so render the OSD on a copy.
+    if (ctx->dr_xvimage) {
+        struct mp_image xv_buffer = get_xv_buffer(vo, ctx->current_buf);
+        mp_image_copy(&xv_buffer, ctx->original_image);
+        ctx->dr_xvimage = NULL;
+    }
 
     struct mp_image img = get_xv_buffer(vo, ctx->current_buf);
+    mp_draw_sub_bitmaps(&ctx->osd_cache, &img, imgs);
+}
+
+static void draw_osd(struct vo *vo, struct osd_state *osd)
+{
+    struct xvctx *ctx = vo->priv;
 
     struct mp_osd_res res = {
         .w = ctx->image_width,
@@ -610,7 +761,7 @@ static void draw_osd(struct vo *vo, struct osd_state *osd)
         .video_par = vo->aspdat.par,
     };
 
-    osd_draw_on_image(osd, res, osd->vo_pts, 0, &img);
+    osd_draw(osd, res, osd->vo_pts, 0, mp_draw_sub_formats, draw_osd_cb, vo);
 }
 
 static void wait_for_completion(struct vo *vo, int max_outstanding)
@@ -635,10 +786,14 @@ static void wait_for_completion(struct vo *vo, int max_outstanding)
 static void flip_page(struct vo *vo)
 {
     struct xvctx *ctx = vo->priv;
-    put_xvimage(vo, ctx->xvimage[ctx->current_buf]);
+    if (ctx->dr_xvimage) {
+        put_xvimage(vo, ctx->dr_xvimage);
+    } else {
+        put_xvimage(vo, ctx->xvimage[ctx->current_buf]);
 
-    /* remember the currently visible buffer */
-    ctx->current_buf = (ctx->current_buf + 1) % ctx->num_buffers;
+        /* remember the currently visible buffer */
+        ctx->current_buf = (ctx->current_buf + 1) % ctx->num_buffers;
+    }
 
     if (!ctx->Shmem_Flag)
         XSync(vo->x11->display, False);
@@ -658,16 +813,28 @@ static void draw_image(struct vo *vo, mp_image_t *mpi)
 {
     struct xvctx *ctx = vo->priv;
 
-    wait_for_completion(vo, ctx->num_buffers - 1);
+    // A previous DR image is released below, and must not be in use by the
+    // X server anymore.
+    wait_for_completion(vo, ctx->dr_xvimage ? 0 : ctx->num_buffers - 1);
 
-    struct mp_image xv_buffer = get_xv_buffer(vo, ctx->current_buf);
-    if (mpi) {
-        mp_image_copy(&xv_buffer, mpi);
+    struct xv_dr_buffer *dr = NULL;
+    if (mpi && ctx->dr_pool)
+        dr = mp_dr_pool_lookup(ctx->dr_pool, mpi);
+    if (dr) {
+        ctx->dr_xvimage = dr->xvimage;
     } else {
-        mp_image_clear(&xv_buffer, 0, 0, xv_buffer.w, xv_buffer.h);
+        ctx->dr_xvimage = NULL;
+        struct mp_image xv_buffer = get_xv_buffer(vo, ctx->current_buf);
+        if (mpi) {
+            mp_image_copy(&xv_buffer, mpi);
+        } else {
+            mp_image_clear(&xv_buffer, 0, 0, xv_buffer.w, xv_buffer.h);
+        }
     }
 
     mp_image_setrefp(&ctx->original_image, mpi);
+
+    add_dr_buffers(vo);
 }
 
 static int redraw_frame(struct vo *vo)
@@ -700,6 +867,9 @@ static void uninit(struct vo *vo)
     int i;
 
     talloc_free(ctx->original_image);
+    clear_dr_buffers(vo);
+    mp_dr_pool_unref(ctx->dr_pool);
+    talloc_free(ctx->osd_cache);
 
     if (ctx->ai)
         XvFreeAdaptorInfo(ctx->ai);
@@ -852,6 +1022,15 @@ static int control(struct vo *vo, uint32_t request, void *data)
     case VOCTRL_REDRAW_FRAME:
         redraw_frame(vo);
         return true;
+#ifdef HAVE_SHM
+    case VOCTRL_GET_DR_POOL:
+        if (!vo->x11->display_is_local || !XShmQueryExtension(vo->x11->display))
+            return VO_NOTAVAIL;
+        if (!ctx->dr_pool)
+            ctx->dr_pool = mp_dr_pool_new();
+        *(struct mp_dr_pool **)data = mp_dr_pool_ref(ctx->dr_pool);
+        return VO_TRUE;
+#endif
     case VOCTRL_SCREENSHOT: {
         struct voctrl_screenshot_args *args = data;
         args->out_image = get_screenshot(vo);